@@ -1,18 +1,59 @@
+#include <setjmp.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
 
 //---- enum & typedef ----
 
 typedef struct Token Token;
 typedef struct LVar LVar;
 typedef struct Function Function;
-typedef struct Node Node;
 typedef struct Type Type;
+typedef struct Arena Arena;
+typedef struct ArenaChunk ArenaChunk;
+typedef struct HashMap HashMap;
+typedef struct Scope Scope;
+typedef struct OutBuf OutBuf;
+typedef struct Inst Inst;
+typedef struct Reloc Reloc;
 
 typedef enum {
-	TK_RESERVED, // 記号
 	TK_IDENT, // 識別子
 	TK_NUM, // 整数トークン
-	TK_IF, // ifトークン
+
+	// 予約語
+	TK_RETURN, // return
+	TK_IF, // if
+	TK_ELSE, // else
+	TK_WHILE, // while
+	TK_FOR, // for
+	TK_INT, // int
+	TK_SIZEOF, // sizeof
+
+	// 記号
+	TK_PLUS, // +
+	TK_MINUS, // -
+	TK_STAR, // *
+	TK_SLASH, // /
+	TK_LPAREN, // (
+	TK_RPAREN, // )
+	TK_LBRACE, // {
+	TK_RBRACE, // }
+	TK_LBRACKET, // [
+	TK_RBRACKET, // ]
+	TK_SEMI, // ;
+	TK_COMMA, // ,
+	TK_AMP, // &
+	TK_ASSIGN, // =
+	TK_LT, // <
+	TK_GT, // >
+	TK_EQ, // ==
+	TK_NE, // !=
+	TK_LE, // <=
+	TK_GE, // >=
+
 	TK_EOF, // 入力終わりトークン
 } TokenKind;
 
@@ -22,6 +63,89 @@ typedef enum {
 	TY_ARRAY, // 配列型
 } TypeKind;
 
+// x86-64の汎用レジスタ (命令エンコーディングの番号順)
+typedef enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+} Reg;
+
+// 命令の種類。codegenはこの命令列を作り、テキストか機械語に変換する。
+typedef enum {
+	IN_LABEL, // ラベル
+	IN_PUSH, // push dst / push imm
+	IN_POP, // pop dst
+	IN_MOV, // mov dst, src / mov dst, imm
+	IN_ADD, // add dst, src / add dst, imm
+	IN_SUB, // sub dst, src / sub dst, imm
+	IN_IMUL, // imul dst, src / imul dst, imm
+	IN_AND, // and dst, src / and dst, imm
+	IN_SHL, // shl dst, imm
+	IN_SAR, // sar dst, imm
+	IN_SHR, // shr dst, imm
+	IN_LEA, // lea dst, [dst+src*val] (valは1, 2, 4, 8)
+	IN_CMP, // cmp dst, src / cmp dst, imm
+	IN_LOAD, // mov dst, [src+imm]
+	IN_STORE, // mov [dst+imm], src
+	IN_CQO, // cqo
+	IN_IDIV, // idiv dst
+	IN_MULH, // imul dst (rdx:rax = rax * dst)
+	IN_SETE, // sete dst8; movzb dst, dst8
+	IN_SETNE, // setne dst8; movzb dst, dst8
+	IN_SETL, // setl dst8; movzb dst, dst8
+	IN_SETLE, // setle dst8; movzb dst, dst8
+	IN_JMP, // jmp label
+	IN_JE, // je label
+	IN_JNE, // jne label
+	IN_JL, // jl label
+	IN_JLE, // jle label
+	IN_JG, // jg label
+	IN_JGE, // jge label
+	IN_CALL, // call sym
+	IN_RET, // ret
+	IN_NOP, // 何もしない (peepholeで消した命令。出力の前に取り除く)
+} InstKind;
+
+// ラベルの種類。ラベル番号は 連番 * NUM_LABEL_KINDS + 種類。
+typedef enum {
+	L_BEGIN, // .Lbegin<n>
+	L_END, // .Lend<n>
+	L_ELSE, // .Lelse<n>
+	L_RETURN, // .Lreturn (関数に1つ)
+	NUM_LABEL_KINDS,
+} LabelKind;
+
+// 中間表現の命令の種類 (-O1以上)
+typedef enum {
+	IR_IMM, // dst = imm
+	IR_MOV, // dst = a
+	IR_ADD, // dst = a + b
+	IR_SUB, // dst = a - b
+	IR_MUL, // dst = a * b
+	IR_DIV, // dst = a / b
+	IR_EQ, // dst = a == b
+	IR_NE, // dst = a != b
+	IR_LT, // dst = a < b
+	IR_LE, // dst = a <= b
+	IR_ADDR, // dst = &var
+	IR_LOAD, // dst = *a
+	IR_STORE, // *a = b
+	IR_LOADVAR, // dst = var (メモリに置く変数)
+	IR_STOREVAR, // var = a (メモリに置く変数)
+	IR_LABEL, // label:
+	IR_JMP, // goto label
+	IR_BR, // if(!(a cond b)) goto label
+	IR_CALL, // dst = sym(args...)
+	IR_PARAM, // dst (またはvar) = imm番目の引数
+	IR_RET, // return a (aがなければ0)
+	IR_NOP, // 何もしない (ssa.cで消した命令。命令列に戻す前に取り除く)
+} IrOp;
+
+// 出力の形式
+typedef enum {
+	OUT_ASM, // アセンブリのテキスト
+	OUT_OBJ, // ELFの再配置可能オブジェクト (-c)
+} OutFormat;
+
 // トークン型
 
 struct Token {
@@ -55,47 +179,150 @@ typedef enum {
 	ND_FOR, // for
 	ND_BLOCK, // {...}
 	ND_FUNCCALL, // function call
+	ND_INLINE, // インライン展開した関数の本体
 	ND_NULL, 
 } NodeKind;
 
-// 抽象構文木のノードの型
-struct Node {
-	NodeKind kind; // ノードの型
-	Node *next; // next node (for block)
-	Type *ty; // type
-
-	Node *lhs; // 左辺
-	Node *rhs; // 右辺
-	Node *cond; // 条件式
-	Node *then; // 条件を満たした場合の処理
-	Node *els; // 条件を満たさなかった場合の処理
-	Node *init; // forの初期化処理
-	Node *inc; // forのincrement処理
-	Node *body; // block
-	char *funcname; // 関数名
-	Node *args; // 引数
-	int val; // kindがND_NUMのとき、その数値
-	LVar *lvar; // kindがND_LVARのとき、lvarへのポインタ
-	int offset; // kindがND_LVARのとき、RBPからのoffset
+// 抽象構文木のノード。ast中の番号で指す。0は「ノードなし」。
+typedef int NodeId;
+
+// 抽象構文木
+//
+// ノードの種類ごとの中身をlhsとrhsの2つの整数に詰め、全ノード分を
+// 配列で持つ。子が3つ以上あるノードや並びはextraに置く。
+// 子は必ず親より先に作るので、番号順に処理すれば子が親より先に来る。
+//
+//   種類                    lhs               rhs
+//   2項演算, ND_ASSIGN      左辺              右辺
+//   ND_ADDR, ND_DEREF,
+//   ND_RETURN               子
+//   ND_NUM                  値
+//   ND_LVAR                 varsの番号
+//   ND_IF                   条件式            extra: then, els
+//   ND_WHILE                条件式            本体
+//   ND_FOR                  extra: init, cond, inc, 本体
+//   ND_BLOCK                extra: 文の数, 文...
+//   ND_FUNCCALL             funcsの番号       extra: 引数の数, 引数...
+//   ND_INLINE               extra: 文の数, 文...  結果を入れる変数 (varsの番号)
+typedef struct {
+	unsigned char *kind; // NodeKind
+	Type **ty; // 型。add_typeで付ける。
+	int *lhs;
+	int *rhs;
+	int len; // 使用済みのノード番号の数 (0番を含む)
+	int cap;
+	int ntyped; // add_typeで型を付け終えたノード番号の数
+
+	int *extra;
+	int nextra;
+	int cap_extra;
+
+	LVar **vars; // ND_LVARが指す変数
+	int nvars;
+	int cap_vars;
+
+	char **funcs; // ND_FUNCCALLの関数名
+	int nfuncs;
+	int cap_funcs;
+
+	size_t nalloc; // 配列の確保回数
+	size_t total; // これまでに確保した総バイト数
+	size_t reserved; // 配列として確保しているバイト数
+	size_t peak_reserved; // reservedのピーク
+} Ast;
+
+
+// 伸長する出力バッファ
+struct OutBuf{
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+// 1つの命令
+struct Inst{
+	InstKind kind;
+	Reg dst;
+	Reg src;
+	bool imm; // 最後のオペランドが即値 (val)
+	long val; // 即値またはディスプレースメント
+	int label; // IN_LABELとジャンプのラベル番号
+	char *sym; // IN_CALLの関数名
+};
+
+// 中間表現の1命令。a, b, dstは仮想レジスタの番号で、使わなければ-1。
+typedef struct {
+	IrOp op;
+	int dst;
+	int a;
+	int b;
+	bool bimm; // bの代わりにimmを使う
+	bool exact; // IR_DIVで割り切れると分かっている (ポインタの差)
+	long imm;
+	IrOp cond; // IR_BRの比較 (IR_EQ, IR_NE, IR_LT, IR_LE)
+	int label; // IR_LABEL, IR_JMP, IR_BRのラベル番号
+	LVar *var; // IR_ADDR, IR_LOADVAR, IR_STOREVAR, IR_PARAMの変数
+	char *sym; // IR_CALLの関数名
+	int *args; // IR_CALLの引数
+	int nargs;
+} Ir;
+
+// 1つの関数の中間表現。仮想レジスタ0..nvars-1はレジスタに置ける変数。
+typedef struct {
+	Ir *code;
+	int len;
+	int cap;
+	int nvregs;
+	int nvars;
+} IrFunc;
+
+// 機械語中の外部シンボルへの参照 (call rel32)
+struct Reloc{
+	int offset; // 関数の先頭からのrel32の位置
+	char *sym;
 };
 
 // ローカル変数の型
 struct LVar{
 	LVar *next; // 次のローカル変数
-	char *name; // ローカル変数の名前
+	char *name; // ローカル変数の名前 (intern済み)
 	int len; // 変数名の長さ
 	Type *ty;
 	int offset; // RBPからのオフセット
+	int id; // ast.varsの番号
+	int vreg; // -O1以上で割り当てた仮想レジスタ。-1ならメモリに置く。
+
+	Scope *scope; // 宣言されたスコープ
+	LVar *shadow; // 同名の外側のスコープの変数
+	LVar *scope_next; // 同じスコープで宣言された次の変数
+};
+
+// ブロックスコープ
+struct Scope{
+	Scope *parent;
+	LVar *vars; // このスコープで宣言された変数
 };
 
 // 関数型
 struct Function{
 	Function *next;
 	char *name;
-	Node *node;
+	int body; // 文の並び (ast.extraの位置。ND_BLOCKと同じ形)
+	NodeId node_begin; // 本体のノード番号の範囲 [node_begin, node_end)
+	NodeId node_end;
 	LVar *locals;
-	LVar *params;
-	int stack_size;
+	LVar **params; // 引数 (宣言順)
+	int nparams;
+	int stack_size; // ローカル変数の領域 (16の倍数)
+	Inst *insts; // 生成した命令列
+	int ninsts;
+	int nlabels; // ラベル番号の上限
+	OutBuf out; // 生成したアセンブリ、または-cのときは機械語
+	Reloc *relocs; // -cのときのoutの再配置情報
+	int nrelocs;
+	bool cached; // outをキャッシュから読み込んだ
+	unsigned long cache_key;
+	long cost_ns; // パースとコード生成にかかった時間
 };
 
 // "型"の型
@@ -106,6 +333,68 @@ struct Type{
 	int array_len;
 };
 
+// アリーナのチャンク
+struct ArenaChunk{
+	ArenaChunk *next;
+	size_t cap; // dataの大きさ
+	size_t used; // 使用済みバイト数
+	char data[];
+};
+
+// ハッシュ表のエントリ。keyがNULLなら空き。
+typedef struct {
+	char *key;
+	int keylen;
+	void *val;
+} HashEntry;
+
+// 開番地法のハッシュ表
+struct HashMap{
+	HashEntry *buckets;
+	int capacity; // 2のべき乗
+	int used;
+};
+
+// バンプポインタ式のアリーナ。まとめて解放する。
+struct Arena{
+	char *name;
+	ArenaChunk *chunk; // 現在のチャンク (先頭)
+	size_t used; // 確保済みバイト数
+	size_t reserved; // チャンクとして確保したバイト数
+	size_t peak; // usedのピーク
+	size_t peak_reserved; // reservedのピーク
+	size_t nalloc; // 確保回数
+	size_t total; // これまでに確保した総バイト数
+};
+
+// --time-report で計測するフェーズ
+typedef enum {
+	PH_TOKENIZE,
+	PH_PARSE,
+	PH_TYPE, // add_type
+	PH_FOLD, // 定数畳み込み
+	PH_SSA, // SSA形式での最適化
+	PH_FRAME, // ローカル変数のoffset計算
+	PH_CODEGEN,
+	PH_OUTPUT,
+	PH_RUN, // --run の実行
+	PH_FREE,
+	NUM_PHASES,
+} Phase;
+
+// コンパイラの統計情報
+typedef struct {
+	bool enabled; // --time-report
+	bool json; // --time-report=json
+	long ntokens; // 生成したトークン数
+	long nnodes; // 生成したノード数
+	atomic_long buf_nalloc; // 出力バッファの確保回数
+	atomic_long buf_bytes; // 出力バッファとして確保したバイト数
+	long cache_hits; // キャッシュを使った関数の数
+	long cache_misses; // キャッシュになかった関数の数
+	long cache_saved_ns; // キャッシュで省いたパースとコード生成の時間
+} Stats;
+
 
 
 
@@ -113,62 +402,174 @@ struct Type{
 
 extern Type *int_type;
 
+extern Arena token_arena;
+extern Arena node_arena;
+extern Arena type_arena;
+
+extern Stats stats;
+extern Ast ast;
+
+extern OutFormat out_format;
+extern int opt_level;
+extern Reg argreg[];
+extern char *cache_dir;
+
+extern FILE *error_out;
+extern jmp_buf *error_jmp;
+
 
 
 
 
 //---- prototypes ----
 
+void *arena_alloc(Arena *arena, size_t size);
+void arena_free(Arena *arena);
+void arena_reset(Arena *arena);
+void arena_reset_all(void);
+void arena_free_all(void);
+void arena_report(FILE *out);
+void *hashmap_get(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, int keylen, void *val);
+void hashmap_clear(HashMap *map);
+char *intern(char *str, int len);
+void buf_reserve(OutBuf *buf, size_t n);
+void phase_push(Phase ph);
+void phase_pop(void);
+void stats_report(FILE *out);
+long clock_ns(void);
+void cache_open(char *dir);
+char *cache_key(char *begin, unsigned long *key);
+bool cache_load(Function *fn, unsigned long key);
+void cache_store(Function *prog);
+void buf_putint(OutBuf *buf, long val);
+void buf_free(OutBuf *buf);
+void buf_write(int fd, OutBuf **bufs, int n);
+
 bool is_integer(Type *ty);
-void add_type(Node *node);
+void add_type(void);
+void fold_function(Function *fn);
+void inline_calls(Function *fn);
+void inline_register(Function *fn);
+Function *inline_candidate(char *name, int len);
+void inline_reset(void);
 Type *pointer_to(Type *base);
 Type *array_of(Type *base, int size);
 
+char *read_file(char *path);
+int open_output(char *path);
+Function *compile(int njobs);
+void reset_compiler(void);
+int run_server(char *path, int njobs);
+int run_client(char *path, char *input, char *output_path);
+
 void error_at(char *loc, char *fmt, ...);
 void error(char *fmt, ...);
 
-bool consume(char *op);
+char *tk_str(TokenKind kind);
+bool consume(TokenKind kind);
 Token *consume_ident();
-void expect(char *op);
+void expect(TokenKind kind);
 int expect_number();
 char *expect_ident();
 bool at_eof();
-Token *new_token(TokenKind kind, Token *cur, char *str, int len);
-bool startswith(char *p, char *q);
 int is_alnum(char c);
-char *strndup(char *str, size_t len);
 Token *tokenize(char *p);
+char *lex_token(char *p, Token *tok);
+void lexer_start(char *p);
+void next_token(void);
+void lexer_seek(char *p);
+void set_scanner(char *name);
+bool lex_check(char *p, FILE *out);
 
-Node *new_node(NodeKind kind);
-Node *new_node_binary(NodeKind kind, Node *lhs, Node *rhs);
-Node *new_node_unary(NodeKind kind, Node *unary);
-Node *new_node_ifelse(Node *cond, Node *then, Node *els);
-Node *new_node_while(Node *cond, Node *then);
-Node *new_node_for(Node *init, Node *cond, Node *inc, Node *then);
-Node *new_node_num(int val);
-Node *new_node_lvar(LVar *var);
+NodeId new_node(NodeKind kind);
+NodeId new_node_binary(NodeKind kind, NodeId lhs, NodeId rhs);
+NodeId new_node_unary(NodeKind kind, NodeId unary);
+NodeId new_node_ifelse(NodeId cond, NodeId then, NodeId els);
+NodeId new_node_while(NodeId cond, NodeId then);
+NodeId new_node_for(NodeId init, NodeId cond, NodeId inc, NodeId then);
+NodeId new_node_block(int list);
+NodeId new_node_num(int val);
+NodeId new_node_call(char *name, int base);
+NodeId new_node_lvar(LVar *var);
+int new_extra(int n);
+void ast_reset(void);
+void ast_free(void);
 
 LVar *new_lvar(char *name, Type *ty);
-LVar *read_func_params(void);
+LVar *new_local(Function *fn, char *name, Type *ty);
+void parse_reset(void);
+void read_func_params(Function *fn);
+LVar *find_lvar(Token *tok);
+void enter_scope(void);
+void leave_scope(void);
 
 Function *program();
 Type *basetype();
 Type *read_type_suffix(Type *base);
 Function *function();
-Node *declaration();
-Node *stmt();
-Node *stmt2();
-Node *expr();
-Node *assign();
-Node *equality();
-Node *relational();
-Node *add();
-Node *mul();
-Node *unary();
-Node *postfix();
-Node *primary();
-
-void gen_addr(Node *node);
-void gen_lval(Node *node);
-void codegen(Function *prog);
-void gen(Node *node);
\ No newline at end of file
+NodeId declaration();
+NodeId stmt();
+NodeId stmt2();
+NodeId expr();
+
+void gen_addr(NodeId node);
+void gen_lval(NodeId node);
+char *reg_name(Reg reg);
+void codegen(Function *prog, int njobs);
+size_t asm_length(Function *prog);
+void write_asm(int fd, Function *prog, OutBuf *frame);
+void free_asm(Function *prog);
+void print_insts(Function *fn);
+void encode_insts(Function *fn);
+void write_obj(int fd, Function *prog);
+int run_jit(Function *prog);
+void gen(NodeId node);
+void gen_stmt(NodeId node);
+int new_label(void);
+int label_id(LabelKind kind, int n);
+void emit0(InstKind kind);
+void emit_r(InstKind kind, Reg reg);
+void emit_rr(InstKind kind, Reg dst, Reg src);
+void emit_ri(InstKind kind, Reg dst, long imm);
+void emit_load(Reg dst, Reg base, int disp);
+void emit_store(Reg base, int disp, Reg src);
+void emit_lea(Reg dst, Reg index, int scale);
+void emit_setcc(InstKind kind, Reg dst);
+void emit_jmp(InstKind kind, LabelKind label, int n);
+void emit_label(LabelKind label, int n);
+void emit_sym(InstKind kind, char *sym);
+
+// strength.c
+void emit_mul_imm(Reg dst, long c);
+bool can_div_imm(long c);
+void emit_div_imm(Reg dst, Reg x, long c);
+void emit_exact_div_imm(Reg dst, long c);
+IrFunc *lower_function(Function *fn);
+void free_ir(IrFunc *irf);
+void optimize_ir(Function *fn, IrFunc *irf);
+void gen_function_ra(Function *fn);
+void peephole(Function *fn);
+void peephole_report(FILE *out);
+
+
+//---- inline ----
+
+static inline void buf_putn(OutBuf *buf, char *s, size_t len){
+	if(buf->cap - buf->len < len){
+		buf_reserve(buf, len);
+	}
+	memcpy(buf->data + buf->len, s, len);
+	buf->len += len;
+}
+
+static inline void buf_puts(OutBuf *buf, char *s){
+	buf_putn(buf, s, strlen(s));
+}
+
+static inline void buf_putc(OutBuf *buf, char c){
+	if(buf->cap == buf->len){
+		buf_reserve(buf, 1);
+	}
+	buf->data[buf->len++] = c;
+}
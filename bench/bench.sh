@@ -0,0 +1,86 @@
+#!/bin/bash
+# 合成プログラムで9ccのスループットを計測する。
+#
+# パラメータを1つずつ倍々に増やしながら、トークン/秒・ノード/秒・
+# アセンブリ出力バイト/秒・最大RSSを測る。入力の大きさに対して
+# 1トークンあたりの時間が SUPERLINEAR_RATIO 倍以上に伸びたら、
+# 超線形 (O(n^2)など) として報告し、終了コードを1にする。
+
+cd "$(dirname "$0")/.."
+
+CC9=${CC9:-./9cc}
+GEN=bench/gen
+RUNS=${RUNS:-3}
+SUPERLINEAR_RATIO=${SUPERLINEAR_RATIO:-2.0}
+
+tmp=bench/tmp
+superlinear=0
+
+# 1回コンパイルして "wall_ms tokens nodes asm_bytes peak_rss_kb" を出力する
+measure(){
+	"$CC9" --time-report=json -f $tmp.in -o $tmp.s 2> $tmp.json || exit 1
+	wall=$(grep -o '"wall_ms": [0-9.]*' $tmp.json | awk '{ s += $2 } END { printf "%.3f", s }')
+	tokens=$(grep -o '"tokens": [0-9]*' $tmp.json | tail -1 | awk '{ print $2 }')
+	nodes=$(grep -o '"nodes": [0-9]*' $tmp.json | tail -1 | awk '{ print $2 }')
+	rss=$(grep -o '"peak_rss_kb": [0-9]*' $tmp.json | awk '$2 > m { m = $2 } END { print m }')
+	bytes=$(wc -c < $tmp.s)
+	echo "$wall $tokens $nodes $bytes $rss"
+}
+
+# sweep <名前> <変化させるオプション> <固定のオプション> <値...>
+sweep(){
+	name=$1
+	flag=$2
+	fixed=$3
+	shift 3
+
+	echo
+	echo "== $name ($flag, fixed: $fixed)"
+	printf "%8s %10s %10s %12s %10s %12s %12s %12s %10s %8s\n" \
+		"$flag" "tokens" "nodes" "asm bytes" "wall(ms)" "tokens/s" "nodes/s" "bytes/s" "RSS(KB)" "ns/tok"
+
+	first_ns=
+	last_ns=
+	for v in "$@"; do
+		$GEN $fixed $flag $v > $tmp.in
+
+		best=
+		for ((r = 0; r < RUNS; r++)); do
+			m=$(measure)
+			if [ -z "$best" ] || awk -v a="${m%% *}" -v b="${best%% *}" 'BEGIN { exit !(a < b) }'; then
+				best=$m
+			fi
+		done
+
+		read wall tokens nodes bytes rss <<< "$best"
+		awk -v v=$v -v w=$wall -v t=$tokens -v n=$nodes -v b=$bytes -v r=$rss 'BEGIN {
+			s = w / 1000
+			if(s <= 0) s = 1e-6
+			printf "%8s %10d %10d %12d %10.1f %12.0f %12.0f %12.0f %10d %8.1f\n",
+				v, t, n, b, w, t / s, n / s, b / s, r, w * 1e6 / t
+		}'
+
+		ns=$(awk -v w=$wall -v t=$tokens 'BEGIN { printf "%f", w * 1e6 / t }')
+		[ -z "$first_ns" ] && first_ns=$ns
+		last_ns=$ns
+	done
+
+	if awk -v a=$last_ns -v b=$first_ns -v k=$SUPERLINEAR_RATIO 'BEGIN { exit !(a > b * k) }'; then
+		echo "!! $name: SUPERLINEAR (ns/token ${first_ns%.*} -> ${last_ns%.*})"
+		superlinear=1
+	fi
+}
+
+sweep "functions"      -f "-l 8 -d 4 -n 2 -a 1"        1000 2000 4000 8000
+sweep "locals"         -l "-f 4 -d 4 -n 1 -a 0"        1000 2000 4000 8000
+sweep "expr depth"     -d "-f 200 -l 8 -n 1 -a 0"      50 100 200 400
+sweep "loop nesting"   -n "-f 200 -l 8 -d 4 -a 0"      4 8 16 32
+sweep "arrays"         -a "-f 200 -l 8 -d 4 -n 1"      4 8 16 32
+
+rm -f $tmp.in $tmp.s $tmp.json
+
+if [ $superlinear = 1 ]; then
+	echo
+	echo "superlinear scaling detected"
+	exit 1
+fi
@@ -0,0 +1,133 @@
+// ベンチマーク用の大きな合成プログラムを生成する
+//
+// 使い方: gen [-f 関数の数] [-l 関数あたりのローカル変数の数]
+//             [-d 式の深さ] [-n ループの入れ子の深さ] [-a 配列の数] [-s シード]
+//
+// 生成したプログラムは9ccが受け付ける言語の範囲に収まっている。
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static int nfuncs = 100;
+static int nlocals = 8;
+static int depth = 4;
+static int nloops = 2;
+static int narrays = 1;
+
+#define ARRAY_LEN 8
+
+static unsigned long seed = 1;
+
+static int rnd(int n){
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return (seed >> 33) % n;
+}
+
+// 葉になる式 (変数、数、配列の要素)
+static void gen_leaf(void){
+	int r = rnd(8);
+	if(r < 4){
+		printf("v%d", rnd(nlocals));
+	}
+	else if(r < 6 || narrays == 0){
+		printf("%d", rnd(100));
+	}
+	else{
+		printf("arr%d[%d]", rnd(narrays), rnd(ARRAY_LEN));
+	}
+}
+
+// 深さdの右に入れ子になった式
+static void gen_expr(int d){
+	static char *ops[] = { "+", "-", "*", "+", "-", "<", "==", "!=" };
+	if(d == 0){
+		gen_leaf();
+		return;
+	}
+	printf("(");
+	gen_leaf();
+	printf(" %s ", ops[rnd(sizeof(ops) / sizeof(*ops))]);
+	gen_expr(d - 1);
+	printf(")");
+}
+
+static void indent(int n){
+	for(int i = 0; i < n; i++){
+		printf("\t");
+	}
+}
+
+// 入れ子のループ。最も内側で変数と配列に代入する。
+static void gen_loops(int level, int nest){
+	if(level == nest){
+		indent(level + 1);
+		printf("v%d = ", rnd(nlocals));
+		gen_expr(depth);
+		printf(";\n");
+		if(narrays){
+			indent(level + 1);
+			printf("arr%d[%d] = ", rnd(narrays), rnd(ARRAY_LEN));
+			gen_expr(depth);
+			printf(";\n");
+		}
+		return;
+	}
+	indent(level + 1);
+	printf("for(i%d = 0; i%d < 2; i%d = i%d + 1){\n", level, level, level, level);
+	gen_loops(level + 1, nest);
+	indent(level + 1);
+	printf("}\n");
+}
+
+static void gen_function(int k){
+	printf("int f%d(int a, int b){\n", k);
+
+	// ローカル変数はそれぞれ前の変数を使って初期化する
+	printf("\tint v0 = a;\n");
+	for(int i = 1; i < nlocals; i++){
+		printf("\tint v%d = v%d + %d;\n", i, rnd(i), rnd(10));
+	}
+	for(int i = 0; i < narrays; i++){
+		printf("\tint arr%d[%d];\n", i, ARRAY_LEN);
+		for(int j = 0; j < ARRAY_LEN; j++){
+			printf("\tarr%d[%d] = b + %d;\n", i, j, j);
+		}
+	}
+	for(int i = 0; i < nloops; i++){
+		printf("\tint i%d;\n", i);
+	}
+
+	if(k > 0){
+		printf("\tv%d = f%d(v%d, %d);\n", rnd(nlocals), rnd(k), rnd(nlocals), rnd(4));
+	}
+	gen_loops(0, nloops);
+
+	printf("\treturn v%d;\n", rnd(nlocals));
+	printf("}\n");
+}
+
+int main(int argc, char **argv){
+	int opt;
+	while((opt = getopt(argc, argv, "f:l:d:n:a:s:")) != -1){
+		switch(opt){
+		case 'f': nfuncs = atoi(optarg); break;
+		case 'l': nlocals = atoi(optarg); break;
+		case 'd': depth = atoi(optarg); break;
+		case 'n': nloops = atoi(optarg); break;
+		case 'a': narrays = atoi(optarg); break;
+		case 's': seed = strtoul(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: gen [-f funcs] [-l locals] [-d depth] [-n loops] [-a arrays] [-s seed]\n");
+			return 1;
+		}
+	}
+	if(nlocals < 1){
+		nlocals = 1;
+	}
+
+	for(int k = 0; k < nfuncs; k++){
+		gen_function(k);
+	}
+	printf("int main(){\n\treturn f%d(1, 2) - f%d(1, 2);\n}\n", nfuncs - 1, nfuncs - 1);
+	return 0;
+}
@@ -0,0 +1,190 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "9cc.h"
+
+// 関数単位のコンパイルキャッシュ (--cache=<ディレクトリ>)
+//
+// 関数の定義のトークン列 (戻り値の型から閉じ括弧まで) と出力の形式・最適化のレベルから
+// キーを作り、生成したコードを <ディレクトリ>/<キー> に保存する。
+// -O1以上では前に定義した関数をインライン展開するので、本体で呼んでいる
+// 展開できる関数のキーも混ぜる。次のコンパイルでキーが一致した関数は
+// 保存したコードをそのまま使う。
+//
+// ファイルの形式 (数値はリトルエンディアン):
+//   "9cc\1", コード生成にかかった時間 (ns, 8バイト),
+//   再配置の数 (4バイト), コードの長さ (4バイト),
+//   再配置ごとに 位置 (4バイト), 名前の長さ (4バイト), 名前,
+//   コード
+
+char *cache_dir; // NULLならキャッシュを使わない
+
+static char cache_magic[4] = "9cc\1";
+static unsigned long compiler_id; // 9cc自身が変わったらキーが変わるように
+
+static unsigned long fnv(unsigned long hash, void *p, size_t len){
+	unsigned char *s = p;
+	for(size_t i = 0; i < len; i++){
+		hash = (hash ^ s[i]) * 0x100000001b3;
+	}
+	return hash;
+}
+
+// キャッシュを使い始める。ディレクトリがなければ作る。
+void cache_open(char *dir){
+	if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+		error("キャッシュのディレクトリ %s を作れません: %s", dir, strerror(errno));
+	}
+	cache_dir = dir;
+
+	struct stat st;
+	compiler_id = 0xcbf29ce484222325;
+	if(stat("/proc/self/exe", &st) == 0){
+		compiler_id = fnv(compiler_id, &st.st_size, sizeof(st.st_size));
+		compiler_id = fnv(compiler_id, &st.st_mtime, sizeof(st.st_mtime));
+	}
+}
+
+// 関数定義のトークン列 (beginから本体の閉じ括弧まで) のキーを*keyに書き、
+// 閉じ括弧の直後の位置を返す。定義が途中で終わっていればNULLを返す。
+// トークンはリングに収まらないので、パーサとは別に読み進める。
+char *cache_key(char *begin, unsigned long *key){
+	unsigned long hash = fnv(compiler_id, &out_format, sizeof(out_format));
+	hash = fnv(hash, &opt_level, sizeof(opt_level));
+	int depth = 0;
+	bool body = false;
+	Token tok, prev = { .kind = TK_EOF };
+
+	for(char *p = lex_token(begin, &tok); tok.kind != TK_EOF; prev = tok, p = lex_token(p, &tok)){
+		hash = fnv(hash, &tok.kind, sizeof(tok.kind));
+		hash = fnv(hash, tok.str, tok.len);
+		Function *callee = body && tok.kind == TK_LPAREN && prev.kind == TK_IDENT && opt_level >= 1 ? inline_candidate(prev.str, prev.len) : NULL;
+		if(callee){
+			hash = fnv(hash, &callee->cache_key, sizeof(callee->cache_key));
+		}
+		if(tok.kind == TK_LBRACE){
+			depth++;
+			body = true;
+		}
+		else if(tok.kind == TK_RBRACE){
+			if(--depth == 0 && body){
+				*key = hash;
+				return p;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void cache_path(char *buf, size_t size, unsigned long key){
+	snprintf(buf, size, "%s/%016lx", cache_dir, key);
+}
+
+static unsigned int get32(unsigned char *p){
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+// キャッシュにあればそのコードをfn->out (と再配置をfn->relocs) に読み込む
+bool cache_load(Function *fn, unsigned long key){
+	char path[4096];
+	cache_path(path, sizeof(path), key);
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return false;
+	}
+
+	OutBuf buf = {};
+	for(;;){
+		buf_reserve(&buf, 4096);
+		ssize_t n = read(fd, buf.data + buf.len, buf.cap - buf.len);
+		if(n <= 0){
+			break;
+		}
+		buf.len += n;
+	}
+	close(fd);
+
+	// 壊れたファイルは無視する
+	unsigned char *p = (unsigned char *)buf.data;
+	unsigned char *end = p + buf.len;
+	if(buf.len < 20 || memcmp(p, cache_magic, 4)){
+		buf_free(&buf);
+		return false;
+	}
+	long cost;
+	memcpy(&cost, p + 4, 8);
+	int nrelocs = get32(p + 12);
+	size_t code_len = get32(p + 16);
+	p += 20;
+
+	Reloc *relocs = malloc(sizeof(Reloc) * (nrelocs ? nrelocs : 1));
+	for(int i = 0; i < nrelocs; i++){
+		if(end - p < 8 || end - p - 8 < get32(p + 4)){
+			free(relocs);
+			buf_free(&buf);
+			return false;
+		}
+		relocs[i].offset = get32(p);
+		int len = get32(p + 4);
+		relocs[i].sym = intern((char *)p + 8, len);
+		p += 8 + len;
+	}
+	if(end - p != code_len){
+		free(relocs);
+		buf_free(&buf);
+		return false;
+	}
+
+	buf_putn(&fn->out, (char *)p, code_len);
+	fn->relocs = relocs;
+	fn->nrelocs = nrelocs;
+	fn->cost_ns = cost;
+	buf_free(&buf);
+	return true;
+}
+
+static void put32(OutBuf *buf, unsigned int val){
+	char b[4] = { val, val >> 8, val >> 16, val >> 24 };
+	buf_putn(buf, b, 4);
+}
+
+// キャッシュになかった関数のコードを保存する。
+// 別の9ccと同時に書いても壊れないよう、一時ファイルに書いてから名前を変える。
+void cache_store(Function *prog){
+	for(Function *fn = prog; fn; fn = fn->next){
+		if(fn->cached || !fn->cache_key){
+			continue;
+		}
+
+		OutBuf head = {};
+		buf_putn(&head, cache_magic, 4);
+		buf_putn(&head, (char *)&fn->cost_ns, 8);
+		put32(&head, fn->nrelocs);
+		put32(&head, fn->out.len);
+		for(int i = 0; i < fn->nrelocs; i++){
+			int len = strlen(fn->relocs[i].sym);
+			put32(&head, fn->relocs[i].offset);
+			put32(&head, len);
+			buf_putn(&head, fn->relocs[i].sym, len);
+		}
+
+		char path[4096], tmp[4096 + 32];
+		cache_path(path, sizeof(path), fn->cache_key);
+		snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+		int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0){
+			buf_free(&head);
+			continue;
+		}
+		OutBuf *bufs[] = { &head, &fn->out };
+		buf_write(fd, bufs, 2);
+		close(fd);
+		rename(tmp, path);
+		buf_free(&head);
+	}
+}
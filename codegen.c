@@ -1,5 +1,7 @@
 #include <ctype.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,257 +10,725 @@
 #include "9cc.h"
 
 
-int cnt_label;
-char *funcname;
-char *argreg[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+// 出力の形式 (-c でOUT_OBJ)
+OutFormat out_format = OUT_ASM;
+
+// 最適化レベル (-O<n>)。0ならスタックマシン、1以上ならレジスタ割り当て。
+int opt_level = 1;
+
+// 関数ごとのコード生成の状態。関数は別々のスレッドで生成されうるので
+// スレッドローカルに持つ。ラベル番号は関数ごとに0から振る。
+static _Thread_local int cnt_label;
+static _Thread_local Function *cur_fn; // 生成中の関数
+static _Thread_local int cap_insts;
+static _Thread_local int depth; // -O0で、フレームの下にpushしている値の数
+
+Reg argreg[] = {RDI, RSI, RDX, RCX, R8, R9};
+
+static char *reg64[] = {
+	"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+static char *reg8[] = {
+	"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+	"r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+char *reg_name(Reg reg){
+	return reg64[reg];
+}
+
+//---- 命令の生成 ----
+
+static Inst *new_inst(InstKind kind){
+	if(cur_fn->ninsts == cap_insts){
+		cap_insts = cap_insts ? cap_insts * 2 : 256;
+		cur_fn->insts = realloc(cur_fn->insts, sizeof(Inst) * cap_insts);
+	}
+	Inst *inst = &cur_fn->insts[cur_fn->ninsts++];
+	memset(inst, 0, sizeof(Inst));
+	inst->kind = kind;
+	return inst;
+}
+
+// "op"
+void emit0(InstKind kind){
+	new_inst(kind);
+}
+
+// "op reg"
+void emit_r(InstKind kind, Reg reg){
+	new_inst(kind)->dst = reg;
+}
+
+// "op imm"
+static void emit_i(InstKind kind, long imm){
+	Inst *inst = new_inst(kind);
+	inst->imm = true;
+	inst->val = imm;
+}
+
+// "op dst, src"
+void emit_rr(InstKind kind, Reg dst, Reg src){
+	Inst *inst = new_inst(kind);
+	inst->dst = dst;
+	inst->src = src;
+}
+
+// "op dst, imm"
+void emit_ri(InstKind kind, Reg dst, long imm){
+	Inst *inst = new_inst(kind);
+	inst->dst = dst;
+	inst->imm = true;
+	inst->val = imm;
+}
+
+// "mov dst, [base+disp]"
+void emit_load(Reg dst, Reg base, int disp){
+	Inst *inst = new_inst(IN_LOAD);
+	inst->dst = dst;
+	inst->src = base;
+	inst->val = disp;
+}
+
+// "mov [base+disp], src"
+void emit_store(Reg base, int disp, Reg src){
+	Inst *inst = new_inst(IN_STORE);
+	inst->dst = base;
+	inst->src = src;
+	inst->val = disp;
+}
+
+// "setcc dst8" と "movzb dst, dst8"
+void emit_setcc(InstKind kind, Reg dst){
+	new_inst(kind)->dst = dst;
+}
+
+// 関数の中で新しいラベルの連番を返す
+int new_label(void){
+	return cnt_label++;
+}
+
+int label_id(LabelKind kind, int n){
+	return n * NUM_LABEL_KINDS + kind;
+}
+
+// "op .L<種類><n>_<関数名>"
+void emit_jmp(InstKind kind, LabelKind label, int n){
+	new_inst(kind)->label = label_id(label, n);
+}
+
+// ".L<種類><n>_<関数名>:"
+void emit_label(LabelKind label, int n){
+	new_inst(IN_LABEL)->label = label_id(label, n);
+}
+
+// "lea dst, [dst+index*scale]"
+void emit_lea(Reg dst, Reg index, int scale){
+	Inst *inst = new_inst(IN_LEA);
+	inst->dst = dst;
+	inst->src = index;
+	inst->val = scale;
+}
+
+// "op sym"
+void emit_sym(InstKind kind, char *sym){
+	new_inst(kind)->sym = sym;
+}
+
+//---- テキストへの変換 ----
+
+static char *inst_name[] = {
+	[IN_PUSH] = "push", [IN_POP] = "pop", [IN_MOV] = "mov",
+	[IN_ADD] = "add", [IN_SUB] = "sub", [IN_IMUL] = "imul",
+	[IN_AND] = "and", [IN_SHL] = "shl", [IN_SAR] = "sar", [IN_SHR] = "shr",
+	[IN_LEA] = "lea", [IN_CMP] = "cmp", [IN_LOAD] = "mov",
+	[IN_STORE] = "mov", [IN_CQO] = "cqo", [IN_IDIV] = "idiv", [IN_MULH] = "imul",
+	[IN_SETE] = "sete", [IN_SETNE] = "setne", [IN_SETL] = "setl",
+	[IN_SETLE] = "setle", [IN_JMP] = "jmp", [IN_JE] = "je",
+	[IN_JNE] = "jne", [IN_JL] = "jl", [IN_JLE] = "jle", [IN_JG] = "jg",
+	[IN_JGE] = "jge", [IN_CALL] = "call", [IN_RET] = "ret",
+};
+
+static char *label_prefix[] = {
+	[L_BEGIN] = "begin", [L_END] = "end", [L_ELSE] = "else",
+	[L_RETURN] = "return",
+};
+
+// ".L<種類><n>_<関数名>"
+// ラベル番号は関数ごとに振るので、関数名を付けて区別する。
+static void print_label(OutBuf *out, char *fname, int label){
+	LabelKind kind = label % NUM_LABEL_KINDS;
+	buf_puts(out, ".L");
+	buf_puts(out, label_prefix[kind]);
+	if(kind != L_RETURN){
+		buf_putint(out, label / NUM_LABEL_KINDS);
+	}
+	buf_putc(out, '_');
+	buf_puts(out, fname);
+}
+
+// "[base]" または "[base-disp]"
+static void print_mem(OutBuf *out, Reg base, long disp){
+	buf_putc(out, '[');
+	buf_puts(out, reg64[base]);
+	if(disp < 0){
+		buf_putint(out, disp);
+	}
+	else if(disp > 0){
+		buf_putc(out, '+');
+		buf_putint(out, disp);
+	}
+	buf_putc(out, ']');
+}
+
+// 命令列をIntel記法のアセンブリとしてfn->outに書く
+void print_insts(Function *fn){
+	OutBuf *out = &fn->out;
+
+	buf_puts(out, ".global ");
+	buf_puts(out, fn->name);
+	buf_putc(out, '\n');
+	buf_puts(out, fn->name);
+	buf_putn(out, ":\n", 2);
+
+	for(int i = 0; i < fn->ninsts; i++){
+		Inst *inst = &fn->insts[i];
+		if(inst->kind == IN_LABEL){
+			print_label(out, fn->name, inst->label);
+			buf_putn(out, ":\n", 2);
+			continue;
+		}
+
+		buf_putn(out, "  ", 2);
+		buf_puts(out, inst_name[inst->kind]);
+		switch(inst->kind){
+		case IN_PUSH:
+		case IN_POP:
+		case IN_IDIV:
+		case IN_MULH:
+			buf_putc(out, ' ');
+			if(inst->imm){
+				buf_putint(out, inst->val);
+			}
+			else{
+				buf_puts(out, reg64[inst->dst]);
+			}
+			break;
+		case IN_MOV:
+		case IN_ADD:
+		case IN_SUB:
+		case IN_IMUL:
+		case IN_AND:
+		case IN_SHL:
+		case IN_SAR:
+		case IN_SHR:
+		case IN_CMP:
+			buf_putc(out, ' ');
+			buf_puts(out, reg64[inst->dst]);
+			buf_putn(out, ", ", 2);
+			if(inst->imm){
+				buf_putint(out, inst->val);
+			}
+			else{
+				buf_puts(out, reg64[inst->src]);
+			}
+			break;
+		case IN_LEA:
+			buf_putc(out, ' ');
+			buf_puts(out, reg64[inst->dst]);
+			buf_putn(out, ", [", 3);
+			buf_puts(out, reg64[inst->dst]);
+			buf_putc(out, '+');
+			buf_puts(out, reg64[inst->src]);
+			buf_putc(out, '*');
+			buf_putint(out, inst->val);
+			buf_putc(out, ']');
+			break;
+		case IN_LOAD:
+			buf_putc(out, ' ');
+			buf_puts(out, reg64[inst->dst]);
+			buf_putn(out, ", ", 2);
+			print_mem(out, inst->src, inst->val);
+			break;
+		case IN_STORE:
+			buf_putc(out, ' ');
+			print_mem(out, inst->dst, inst->val);
+			buf_putn(out, ", ", 2);
+			buf_puts(out, reg64[inst->src]);
+			break;
+		case IN_SETE:
+		case IN_SETNE:
+		case IN_SETL:
+		case IN_SETLE:
+			buf_putc(out, ' ');
+			buf_puts(out, reg8[inst->dst]);
+			buf_puts(out, "\n  movzb ");
+			buf_puts(out, reg64[inst->dst]);
+			buf_putn(out, ", ", 2);
+			buf_puts(out, reg8[inst->dst]);
+			break;
+		case IN_JMP:
+		case IN_JE:
+		case IN_JNE:
+		case IN_JL:
+		case IN_JLE:
+		case IN_JG:
+		case IN_JGE:
+			buf_putc(out, ' ');
+			print_label(out, fn->name, inst->label);
+			break;
+		case IN_CALL:
+			buf_putc(out, ' ');
+			buf_puts(out, inst->sym);
+			break;
+		}
+		buf_putc(out, '\n');
+	}
+}
+
+//---- スタックマシン (-O0) ----
+
+// push/popは必ずここを通し、スタックの深さをコンパイル時に数える
+static void push(Reg reg){
+	emit_r(IN_PUSH, reg);
+	depth++;
+}
+
+static void push_imm(long val){
+	emit_i(IN_PUSH, val);
+	depth++;
+}
+
+static void pop(Reg reg){
+	emit_r(IN_POP, reg);
+	depth--;
+}
 
 void load(){
-	printf("  pop rax\n");
-	printf("  mov rax, [rax]\n");
-	printf("  push rax\n");
+	pop(RAX);
+	emit_load(RAX, RAX, 0);
+	push(RAX);
 }
 
 void store(){
-	printf("  pop rdi\n");
-	printf("  pop rax\n");
-	printf("  mov [rax], rdi\n");
-	printf("  push rdi\n");
+	pop(RDI);
+	pop(RAX);
+	emit_store(RAX, 0, RDI);
+	push(RDI);
 }
 
-void gen_lval(Node *node){
-    if(node->ty->kind == TY_ARRAY){
-		fprintf(stderr, "左辺値ではありません");
-		exit(1);
+void gen_lval(NodeId node){
+    if(ast.ty[node]->kind == TY_ARRAY){
+		error("左辺値ではありません");
 	}
 
 	gen_addr(node);
 }
 
-void gen_addr(Node *node){
-	switch(node->kind){
+void gen_addr(NodeId node){
+	switch(ast.kind[node]){
 	case ND_LVAR:
-		printf("  mov rax, rbp\n");
-		printf("  sub rax, %d\n", node->lvar->offset);
-		printf("  push rax\n");
+		emit_rr(IN_MOV, RAX, RBP);
+		emit_ri(IN_SUB, RAX, ast.vars[ast.lhs[node]]->offset);
+		push(RAX);
 		return;
 	case ND_DEREF:
-		gen(node->lhs);
+		gen(ast.lhs[node]);
 		return;
 	}
 
-	fprintf(stderr, "左辺値ではありません");
-	exit(1);
-}
-
-void codegen(Function *prog){
-		
-	// アセンブリの前半部分を出力
-	printf(".intel_syntax noprefix\n");
-    for(Function *fn = prog; fn; fn = fn->next){
-        printf(".global %s\n", fn->name);
-        printf("%s:\n", fn->name);
-        funcname = fn->name;
-
-        // プロローグ
-        // ローカル変数の領域を確保する
-        printf("  push rbp\n");
-        printf("  mov rbp, rsp\n");
-        printf("  sub rsp, %d\n", fn->stack_size); 
-
-        // 関数の引数の領域を確保する
-        int i = 0;
-        for(LVar *var = fn->params; var; var = var->next){
-            printf("  mov [rbp-%d], %s\n", var->offset, argreg[i++]);
-        }
-
-        // 先頭の式から、抽象構文木を下りコード生成
-        for(Node *node = fn->node; node; node = node->next){
-            gen(node);
-        }
-
-        // エピローグ
-        // 最後の式の結果がRAXに残っているので、それが返り値
-        printf(".Lreturn_%s:\n", funcname);
-        printf("  mov rsp, rbp\n");
-        printf("  pop rbp\n");
-        printf("  ret\n");
-    }
+	error("左辺値ではありません");
 }
 
-void gen(Node *node){
-	if(node == NULL) return;
+// スタックマシンとして関数の命令列を生成する (-O0)
+static void gen_function_stack(Function *fn){
+	// プロローグ
+	// ローカル変数の領域を確保する。stack_sizeは16の倍数なので、
+	// ここでRSPは16バイト境界にあり、以降はdepthが偶数なら揃っている。
+	emit_r(IN_PUSH, RBP);
+	emit_rr(IN_MOV, RBP, RSP);
+	if(fn->stack_size){
+		emit_ri(IN_SUB, RSP, fn->stack_size);
+	}
+	depth = 0;
+
+	// 関数の引数の領域を確保する
+	for(int i = 0; i < fn->nparams; i++){
+		emit_store(RBP, -fn->params[i]->offset, argreg[i]);
+	}
+
+	// 先頭の式から、抽象構文木を下りコード生成
+	int *body = &ast.extra[fn->body];
+	for(int i = 1; i <= body[0]; i++){
+		gen_stmt(body[i]);
+	}
+
+	// エピローグ
+	// 最後の式文の結果がRAXに残っているので、それが返り値
+	emit_label(L_RETURN, 0);
+	emit_rr(IN_MOV, RSP, RBP);
+	emit_r(IN_POP, RBP);
+	emit0(IN_RET);
+}
 
-    switch(node->kind){
+// 1つの関数の命令列を生成し、out_formatに応じてfn->outに
+// アセンブリか機械語を書く
+static void gen_function(Function *fn){
+	if(fn->cached){
+		return;
+	}
+	long start = cache_dir ? clock_ns() : 0;
+	cur_fn = fn;
+	cnt_label = 0;
+	cap_insts = 0;
+
+	if(opt_level == 0){
+		gen_function_stack(fn);
+	}
+	else{
+		gen_function_ra(fn);
+	}
+	fn->nlabels = (cnt_label + 1) * NUM_LABEL_KINDS;
+	peephole(fn);
+
+	if(out_format == OUT_OBJ){
+		encode_insts(fn);
+	}
+	else{
+		print_insts(fn);
+	}
+	free(fn->insts);
+	fn->insts = NULL;
+	fn->ninsts = 0;
+	if(cache_dir){
+		fn->cost_ns += clock_ns() - start;
+	}
+}
+
+// スレッドプールで共有する作業キュー
+typedef struct {
+	Function **fns;
+	int nfns;
+	atomic_int next; // 次に生成する関数の番号
+} CodegenQueue;
+
+static void *codegen_worker(void *arg){
+	CodegenQueue *q = arg;
+	for(;;){
+		int i = atomic_fetch_add(&q->next, 1);
+		if(i >= q->nfns){
+			return NULL;
+		}
+		gen_function(q->fns[i]);
+	}
+}
+
+// 各関数のアセンブリを生成する。njobs > 1 のときは関数単位で
+// njobs個のスレッドに分けて生成する。
+void codegen(Function *prog, int njobs){
+	int nfns = 0;
+	for(Function *fn = prog; fn; fn = fn->next){
+		nfns++;
+	}
+
+	if(njobs <= 1 || nfns <= 1){
+		for(Function *fn = prog; fn; fn = fn->next){
+			gen_function(fn);
+		}
+		return;
+	}
+
+	CodegenQueue q = {};
+	q.fns = malloc(sizeof(Function *) * nfns);
+	q.nfns = nfns;
+	atomic_init(&q.next, 0);
+	int i = 0;
+	for(Function *fn = prog; fn; fn = fn->next){
+		q.fns[i++] = fn;
+	}
+
+	if(njobs > nfns){
+		njobs = nfns;
+	}
+	pthread_t *threads = malloc(sizeof(pthread_t) * (njobs - 1));
+	int nthreads = 0;
+	for(; nthreads < njobs - 1; nthreads++){
+		if(pthread_create(&threads[nthreads], NULL, codegen_worker, &q)){
+			break;
+		}
+	}
+	codegen_worker(&q); // このスレッドも作業する
+	for(int i = 0; i < nthreads; i++){
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	free(q.fns);
+}
+
+static char asm_header[] = ".intel_syntax noprefix\n";
+
+// 生成したアセンブリの総バイト数
+size_t asm_length(Function *prog){
+	size_t len = strlen(asm_header);
+	for(Function *fn = prog; fn; fn = fn->next){
+		len += fn->out.len;
+	}
+	return len;
+}
+
+// 生成したアセンブリをソースの順にfdへ書き出す。
+// frameがNULLでなければその内容を先頭に付ける。
+void write_asm(int fd, Function *prog, OutBuf *frame){
+	OutBuf head = {};
+	buf_puts(&head, asm_header);
+
+	int nbufs = 2;
+	for(Function *fn = prog; fn; fn = fn->next){
+		nbufs++;
+	}
+	OutBuf **bufs = malloc(sizeof(OutBuf *) * nbufs);
+	OutBuf empty = {};
+	bufs[0] = frame ? frame : &empty;
+	bufs[1] = &head;
+	int i = 2;
+	for(Function *fn = prog; fn; fn = fn->next){
+		bufs[i++] = &fn->out;
+	}
+
+	buf_write(fd, bufs, nbufs);
+
+	free(bufs);
+	buf_free(&head);
+	free_asm(prog);
+}
+
+// 各関数の出力バッファを解放する
+void free_asm(Function *prog){
+	for(Function *fn = prog; fn; fn = fn->next){
+		buf_free(&fn->out);
+		free(fn->relocs);
+		fn->relocs = NULL;
+		fn->nrelocs = 0;
+	}
+}
+
+// 定数との乗除算は、定数をpushせずにシフトなどに変える。変えたらtrue。
+static bool gen_by_const(NodeId node){
+	NodeKind kind = ast.kind[node];
+	NodeId lhs = ast.lhs[node];
+	NodeId rhs = ast.rhs[node];
+	if(kind == ND_MUL && ast.kind[lhs] == ND_NUM){
+		NodeId t = lhs;
+		lhs = rhs;
+		rhs = t;
+	}
+	if(ast.kind[rhs] != ND_NUM){
+		return false;
+	}
+	long c = ast.lhs[rhs];
+	if(kind == ND_MUL && c == (int)c){
+		gen(lhs);
+		pop(RAX);
+		emit_mul_imm(RAX, c);
+	}
+	else if(kind == ND_DIV && can_div_imm(c)){
+		gen(lhs);
+		pop(RDI);
+		emit_div_imm(RAX, RDI, c);
+	}
+	else{
+		return false;
+	}
+	push(RAX);
+	return true;
+}
+
+// 文を生成する。文の前後でスタックの深さは変わらない。
+// 式文の値はRAXに残す (returnのない関数の返り値になる)。
+void gen_stmt(NodeId node){
+	if(node == 0) return;
+
+	int lhs = ast.lhs[node];
+	int rhs = ast.rhs[node];
+
+	switch(ast.kind[node]){
+	case ND_NULL:
+		return;
 	case ND_RETURN:
-		gen(node->lhs);
-		printf("  pop rax\n");
-		printf("  jmp .Lreturn_%s\n", funcname);
+		gen(lhs);
+		pop(RAX);
+		emit_jmp(IN_JMP, L_RETURN, 0);
 		return;
-	case ND_IF:
-		if(node->els){
-			int cnt_label_tmp = cnt_label++;
-			gen(node->cond);
-			printf("  pop rax\n");
-			printf("  cmp rax, 0\n");
-			printf("  je .Lelse%d\n", cnt_label_tmp);
-			gen(node->then);
-			printf("  jmp .Lend%d\n", cnt_label_tmp);
-			printf(".Lelse%d:\n", cnt_label_tmp);
-			gen(node->els);
-			printf(".Lend%d:\n", cnt_label_tmp);
+	case ND_IF: {
+		NodeId then = ast.extra[rhs];
+		NodeId els = ast.extra[rhs + 1];
+		int cnt_label_tmp = cnt_label++;
+		gen(lhs);
+		pop(RAX);
+		emit_ri(IN_CMP, RAX, 0);
+		if(els){
+			emit_jmp(IN_JE, L_ELSE, cnt_label_tmp);
+			gen_stmt(then);
+			emit_jmp(IN_JMP, L_END, cnt_label_tmp);
+			emit_label(L_ELSE, cnt_label_tmp);
+			gen_stmt(els);
 		}
 		else{
-			int cnt_label_tmp = cnt_label++;
-			gen(node->cond);
-			printf("  pop rax\n");
-			printf("  cmp rax, 0\n");
-			printf("  je .Lend%d\n", cnt_label_tmp);
-			gen(node->then);
-			printf(".Lend%d:\n", cnt_label_tmp);
+			emit_jmp(IN_JE, L_END, cnt_label_tmp);
+			gen_stmt(then);
 		}
+		emit_label(L_END, cnt_label_tmp);
 		return;
+	}
 	case ND_WHILE: {
 		int cnt_label_tmp = cnt_label++;
-		printf(".Lbegin%d:\n", cnt_label_tmp);
-		gen(node->cond);
-		printf("  pop rax\n");
-		printf("  cmp rax, 0\n");
-		printf("  je .Lend%d\n", cnt_label_tmp);
-		gen(node->then);
-		printf("  jmp .Lbegin%d\n", cnt_label_tmp);
-		printf(".Lend%d:\n", cnt_label_tmp);
+		emit_label(L_BEGIN, cnt_label_tmp);
+		gen(lhs);
+		pop(RAX);
+		emit_ri(IN_CMP, RAX, 0);
+		emit_jmp(IN_JE, L_END, cnt_label_tmp);
+		gen_stmt(rhs);
+		emit_jmp(IN_JMP, L_BEGIN, cnt_label_tmp);
+		emit_label(L_END, cnt_label_tmp);
 		return;
 	}
 	case ND_FOR: {
+		int *f = &ast.extra[lhs]; // init, cond, inc, 本体
 		int cnt_label_tmp = cnt_label++;
-		gen(node->init);
-		printf(".Lbegin%d:\n", cnt_label_tmp);
-		gen(node->cond);
-		printf("  pop rax\n");
-		printf("  cmp rax, 0\n");
-		printf("  je .Lend%d\n", cnt_label_tmp);
-		gen(node->then);
-		gen(node->inc);
-		printf("  jmp .Lbegin%d\n", cnt_label_tmp);
-		printf(".Lend%d:\n", cnt_label_tmp);
+		gen_stmt(f[0]);
+		emit_label(L_BEGIN, cnt_label_tmp);
+		if(f[1]){
+			gen(f[1]);
+			pop(RAX);
+			emit_ri(IN_CMP, RAX, 0);
+			emit_jmp(IN_JE, L_END, cnt_label_tmp);
+		}
+		gen_stmt(f[3]);
+		gen_stmt(f[2]);
+		emit_jmp(IN_JMP, L_BEGIN, cnt_label_tmp);
+		emit_label(L_END, cnt_label_tmp);
 		return;
 	}
 	case ND_BLOCK:
-		while(1){
-			gen(node->body);
-			if(node->next == NULL)
-				break;
-			node = node->next;
-			if(node->next != NULL)
-				printf("  pop rax\n");
+		for(int i = 1, *list = &ast.extra[lhs]; i <= list[0]; i++){
+			gen_stmt(list[i]);
 		}
 		return;
+	}
+
+	// 式文
+	gen(node);
+	pop(RAX);
+}
+
+// 式を生成し、その値を1つpushする
+void gen(NodeId node){
+	int lhs = ast.lhs[node];
+	int rhs = ast.rhs[node];
+
+	switch(ast.kind[node]){
 	case ND_FUNCCALL: {
-		int n_args = 0;
-		for(Node *arg = node->args; arg; arg = arg->next){
-			gen(arg);
-			n_args++;
+		int *args = &ast.extra[rhs];
+		int n_args = args[0];
+		for(int i = 1; i <= n_args; i++){
+			gen(args[i]);
 		}
 		for(int i = n_args - 1; i >= 0; i--){
-			printf("  pop %s\n", argreg[i]);
+			pop(argreg[i]);
 		}
-		int cnt_label_tmp = cnt_label++;
-		printf("  mov rax, rsp\n");
-		printf("  and rax, 15\n");
-		printf("  jnz .Lcall%d\n", cnt_label_tmp);
-		printf("  mov rax, 0\n");
-		printf("  call %s\n", node->funcname);
-		printf("  jmp .Lend%d\n", cnt_label_tmp);
-		printf(".Lcall%d:\n", cnt_label_tmp);
-		printf("  sub rsp, 8\n");
-		printf("  mov rax, 0\n");
-		printf("  call %s\n", node->funcname);
-		printf("  add rsp, 8\n");
-		printf(".Lend%d:\n", cnt_label_tmp);
-		printf("  push rax\n");
+		// callの時点でRSPが16バイト境界にあるように揃える
+		bool pad = depth % 2;
+		if(pad){
+			emit_ri(IN_SUB, RSP, 8);
+		}
+		emit_ri(IN_MOV, RAX, 0);
+		emit_sym(IN_CALL, ast.funcs[lhs]);
+		if(pad){
+			emit_ri(IN_ADD, RSP, 8);
+		}
+		push(RAX);
 		return;
 	}
     case ND_NUM:
-        printf("  push %d\n", node->val);
+        push_imm(lhs);
         return;
     case ND_LVAR:
 		gen_addr(node);
-		if(node->ty->kind != TY_ARRAY){
+		if(ast.ty[node]->kind != TY_ARRAY){
 			load();
 		}
         return;
     case ND_ASSIGN:
-        gen_lval(node->lhs);
-        gen(node->rhs);
+        gen_lval(lhs);
+        gen(rhs);
 		store();
         return;
 	case ND_ADDR:
-		gen_addr(node->lhs);
+		gen_addr(lhs);
 		return;
 	case ND_DEREF:
-		gen(node->lhs);
-		if(node->ty->kind != TY_ARRAY){
+		gen(lhs);
+		if(ast.ty[node]->kind != TY_ARRAY){
 			load();
 		}
 		return;
     }
 
-	gen(node->lhs);
-	gen(node->rhs);
+	if(gen_by_const(node)){
+		return;
+	}
+	gen(lhs);
+	gen(rhs);
 
-	printf("  pop rdi\n");
-	printf("  pop rax\n");
+	pop(RDI);
+	pop(RAX);
 
-	switch(node->kind){
+	switch(ast.kind[node]){
 	case ND_ADD:
-		printf("  add rax, rdi\n");
+		emit_rr(IN_ADD, RAX, RDI);
 		break;
 	case ND_PTR_ADD:
-		printf("  imul rdi, %d\n", node->ty->base->size);
-		printf("  add rax, rdi\n");
+		emit_mul_imm(RDI, ast.ty[node]->base->size);
+		emit_rr(IN_ADD, RAX, RDI);
 		break;
 	case ND_SUB:
-		printf("  sub rax, rdi\n");
+		emit_rr(IN_SUB, RAX, RDI);
 		break;
 	case ND_PTR_SUB:
-		printf("  imul rdi, %d\n", node->ty->base->size);
-		printf("  sub rax, rdi\n");
+		emit_mul_imm(RDI, ast.ty[node]->base->size);
+		emit_rr(IN_SUB, RAX, RDI);
 		break;
 	case ND_PTR_DIFF:
-		printf("  sub rax, rdi\n");
-		printf("  cqo\n");
-		printf("  mov rdi, %d\n", node->ty->base->size);
-		printf("  idiv rdi\n");
+		emit_rr(IN_SUB, RAX, RDI);
+		emit_exact_div_imm(RAX, ast.ty[lhs]->base->size);
+		break;
 	case ND_MUL:
-		printf("  imul rax, rdi\n");
+		emit_rr(IN_IMUL, RAX, RDI);
 		break;
 	case ND_DIV:
-		printf("  cqo\n");
-		printf("  idiv rdi\n");
+		emit0(IN_CQO);
+		emit_r(IN_IDIV, RDI);
 		break;
 	case ND_EQ:
-		printf("  cmp rax, rdi\n");
-		printf("  sete al\n");
-		printf("  movzb rax, al\n");
+		emit_rr(IN_CMP, RAX, RDI);
+		emit_setcc(IN_SETE, RAX);
 		break;
 	case ND_NE:
-		printf("  cmp rax, rdi\n");
-		printf("  setne al\n");
-		printf("  movzb rax, al\n");
+		emit_rr(IN_CMP, RAX, RDI);
+		emit_setcc(IN_SETNE, RAX);
 		break;
 	case ND_LT:
-		printf("  cmp rax, rdi\n");
-		printf("  setl al\n");
-		printf("  movzb rax, al\n");
+		emit_rr(IN_CMP, RAX, RDI);
+		emit_setcc(IN_SETL, RAX);
 		break;
 	case ND_LE:
-		printf("  cmp rax, rdi\n");
-		printf("  setle al\n");
-		printf("  movzb rax, al\n");
+		emit_rr(IN_CMP, RAX, RDI);
+		emit_setcc(IN_SETLE, RAX);
 		break;
 	}
 
-	printf("  push rax\n");
+	push(RAX);
 }
-
-
@@ -0,0 +1,281 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "9cc.h"
+
+// 識別子の文字列表。同じ綴りには同じポインタを返すので、ポインタで比較できる。
+static HashMap intern_table;
+
+// フェーズごとのアリーナ
+Arena token_arena = { "token" };
+Arena node_arena  = { "node" };
+Arena type_arena  = { "type" };
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 8
+
+// アリーナからsizeバイトを確保する。確保した領域は0で初期化される。
+void *arena_alloc(Arena *arena, size_t size){
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	ArenaChunk *chunk = arena->chunk;
+	if(!chunk || chunk->cap - chunk->used < size){
+		size_t cap = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		chunk = malloc(sizeof(ArenaChunk) + cap);
+		if(!chunk){
+			error("アリーナ %s のメモリ確保に失敗しました。", arena->name);
+		}
+		chunk->next = arena->chunk;
+		chunk->cap = cap;
+		chunk->used = 0;
+		arena->chunk = chunk;
+		arena->reserved += sizeof(ArenaChunk) + cap;
+		if(arena->reserved > arena->peak_reserved){
+			arena->peak_reserved = arena->reserved;
+		}
+	}
+
+	void *p = chunk->data + chunk->used;
+	chunk->used += size;
+	memset(p, 0, size);
+
+	arena->used += size;
+	arena->total += size;
+	arena->nalloc++;
+	if(arena->used > arena->peak){
+		arena->peak = arena->used;
+	}
+	return p;
+}
+
+// アリーナのチャンクをまとめて解放する。ピーク値は残す。
+void arena_free(Arena *arena){
+	ArenaChunk *chunk = arena->chunk;
+	while(chunk){
+		ArenaChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->chunk = NULL;
+	arena->used = 0;
+	arena->reserved = 0;
+}
+
+// 次のコンパイルのためにアリーナを空にする。標準の大きさのチャンクを
+// 1つだけ残して再利用し、それ以外はまとめて解放する。
+void arena_reset(Arena *arena){
+	ArenaChunk *keep = NULL;
+	ArenaChunk *chunk = arena->chunk;
+	while(chunk){
+		ArenaChunk *next = chunk->next;
+		if(!keep && chunk->cap == ARENA_CHUNK_SIZE){
+			keep = chunk;
+		}
+		else{
+			free(chunk);
+		}
+		chunk = next;
+	}
+
+	arena->chunk = keep;
+	arena->used = 0;
+	arena->reserved = 0;
+	if(keep){
+		keep->next = NULL;
+		keep->used = 0;
+		arena->reserved = sizeof(ArenaChunk) + keep->cap;
+	}
+}
+
+void arena_reset_all(void){
+	hashmap_clear(&intern_table);
+	arena_reset(&token_arena);
+	arena_reset(&node_arena);
+	arena_reset(&type_arena);
+}
+
+void arena_free_all(void){
+	hashmap_clear(&intern_table);
+	arena_free(&token_arena);
+	arena_free(&node_arena);
+	arena_free(&type_arena);
+}
+
+// 各アリーナのピーク使用量を出力する
+void arena_report(FILE *out){
+	Arena *arenas[] = { &token_arena, &node_arena, &type_arena };
+	size_t total = 0;
+
+	fprintf(out, "%-8s %10s %12s %12s\n", "arena", "allocs", "peak bytes", "peak chunks");
+	for(int i = 0; i < sizeof(arenas) / sizeof(*arenas); i++){
+		Arena *a = arenas[i];
+		fprintf(out, "%-8s %10zu %12zu %12zu\n",
+			a->name, a->nalloc, a->peak, a->peak_reserved);
+		total += a->peak_reserved;
+	}
+	// 構文木はアリーナではなく配列だが、同じ形で並べる
+	fprintf(out, "%-8s %10zu %12zu %12zu\n", "ast", ast.nalloc, ast.peak_reserved, ast.peak_reserved);
+	total += ast.peak_reserved;
+	fprintf(out, "%-8s %10s %12s %12zu\n", "total", "", "", total);
+}
+
+// FNV-1a ハッシュ
+static unsigned long hash_bytes(char *s, int len){
+	unsigned long hash = 0xcbf29ce484222325;
+	for(int i = 0; i < len; i++){
+		hash = (hash ^ (unsigned char)s[i]) * 0x100000001b3;
+	}
+	return hash;
+}
+
+static HashEntry *hashmap_find(HashMap *map, char *key, int keylen){
+	unsigned long mask = map->capacity - 1;
+	for(unsigned long i = hash_bytes(key, keylen) & mask; ; i = (i + 1) & mask){
+		HashEntry *ent = &map->buckets[i];
+		if(!ent->key){
+			return ent;
+		}
+		if(ent->keylen == keylen && (ent->key == key || !memcmp(ent->key, key, keylen))){
+			return ent;
+		}
+	}
+}
+
+static void hashmap_grow(HashMap *map){
+	HashMap new_map = {};
+	new_map.capacity = map->capacity ? map->capacity * 2 : 64;
+	new_map.buckets = calloc(new_map.capacity, sizeof(HashEntry));
+
+	for(int i = 0; i < map->capacity; i++){
+		HashEntry *ent = &map->buckets[i];
+		if(ent->key){
+			*hashmap_find(&new_map, ent->key, ent->keylen) = *ent;
+			new_map.used++;
+		}
+	}
+	free(map->buckets);
+	*map = new_map;
+}
+
+// キーに対応する値を返す。ない場合はNULL。
+void *hashmap_get(HashMap *map, char *key, int keylen){
+	if(!map->buckets){
+		return NULL;
+	}
+	return hashmap_find(map, key, keylen)->val;
+}
+
+// キーに値を設定する。keyの指す文字列はmapより長生きしなければならない。
+void hashmap_put(HashMap *map, char *key, int keylen, void *val){
+	if(map->used * 4 >= map->capacity * 3){
+		hashmap_grow(map);
+	}
+	HashEntry *ent = hashmap_find(map, key, keylen);
+	if(!ent->key){
+		ent->key = key;
+		ent->keylen = keylen;
+		map->used++;
+	}
+	ent->val = val;
+}
+
+void hashmap_clear(HashMap *map){
+	free(map->buckets);
+	map->buckets = NULL;
+	map->capacity = 0;
+	map->used = 0;
+}
+
+// 文字列str[0..len)をintern表に登録し、正規のポインタを返す
+char *intern(char *str, int len){
+	char *s = hashmap_get(&intern_table, str, len);
+	if(s){
+		return s;
+	}
+	s = arena_alloc(&node_arena, len + 1);
+	memcpy(s, str, len);
+	hashmap_put(&intern_table, s, len, s);
+	return s;
+}
+
+// 出力バッファに少なくともnバイトの空きを作る
+void buf_reserve(OutBuf *buf, size_t n){
+	if(buf->cap - buf->len >= n){
+		return;
+	}
+	size_t cap = buf->cap ? buf->cap : 4096;
+	while(cap - buf->len < n){
+		cap *= 2;
+	}
+	buf->data = realloc(buf->data, cap);
+	if(!buf->data){
+		error("出力バッファのメモリ確保に失敗しました。");
+	}
+	atomic_fetch_add(&stats.buf_nalloc, 1);
+	atomic_fetch_add(&stats.buf_bytes, cap - buf->cap);
+	buf->cap = cap;
+}
+
+// 10進数で整数を書き込む
+void buf_putint(OutBuf *buf, long val){
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	unsigned long u = val < 0 ? -(unsigned long)val : val;
+
+	do{
+		*--p = '0' + u % 10;
+		u /= 10;
+	}while(u);
+	if(val < 0){
+		*--p = '-';
+	}
+	buf_putn(buf, p, tmp + sizeof(tmp) - p);
+}
+
+void buf_free(OutBuf *buf){
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = buf->cap = 0;
+}
+
+// 複数のバッファをこの順にfdへ書き出す。writevで書けるだけまとめて書く。
+void buf_write(int fd, OutBuf **bufs, int n){
+	struct iovec iov[64];
+	int i = 0;
+	size_t skip = 0; // bufs[i]のうち書き出し済みのバイト数
+
+	while(i < n){
+		int cnt = 0;
+		for(int j = i; j < n && cnt < sizeof(iov) / sizeof(*iov); j++){
+			size_t off = j == i ? skip : 0;
+			if(bufs[j]->len == off){
+				continue;
+			}
+			iov[cnt].iov_base = bufs[j]->data + off;
+			iov[cnt].iov_len = bufs[j]->len - off;
+			cnt++;
+		}
+		if(cnt == 0){
+			return;
+		}
+
+		ssize_t written = writev(fd, iov, cnt);
+		if(written < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			error("出力の書き込みに失敗しました: %s", strerror(errno));
+		}
+
+		// 書き込めた分だけ進める
+		while(i < n && written >= bufs[i]->len - skip){
+			written -= bufs[i]->len - skip;
+			skip = 0;
+			i++;
+		}
+		skip += written;
+	}
+}
@@ -0,0 +1,194 @@
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// ELFの再配置可能オブジェクトファイルの出力 (-c)
+//
+// セクションは .text, .rela.text, .symtab, .strtab, .shstrtab と
+// 空の .note.GNU-stack。各関数はグローバルな関数シンボルになり、
+// callの参照先はR_X86_64_PLT32で再配置する。
+
+enum {
+	SEC_NULL,
+	SEC_TEXT,
+	SEC_RELA,
+	SEC_SYMTAB,
+	SEC_STRTAB,
+	SEC_SHSTRTAB,
+	SEC_NOTE,
+	NUM_SECS,
+};
+
+static char *sec_name[] = {
+	[SEC_NULL] = "",
+	[SEC_TEXT] = ".text",
+	[SEC_RELA] = ".rela.text",
+	[SEC_SYMTAB] = ".symtab",
+	[SEC_STRTAB] = ".strtab",
+	[SEC_SHSTRTAB] = ".shstrtab",
+	[SEC_NOTE] = ".note.GNU-stack",
+};
+
+static void align_to(OutBuf *buf, size_t base, int align){
+	while((base + buf->len) % align){
+		buf_putc(buf, 0);
+	}
+}
+
+// 文字列表に名前を足し、その位置を返す
+static int add_str(OutBuf *strtab, char *s){
+	int off = strtab->len;
+	buf_putn(strtab, s, strlen(s) + 1);
+	return off;
+}
+
+// シンボル表に足し、その番号を返す
+static int add_sym(OutBuf *symtab, OutBuf *strtab, char *name, int type, int shndx, long value, long size){
+	Elf64_Sym sym = {};
+	sym.st_name = add_str(strtab, name);
+	sym.st_info = ELF64_ST_INFO(STB_GLOBAL, type);
+	sym.st_shndx = shndx;
+	sym.st_value = value;
+	sym.st_size = size;
+	buf_putn(symtab, (char *)&sym, sizeof(sym));
+	return symtab->len / sizeof(sym) - 1;
+}
+
+// 各関数の機械語 (fn->out) をまとめてfdに書き出す
+void write_obj(int fd, Function *prog){
+	OutBuf symtab = {}, strtab = {}, rela = {}, shstrtab = {};
+	HashMap syms = {}; // 名前 -> シンボル番号+1
+
+	// シンボル0はnull。ローカルシンボルはないので以降すべてグローバル。
+	Elf64_Sym null_sym = {};
+	buf_putn(&symtab, (char *)&null_sym, sizeof(null_sym));
+	buf_putc(&strtab, 0);
+
+	size_t text_size = 0;
+	int nfns = 0;
+	for(Function *fn = prog; fn; fn = fn->next){
+		int idx = add_sym(&symtab, &strtab, fn->name, STT_FUNC, SEC_TEXT, text_size, fn->out.len);
+		hashmap_put(&syms, fn->name, strlen(fn->name), (void *)(long)(idx + 1));
+		text_size += fn->out.len;
+		nfns++;
+	}
+
+	// callの再配置。定義のない関数は未定義シンボルにする。
+	size_t fn_off = 0;
+	for(Function *fn = prog; fn; fn = fn->next){
+		for(int i = 0; i < fn->nrelocs; i++){
+			Reloc *rel = &fn->relocs[i];
+			int len = strlen(rel->sym);
+			long idx = (long)hashmap_get(&syms, rel->sym, len) - 1;
+			if(idx < 0){
+				idx = add_sym(&symtab, &strtab, rel->sym, STT_NOTYPE, SHN_UNDEF, 0, 0);
+				hashmap_put(&syms, rel->sym, len, (void *)(idx + 1));
+			}
+			Elf64_Rela r = {};
+			r.r_offset = fn_off + rel->offset;
+			r.r_info = ELF64_R_INFO(idx, R_X86_64_PLT32);
+			r.r_addend = -4;
+			buf_putn(&rela, (char *)&r, sizeof(r));
+		}
+		fn_off += fn->out.len;
+	}
+	hashmap_clear(&syms);
+
+	int sec_name_off[NUM_SECS];
+	for(int i = 0; i < NUM_SECS; i++){
+		sec_name_off[i] = add_str(&shstrtab, sec_name[i]);
+	}
+
+	// .textの後ろに残りのセクションとセクションヘッダを続ける
+	size_t text_off = sizeof(Elf64_Ehdr);
+	size_t tail_off = text_off + text_size;
+	OutBuf tail = {};
+	Elf64_Shdr sh[NUM_SECS] = {};
+
+	sh[SEC_TEXT].sh_type = SHT_PROGBITS;
+	sh[SEC_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+	sh[SEC_TEXT].sh_offset = text_off;
+	sh[SEC_TEXT].sh_size = text_size;
+	sh[SEC_TEXT].sh_addralign = 16;
+
+	align_to(&tail, tail_off, 8);
+	sh[SEC_RELA].sh_type = SHT_RELA;
+	sh[SEC_RELA].sh_flags = SHF_INFO_LINK;
+	sh[SEC_RELA].sh_offset = tail_off + tail.len;
+	sh[SEC_RELA].sh_size = rela.len;
+	sh[SEC_RELA].sh_link = SEC_SYMTAB;
+	sh[SEC_RELA].sh_info = SEC_TEXT;
+	sh[SEC_RELA].sh_addralign = 8;
+	sh[SEC_RELA].sh_entsize = sizeof(Elf64_Rela);
+	buf_putn(&tail, rela.data, rela.len);
+
+	sh[SEC_SYMTAB].sh_type = SHT_SYMTAB;
+	sh[SEC_SYMTAB].sh_offset = tail_off + tail.len;
+	sh[SEC_SYMTAB].sh_size = symtab.len;
+	sh[SEC_SYMTAB].sh_link = SEC_STRTAB;
+	sh[SEC_SYMTAB].sh_info = 1; // 最初のグローバルシンボル
+	sh[SEC_SYMTAB].sh_addralign = 8;
+	sh[SEC_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+	buf_putn(&tail, symtab.data, symtab.len);
+
+	sh[SEC_STRTAB].sh_type = SHT_STRTAB;
+	sh[SEC_STRTAB].sh_offset = tail_off + tail.len;
+	sh[SEC_STRTAB].sh_size = strtab.len;
+	sh[SEC_STRTAB].sh_addralign = 1;
+	buf_putn(&tail, strtab.data, strtab.len);
+
+	sh[SEC_SHSTRTAB].sh_type = SHT_STRTAB;
+	sh[SEC_SHSTRTAB].sh_offset = tail_off + tail.len;
+	sh[SEC_SHSTRTAB].sh_size = shstrtab.len;
+	sh[SEC_SHSTRTAB].sh_addralign = 1;
+	buf_putn(&tail, shstrtab.data, shstrtab.len);
+
+	sh[SEC_NOTE].sh_type = SHT_PROGBITS;
+	sh[SEC_NOTE].sh_offset = tail_off + tail.len;
+	sh[SEC_NOTE].sh_addralign = 1;
+
+	for(int i = 0; i < NUM_SECS; i++){
+		sh[i].sh_name = sec_name_off[i];
+	}
+	align_to(&tail, tail_off, 8);
+	size_t shoff = tail_off + tail.len;
+	buf_putn(&tail, (char *)sh, sizeof(sh));
+
+	OutBuf head = {};
+	Elf64_Ehdr eh = {};
+	memcpy(eh.e_ident, ELFMAG, SELFMAG);
+	eh.e_ident[EI_CLASS] = ELFCLASS64;
+	eh.e_ident[EI_DATA] = ELFDATA2LSB;
+	eh.e_ident[EI_VERSION] = EV_CURRENT;
+	eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	eh.e_type = ET_REL;
+	eh.e_machine = EM_X86_64;
+	eh.e_version = EV_CURRENT;
+	eh.e_shoff = shoff;
+	eh.e_ehsize = sizeof(Elf64_Ehdr);
+	eh.e_shentsize = sizeof(Elf64_Shdr);
+	eh.e_shnum = NUM_SECS;
+	eh.e_shstrndx = SEC_SHSTRTAB;
+	buf_putn(&head, (char *)&eh, sizeof(eh));
+
+	// ヘッダ、各関数の機械語、残りの順に書く
+	OutBuf **bufs = malloc(sizeof(OutBuf *) * (nfns + 2));
+	int i = 0;
+	bufs[i++] = &head;
+	for(Function *fn = prog; fn; fn = fn->next){
+		bufs[i++] = &fn->out;
+	}
+	bufs[i++] = &tail;
+	buf_write(fd, bufs, i);
+
+	free(bufs);
+	buf_free(&head);
+	buf_free(&tail);
+	buf_free(&symtab);
+	buf_free(&strtab);
+	buf_free(&rela);
+	buf_free(&shstrtab);
+	free_asm(prog);
+}
@@ -0,0 +1,349 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// x86-64の機械語への変換
+//
+// codegenが作る命令だけを扱う。ラベルは関数の中で解決し、関数の外への
+// 参照 (call) はfn->relocsに記録してリンカかJITに任せる。
+// ジャンプはまず短い形式 (rel8) を仮定し、届かないものを長い形式 (rel32)
+// に直しながら、ラベルの位置が変わらなくなるまで繰り返す。
+
+static bool is_imm8(long val){
+	return -128 <= val && val <= 127;
+}
+
+static bool is_imm32(long val){
+	return -2147483648L <= val && val <= 2147483647L;
+}
+
+static void put32(OutBuf *out, long val){
+	char b[4] = { val, val >> 8, val >> 16, val >> 24 };
+	buf_putn(out, b, 4);
+}
+
+// 64ビットオペランドのREXプレフィックス
+static void rex_w(OutBuf *out, int reg, Reg rm){
+	buf_putc(out, 0x48 | (reg >> 3) << 2 | rm >> 3);
+}
+
+// ModR/M (レジスタ同士)
+static void modrm_rr(OutBuf *out, int reg, Reg rm){
+	buf_putc(out, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// ModR/M (メモリ [base+disp])
+static void modrm_mem(OutBuf *out, int reg, Reg base, long disp){
+	int mod = 2;
+	if(disp == 0 && (base & 7) != RBP){
+		mod = 0;
+	}
+	else if(is_imm8(disp)){
+		mod = 1;
+	}
+	buf_putc(out, mod << 6 | (reg & 7) << 3 | (base & 7));
+	if((base & 7) == RSP){
+		buf_putc(out, 0x24); // SIB: [rsp]
+	}
+	if(mod == 1){
+		buf_putc(out, disp);
+	}
+	else if(mod == 2){
+		put32(out, disp);
+	}
+}
+
+// 2オペランドの算術命令の "op r/m, reg" のオペコードと
+// "op r/m, imm" (0x81, 0x83) の拡張オペコード
+static int alu_op[] = {
+	[IN_ADD] = 0x01, [IN_SUB] = 0x29, [IN_AND] = 0x21, [IN_CMP] = 0x39,
+};
+static int alu_ext[] = {
+	[IN_ADD] = 0, [IN_SUB] = 5, [IN_AND] = 4, [IN_CMP] = 7,
+};
+
+// シフト (0xc1) の拡張オペコード
+static int shift_ext[] = {
+	[IN_SHL] = 4, [IN_SHR] = 5, [IN_SAR] = 7,
+};
+
+// スケール (1, 2, 4, 8) -> SIBのssビット
+static int sib_scale[] = {
+	[1] = 0, [2] = 1, [4] = 2, [8] = 3,
+};
+
+static int setcc_op[] = {
+	[IN_SETE] = 0x94, [IN_SETNE] = 0x95, [IN_SETL] = 0x9c, [IN_SETLE] = 0x9e,
+};
+
+// jccの短い形式のオペコード。長い形式は0x0fの後にこれ+0x10。
+static int jcc_op[] = {
+	[IN_JE] = 0x74, [IN_JNE] = 0x75, [IN_JL] = 0x7c, [IN_JGE] = 0x7d,
+	[IN_JLE] = 0x7e, [IN_JG] = 0x7f,
+};
+
+static bool is_jump(Inst *inst){
+	return IN_JMP <= inst->kind && inst->kind <= IN_JGE;
+}
+
+// ジャンプとラベル以外の1命令を書く
+static void encode_inst(OutBuf *out, Inst *inst){
+	switch(inst->kind){
+	case IN_PUSH:
+		if(inst->imm){
+			if(is_imm8(inst->val)){
+				buf_putc(out, 0x6a);
+				buf_putc(out, inst->val);
+			}
+			else{
+				buf_putc(out, 0x68);
+				put32(out, inst->val);
+			}
+			return;
+		}
+		if(inst->dst >= R8){
+			buf_putc(out, 0x41);
+		}
+		buf_putc(out, 0x50 + (inst->dst & 7));
+		return;
+	case IN_POP:
+		if(inst->dst >= R8){
+			buf_putc(out, 0x41);
+		}
+		buf_putc(out, 0x58 + (inst->dst & 7));
+		return;
+	case IN_MOV:
+		if(!inst->imm){
+			rex_w(out, inst->src, inst->dst);
+			buf_putc(out, 0x89);
+			modrm_rr(out, inst->src, inst->dst);
+		}
+		else if(is_imm32(inst->val)){
+			rex_w(out, 0, inst->dst);
+			buf_putc(out, 0xc7);
+			modrm_rr(out, 0, inst->dst);
+			put32(out, inst->val);
+		}
+		else{
+			// movabs
+			rex_w(out, 0, inst->dst);
+			buf_putc(out, 0xb8 + (inst->dst & 7));
+			put32(out, inst->val);
+			put32(out, inst->val >> 32);
+		}
+		return;
+	case IN_ADD:
+	case IN_SUB:
+	case IN_AND:
+	case IN_CMP:
+		if(!inst->imm){
+			rex_w(out, inst->src, inst->dst);
+			buf_putc(out, alu_op[inst->kind]);
+			modrm_rr(out, inst->src, inst->dst);
+		}
+		else if(is_imm8(inst->val)){
+			rex_w(out, 0, inst->dst);
+			buf_putc(out, 0x83);
+			modrm_rr(out, alu_ext[inst->kind], inst->dst);
+			buf_putc(out, inst->val);
+		}
+		else if(inst->dst == RAX){
+			// "op rax, imm32" の短い形式
+			buf_putc(out, 0x48);
+			buf_putc(out, alu_op[inst->kind] + 4);
+			put32(out, inst->val);
+		}
+		else{
+			rex_w(out, 0, inst->dst);
+			buf_putc(out, 0x81);
+			modrm_rr(out, alu_ext[inst->kind], inst->dst);
+			put32(out, inst->val);
+		}
+		return;
+	case IN_IMUL:
+		if(!inst->imm){
+			rex_w(out, inst->dst, inst->src);
+			buf_putn(out, "\x0f\xaf", 2);
+			modrm_rr(out, inst->dst, inst->src);
+		}
+		else{
+			// imul dst, dst, imm
+			rex_w(out, inst->dst, inst->dst);
+			buf_putc(out, is_imm8(inst->val) ? 0x6b : 0x69);
+			modrm_rr(out, inst->dst, inst->dst);
+			if(is_imm8(inst->val)){
+				buf_putc(out, inst->val);
+			}
+			else{
+				put32(out, inst->val);
+			}
+		}
+		return;
+	case IN_SHL:
+	case IN_SAR:
+	case IN_SHR:
+		rex_w(out, 0, inst->dst);
+		buf_putc(out, 0xc1);
+		modrm_rr(out, shift_ext[inst->kind], inst->dst);
+		buf_putc(out, inst->val);
+		return;
+	case IN_LEA:
+		// lea dst, [dst+src*scale]。[rbp+...] と [r13+...] はdisp8の0が要る。
+		buf_putc(out, 0x48 | (inst->dst >> 3) << 2 | (inst->src >> 3) << 1 | inst->dst >> 3);
+		buf_putc(out, 0x8d);
+		buf_putc(out, ((inst->dst & 7) == RBP ? 0x44 : 0x04) | (inst->dst & 7) << 3);
+		buf_putc(out, sib_scale[inst->val] << 6 | (inst->src & 7) << 3 | (inst->dst & 7));
+		if((inst->dst & 7) == RBP){
+			buf_putc(out, 0);
+		}
+		return;
+	case IN_LOAD:
+		rex_w(out, inst->dst, inst->src);
+		buf_putc(out, 0x8b);
+		modrm_mem(out, inst->dst, inst->src, inst->val);
+		return;
+	case IN_STORE:
+		rex_w(out, inst->src, inst->dst);
+		buf_putc(out, 0x89);
+		modrm_mem(out, inst->src, inst->dst, inst->val);
+		return;
+	case IN_CQO:
+		buf_putn(out, "\x48\x99", 2);
+		return;
+	case IN_IDIV:
+		rex_w(out, 0, inst->dst);
+		buf_putc(out, 0xf7);
+		modrm_rr(out, 7, inst->dst);
+		return;
+	case IN_MULH:
+		rex_w(out, 0, inst->dst);
+		buf_putc(out, 0xf7);
+		modrm_rr(out, 5, inst->dst);
+		return;
+	case IN_SETE:
+	case IN_SETNE:
+	case IN_SETL:
+	case IN_SETLE:
+		// setcc dst8; movzx dst, dst8
+		// spl, bpl, sil, dilはREXがないとah, ch, dh, bhになる
+		if(inst->dst >= RSP){
+			buf_putc(out, 0x40 | inst->dst >> 3);
+		}
+		buf_putc(out, 0x0f);
+		buf_putc(out, setcc_op[inst->kind]);
+		modrm_rr(out, 0, inst->dst);
+		rex_w(out, inst->dst, inst->dst);
+		buf_putn(out, "\x0f\xb6", 2);
+		modrm_rr(out, inst->dst, inst->dst);
+		return;
+	case IN_CALL:
+		// rel32は再配置で埋める
+		buf_putn(out, "\xe8\0\0\0\0", 5);
+		return;
+	case IN_RET:
+		buf_putc(out, 0xc3);
+		return;
+	}
+}
+
+static int jump_size(Inst *inst, bool is_long){
+	if(!is_long){
+		return 2;
+	}
+	return inst->kind == IN_JMP ? 5 : 6;
+}
+
+// fn->instsを機械語にしてfn->outに書き、callの再配置をfn->relocsに記録する
+void encode_insts(Function *fn){
+	int n = fn->ninsts;
+	Inst *insts = fn->insts;
+
+	// ジャンプ以外を先に機械語にする。pos[i]は命令iのcodeでの位置。
+	OutBuf code = {};
+	int *pos = malloc(sizeof(int) * (n + 1));
+	int ncalls = 0;
+	for(int i = 0; i < n; i++){
+		pos[i] = code.len;
+		if(insts[i].kind != IN_LABEL && !is_jump(&insts[i])){
+			encode_inst(&code, &insts[i]);
+		}
+		if(insts[i].kind == IN_CALL){
+			ncalls++;
+		}
+	}
+	pos[n] = code.len;
+
+	// ジャンプの長さを決める。addr[i]は命令iの最終的な位置。
+	bool *is_long = calloc(n, sizeof(bool));
+	int *addr = malloc(sizeof(int) * (n + 1));
+	int *label_addr = malloc(sizeof(int) * fn->nlabels);
+	for(;;){
+		int off = 0;
+		for(int i = 0; i < n; i++){
+			addr[i] = off;
+			if(insts[i].kind == IN_LABEL){
+				label_addr[insts[i].label] = off;
+			}
+			else if(is_jump(&insts[i])){
+				off += jump_size(&insts[i], is_long[i]);
+			}
+			else{
+				off += pos[i + 1] - pos[i];
+			}
+		}
+		addr[n] = off;
+
+		bool changed = false;
+		for(int i = 0; i < n; i++){
+			if(is_jump(&insts[i]) && !is_long[i]
+				&& !is_imm8(label_addr[insts[i].label] - (addr[i] + 2))){
+				is_long[i] = true;
+				changed = true;
+			}
+		}
+		if(!changed){
+			break;
+		}
+	}
+
+	// 書き出す
+	OutBuf *out = &fn->out;
+	buf_reserve(out, addr[n]);
+	fn->relocs = malloc(sizeof(Reloc) * ncalls);
+	fn->nrelocs = 0;
+	for(int i = 0; i < n; i++){
+		Inst *inst = &insts[i];
+		if(is_jump(inst)){
+			int size = jump_size(inst, is_long[i]);
+			long disp = label_addr[inst->label] - (addr[i] + size);
+			if(!is_long[i]){
+				buf_putc(out, inst->kind == IN_JMP ? 0xeb : jcc_op[inst->kind]);
+				buf_putc(out, disp);
+			}
+			else if(inst->kind == IN_JMP){
+				buf_putc(out, 0xe9);
+				put32(out, disp);
+			}
+			else{
+				buf_putc(out, 0x0f);
+				buf_putc(out, jcc_op[inst->kind] + 0x10);
+				put32(out, disp);
+			}
+			continue;
+		}
+		if(inst->kind == IN_CALL){
+			Reloc *rel = &fn->relocs[fn->nrelocs++];
+			rel->offset = addr[i] + 1;
+			rel->sym = inst->sym;
+		}
+		buf_putn(out, code.data + pos[i], pos[i + 1] - pos[i]);
+	}
+
+	free(label_addr);
+	free(addr);
+	free(is_long);
+	free(pos);
+	buf_free(&code);
+}
@@ -0,0 +1,280 @@
+#include <stdlib.h>
+
+#include "9cc.h"
+
+// 抽象構文木の定数畳み込み (-O1以上)
+//
+// 子は親より番号が小さいので、関数のノードを番号順に1回なめれば、
+// 親を見るときには子はもう畳み込んである。畳み込んだノードは
+// その場でND_NUMや子の中身に書き換えるので、親から見た番号は変わらない。
+//
+// アドレスを取られないint型の変数で、代入が1回だけで右辺が定数のものは、
+// 代入より後ろ (番号が大きい) の読み出しをその定数にする。代入より
+// 前の読み出しがなければ、その変数を読む箇所はなくなるので代入自体も
+// 定数にする。0での除算は畳み込まず、実行時に落ちるように残す。
+
+// 変数ごとの情報
+typedef struct {
+	int nrefs; // ND_LVARの数 (代入の左辺を含む)
+	int nassign; // 代入の数
+	int seen; // 番号順になめて、これまでに見たND_LVARの数
+	bool fixed; // 代入できない (アドレスを取られる・引数・int以外)
+	bool known; // valが分かっている
+	int val;
+} VarInfo;
+
+static VarInfo *info; // 関数の最初の変数の番号からの添字
+static int var_base;
+static bool *effect; // 副作用 (代入・関数呼び出し) を含むか。node_beginからの添字。
+static NodeId node_base;
+
+static bool is_num(NodeId node, long val){
+	return ast.kind[node] == ND_NUM && ast.lhs[node] == val;
+}
+
+// ノードnodeをsrcの中身で置き換える
+static void replace(NodeId node, NodeId src){
+	ast.kind[node] = ast.kind[src];
+	ast.ty[node] = ast.ty[src];
+	ast.lhs[node] = ast.lhs[src];
+	ast.rhs[node] = ast.rhs[src];
+}
+
+static void replace_num(NodeId node, long val){
+	ast.kind[node] = ND_NUM;
+	ast.ty[node] = int_type;
+	ast.lhs[node] = val;
+	ast.rhs[node] = 0;
+}
+
+// 2つの定数の演算。結果がintに収まらないか0での除算ならfalse。
+static bool eval(NodeKind kind, long a, long b, long *val){
+	switch(kind){
+	case ND_ADD: *val = a + b; break;
+	case ND_SUB: *val = a - b; break;
+	case ND_MUL: *val = a * b; break;
+	case ND_DIV:
+		if(b == 0){
+			return false;
+		}
+		*val = a / b;
+		break;
+	case ND_EQ: *val = a == b; break;
+	case ND_NE: *val = a != b; break;
+	case ND_LT: *val = a < b; break;
+	case ND_LE: *val = a <= b; break;
+	default:
+		return false;
+	}
+	return *val == (int)*val;
+}
+
+// 2項演算を畳み込むか、x+0, x*1, x*0 などを簡単にする
+static void fold_binary(NodeId node){
+	NodeKind kind = ast.kind[node];
+	NodeId lhs = ast.lhs[node], rhs = ast.rhs[node];
+	long val;
+
+	if(ast.kind[lhs] == ND_NUM && ast.kind[rhs] == ND_NUM){
+		if(eval(kind, ast.lhs[lhs], ast.lhs[rhs], &val)){
+			replace_num(node, val);
+		}
+		return;
+	}
+
+	switch(kind){
+	case ND_ADD:
+		if(is_num(lhs, 0)){
+			replace(node, rhs);
+			return;
+		}
+		// fallthrough
+	case ND_SUB:
+	case ND_PTR_ADD:
+	case ND_PTR_SUB:
+		if(is_num(rhs, 0)){
+			replace(node, lhs);
+		}
+		return;
+	case ND_MUL:
+		if(is_num(lhs, 1)){
+			replace(node, rhs);
+		}
+		else if(is_num(rhs, 1)){
+			replace(node, lhs);
+		}
+		else if((is_num(lhs, 0) && !effect[rhs - node_base]) || (is_num(rhs, 0) && !effect[lhs - node_base])){
+			replace_num(node, 0);
+		}
+		return;
+	case ND_DIV:
+		if(is_num(rhs, 1)){
+			replace(node, lhs);
+		}
+		return;
+	}
+}
+
+// 代入の左辺がこの関数で定数にできる変数なら、その情報を返す
+static VarInfo *assigned_var(NodeId node){
+	NodeId lhs = ast.lhs[node];
+	if(ast.kind[lhs] != ND_LVAR){
+		return NULL;
+	}
+	VarInfo *vi = &info[ast.lhs[lhs] - var_base];
+	return vi->fixed || vi->nassign != 1 ? NULL : vi;
+}
+
+static void fold_node(NodeId node){
+	NodeId lhs = ast.lhs[node];
+	NodeId rhs = ast.rhs[node];
+
+	switch(ast.kind[node]){
+	case ND_ADD:
+	case ND_PTR_ADD:
+	case ND_SUB:
+	case ND_PTR_SUB:
+	case ND_MUL:
+	case ND_DIV:
+	case ND_EQ:
+	case ND_NE:
+	case ND_LT:
+	case ND_LE:
+		fold_binary(node);
+		return;
+	case ND_LVAR: {
+		VarInfo *vi = &info[lhs - var_base];
+		vi->seen++;
+		if(vi->known){
+			replace_num(node, vi->val);
+		}
+		return;
+	}
+	case ND_ASSIGN: {
+		VarInfo *vi = assigned_var(node);
+		if(!vi || ast.kind[rhs] != ND_NUM){
+			return;
+		}
+		vi->known = true;
+		vi->val = ast.lhs[rhs];
+		// 左辺のほかにまだ読まれていなければ、以降の読み出しはすべて定数になる
+		if(vi->seen == 1){
+			replace_num(node, vi->val);
+		}
+		return;
+	}
+	case ND_IF: {
+		if(ast.kind[lhs] != ND_NUM){
+			return;
+		}
+		NodeId stmt = ast.lhs[lhs] ? ast.extra[rhs] : ast.extra[rhs + 1];
+		if(stmt){
+			replace(node, stmt);
+		}
+		else{
+			ast.kind[node] = ND_NULL;
+		}
+		return;
+	}
+	case ND_WHILE:
+		if(is_num(lhs, 0)){
+			ast.kind[node] = ND_NULL;
+		}
+		return;
+	case ND_FOR: {
+		int *f = &ast.extra[lhs]; // init, cond, inc, 本体
+		if(!f[1] || ast.kind[f[1]] != ND_NUM){
+			return;
+		}
+		if(ast.lhs[f[1]]){
+			f[1] = 0;
+		}
+		else if(f[0]){
+			replace(node, f[0]);
+		}
+		else{
+			ast.kind[node] = ND_NULL;
+		}
+		return;
+	}
+	}
+}
+
+// 関数の本体を畳み込む。add_typeで型を付けた後に呼ぶ。
+void fold_function(Function *fn){
+	if(fn->node_begin == fn->node_end){
+		return;
+	}
+	phase_push(PH_FOLD);
+
+	// 変数の番号は宣言順なので、最初の変数 (localsの末尾) から並んでいる
+	var_base = ast.nvars;
+	for(LVar *var = fn->locals; var; var = var->next){
+		var_base = var->id;
+	}
+	info = calloc(ast.nvars - var_base + 1, sizeof(VarInfo));
+	node_base = fn->node_begin;
+	effect = calloc(fn->node_end - fn->node_begin, sizeof(bool));
+
+	for(int i = 0; i < fn->nparams; i++){
+		info[fn->params[i]->id - var_base].fixed = true;
+	}
+	for(LVar *var = fn->locals; var; var = var->next){
+		if(var->ty->kind != TY_INT){
+			info[var->id - var_base].fixed = true;
+		}
+	}
+
+	// 変数の参照と代入を数え、副作用のある式に印を付ける
+	for(NodeId node = fn->node_begin; node < fn->node_end; node++){
+		NodeId lhs = ast.lhs[node];
+		NodeId rhs = ast.rhs[node];
+		bool *e = &effect[node - node_base];
+		switch(ast.kind[node]){
+		case ND_LVAR:
+			info[lhs - var_base].nrefs++;
+			break;
+		case ND_ADDR:
+			if(ast.kind[lhs] == ND_LVAR){
+				info[ast.lhs[lhs] - var_base].fixed = true;
+			}
+			*e = effect[lhs - node_base];
+			break;
+		case ND_ASSIGN:
+			if(ast.kind[lhs] == ND_LVAR){
+				info[ast.lhs[lhs] - var_base].nassign++;
+			}
+			*e = true;
+			break;
+		case ND_FUNCCALL:
+			*e = true;
+			break;
+		case ND_DEREF:
+			*e = effect[lhs - node_base];
+			break;
+		case ND_ADD:
+		case ND_PTR_ADD:
+		case ND_SUB:
+		case ND_PTR_SUB:
+		case ND_PTR_DIFF:
+		case ND_MUL:
+		case ND_DIV:
+		case ND_EQ:
+		case ND_NE:
+		case ND_LT:
+		case ND_LE:
+			*e = effect[lhs - node_base] || effect[rhs - node_base];
+			break;
+		}
+	}
+
+	for(NodeId node = fn->node_begin; node < fn->node_end; node++){
+		fold_node(node);
+	}
+
+	free(info);
+	free(effect);
+	info = NULL;
+	effect = NULL;
+	phase_pop();
+}
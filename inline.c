@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// 小さな関数のインライン展開 (-O1以上)
+//
+// 関数をパースし終えるたびに、その中の呼び出しのうち、前に定義された小さな
+// 関数を呼ぶものを本体のコピーに置き換える。呼ばれる関数は自分の中の展開を
+// 済ませてあるので、コピーにはその先の展開も含まれる。後ろで定義される関数は
+// 展開しないので相互再帰で止まらなくなることはなく、自分自身を呼ぶ関数は展開しない。
+//
+// 呼び出しを含む文をブロックにして、元の文の前にND_INLINEを置く。ND_INLINEは
+// 引数を引数のコピーに代入してから本体を実行し、本体のreturnは結果の変数に
+// 値を入れて末尾へ飛ぶ (lower.c)。呼び出しのノードはその変数の読み出しにする。
+// 呼ばれる関数の変数は、呼んだ関数のローカル変数としてコピーする。
+// whileとforの条件や増分の中の呼び出しは、文の前に出すと評価の回数が
+// 変わるので展開しない。
+//
+// 展開で作るノードは親より番号が大きくなることがあるので、型はコピー元のものを
+// 使う。畳み込みは展開の後に行い、定数の引数は本体の中まで伝わる。
+
+#define INLINE_MAX_NODES 48 // 展開する関数の大きさ (ノード数) の上限
+#define INLINE_MAX_GROWTH 4096 // 1つの関数に展開で足すノード数の上限
+
+// 文atの前に置くND_INLINE
+typedef struct {
+	NodeId at;
+	NodeId node;
+} Expansion;
+
+static HashMap candidates; // 名前 -> 展開できる関数
+
+// 展開中の関数のノードと変数の、コピーとの対応
+static NodeId node_base;
+static NodeId *node_map;
+static int var_base;
+static LVar **var_map;
+
+void inline_reset(void){
+	hashmap_clear(&candidates);
+}
+
+// 前に定義された展開できる関数。なければNULL。
+Function *inline_candidate(char *name, int len){
+	return hashmap_get(&candidates, name, len);
+}
+
+// パースし終えた関数が小さく、自分自身を呼ばなければ、後の関数で展開できるようにする
+void inline_register(Function *fn){
+	if(fn->node_end - fn->node_begin > INLINE_MAX_NODES){
+		return;
+	}
+	for(int i = 0; i < fn->nparams; i++){
+		if(fn->params[i]->ty->kind == TY_ARRAY){
+			return;
+		}
+	}
+	for(NodeId node = fn->node_begin; node < fn->node_end; node++){
+		if(ast.kind[node] == ND_FUNCCALL && ast.funcs[ast.lhs[node]] == fn->name){
+			return;
+		}
+	}
+	hashmap_put(&candidates, fn->name, strlen(fn->name), fn);
+}
+
+static NodeId map_node(NodeId node){
+	return node ? node_map[node - node_base] : 0;
+}
+
+// extraのn個のノードをコピーに置き換えた並びを新しく作る
+static int map_extra(int pos, int n){
+	int new = new_extra(n);
+	for(int i = 0; i < n; i++){
+		ast.extra[new + i] = map_node(ast.extra[pos + i]);
+	}
+	return new;
+}
+
+// 「数, ノード...」の並び
+static int map_list(int pos){
+	int n = ast.extra[pos];
+	int new = new_extra(n + 1);
+	ast.extra[new] = n;
+	for(int i = 1; i <= n; i++){
+		ast.extra[new + i] = map_node(ast.extra[pos + i]);
+	}
+	return new;
+}
+
+static NodeId new_typed(NodeKind kind, int lhs, int rhs, Type *ty){
+	NodeId node = new_node(kind);
+	ast.lhs[node] = lhs;
+	ast.rhs[node] = rhs;
+	ast.ty[node] = ty;
+	return node;
+}
+
+// fnの中の呼び出しcallを、calleeの本体のコピーを実行するND_INLINEにして返す。
+// callは結果の変数の読み出しになる。
+static NodeId expand(Function *fn, NodeId call, Function *callee){
+	// 変数の番号は宣言順なので、localsの末尾から先頭まで並んでいる
+	var_base = 0;
+	for(LVar *var = callee->locals; var; var = var->next){
+		var_base = var->id;
+	}
+	int nvars = callee->locals ? callee->locals->id - var_base + 1 : 0;
+	var_map = calloc(nvars + 1, sizeof(LVar *));
+	for(LVar *var = callee->locals; var; var = var->next){
+		var_map[var->id - var_base] = new_local(fn, var->name, var->ty);
+	}
+	LVar *ret = new_local(fn, callee->name, int_type);
+
+	// 引数の代入を本体より前の番号にしておくと、畳み込みで本体の読み出しが定数になる
+	int nparams = callee->nparams;
+	int nbody = ast.extra[callee->body];
+	NodeId *stmts = malloc(sizeof(NodeId) * (nparams + nbody + 1));
+	for(int i = 0; i < nparams; i++){
+		LVar *param = var_map[callee->params[i]->id - var_base];
+		NodeId arg = ast.extra[ast.rhs[call] + 1 + i];
+		NodeId lhs = new_typed(ND_LVAR, param->id, 0, param->ty);
+		stmts[i] = new_typed(ND_ASSIGN, lhs, arg, param->ty);
+	}
+
+	// 本体のノードをコピーしてから、子の番号をコピーの番号に付け替える
+	node_base = callee->node_begin;
+	int nnodes = callee->node_end - callee->node_begin;
+	node_map = malloc(sizeof(NodeId) * (nnodes + 1));
+	for(int i = 0; i < nnodes; i++){
+		NodeId old = node_base + i;
+		node_map[i] = new_typed(ast.kind[old], ast.lhs[old], ast.rhs[old], ast.ty[old]);
+	}
+	for(int i = 0; i < nnodes; i++){
+		NodeId node = node_map[i];
+		int lhs = ast.lhs[node];
+		int rhs = ast.rhs[node];
+		switch(ast.kind[node]){
+		case ND_NUM:
+		case ND_NULL:
+			break;
+		case ND_LVAR:
+			ast.lhs[node] = var_map[lhs - var_base]->id;
+			break;
+		case ND_IF:
+			ast.lhs[node] = map_node(lhs);
+			ast.rhs[node] = map_extra(rhs, 2);
+			break;
+		case ND_FOR:
+			ast.lhs[node] = map_extra(lhs, 4);
+			break;
+		case ND_BLOCK:
+			ast.lhs[node] = map_list(lhs);
+			break;
+		case ND_FUNCCALL:
+			ast.rhs[node] = map_list(rhs);
+			break;
+		case ND_INLINE:
+			ast.lhs[node] = map_list(lhs);
+			ast.rhs[node] = var_map[rhs - var_base]->id;
+			break;
+		default:
+			// 2項演算, ND_ASSIGN, ND_WHILE と、子が1つのもの (rhsは0)
+			ast.lhs[node] = map_node(lhs);
+			ast.rhs[node] = map_node(rhs);
+			break;
+		}
+	}
+	for(int i = 0; i < nbody; i++){
+		stmts[nparams + i] = map_node(ast.extra[callee->body + 1 + i]);
+	}
+
+	int list = new_extra(nparams + nbody + 1);
+	ast.extra[list] = nparams + nbody;
+	memcpy(&ast.extra[list + 1], stmts, sizeof(NodeId) * (nparams + nbody));
+	NodeId node = new_typed(ND_INLINE, list, ret->id, NULL);
+
+	ast.kind[call] = ND_LVAR;
+	ast.lhs[call] = ret->id;
+	ast.rhs[call] = 0;
+
+	free(stmts);
+	free(node_map);
+	free(var_map);
+	node_map = NULL;
+	var_map = NULL;
+	return node;
+}
+
+static int cmp_expansion(const void *a, const void *b){
+	const Expansion *x = a, *y = b;
+	if(x->at != y->at){
+		return x->at < y->at ? -1 : 1;
+	}
+	return x->node < y->node ? -1 : x->node > y->node;
+}
+
+// fnの中の、展開できる関数の呼び出しを展開する
+void inline_calls(Function *fn){
+	NodeId begin = fn->node_begin, end = fn->node_end;
+	if(begin == end){
+		return;
+	}
+
+	// 式ごとに、その式を含む文 (展開した本体をその前に置けるもの) を求める。
+	// 親は子より番号が大きいので、後ろから見れば親の方が先に決まる。
+	NodeId *anchor = calloc(end - begin, sizeof(NodeId)); // 0なら前に出せない
+	bool *is_stmt = calloc(end - begin, sizeof(bool));
+	for(int i = 1; i <= ast.extra[fn->body]; i++){
+		is_stmt[ast.extra[fn->body + i] - begin] = true;
+	}
+	for(NodeId node = end - 1; node >= begin; node--){
+		int lhs = ast.lhs[node];
+		int rhs = ast.rhs[node];
+		NodeId at = anchor[node - begin];
+		if(is_stmt[node - begin]){
+			switch(ast.kind[node]){
+			case ND_BLOCK:
+				for(int i = 1; i <= ast.extra[lhs]; i++){
+					is_stmt[ast.extra[lhs + i] - begin] = true;
+				}
+				continue;
+			case ND_IF:
+				anchor[lhs - begin] = node;
+				for(int i = 0; i < 2; i++){
+					if(ast.extra[rhs + i]){
+						is_stmt[ast.extra[rhs + i] - begin] = true;
+					}
+				}
+				continue;
+			case ND_WHILE:
+				is_stmt[rhs - begin] = true;
+				continue;
+			case ND_FOR: {
+				int *f = &ast.extra[lhs]; // init, cond, inc, 本体
+				if(f[0]){
+					anchor[f[0] - begin] = node;
+				}
+				is_stmt[f[3] - begin] = true;
+				continue;
+			}
+			case ND_RETURN:
+				anchor[lhs - begin] = node;
+				continue;
+			case ND_NULL:
+				continue;
+			default:
+				// 式文
+				at = anchor[node - begin] = node;
+				break;
+			}
+		}
+		if(!at){
+			continue;
+		}
+		switch(ast.kind[node]){
+		case ND_NUM:
+		case ND_LVAR:
+			break;
+		case ND_FUNCCALL:
+			for(int i = 1; i <= ast.extra[rhs]; i++){
+				anchor[ast.extra[rhs + i] - begin] = at;
+			}
+			break;
+		default:
+			anchor[lhs - begin] = at;
+			if(rhs){
+				anchor[rhs - begin] = at;
+			}
+			break;
+		}
+	}
+
+	// 引数の中の呼び出しから順に展開する
+	Expansion *exps = NULL;
+	int nexps = 0;
+	int grown = 0;
+	for(NodeId node = begin; node < end; node++){
+		if(ast.kind[node] != ND_FUNCCALL || !anchor[node - begin]){
+			continue;
+		}
+		char *name = ast.funcs[ast.lhs[node]];
+		Function *callee = inline_candidate(name, strlen(name));
+		if(!callee || ast.extra[ast.rhs[node]] != callee->nparams){
+			continue;
+		}
+		int size = callee->node_end - callee->node_begin;
+		if(grown + size > INLINE_MAX_GROWTH){
+			continue;
+		}
+		grown += size;
+		exps = realloc(exps, sizeof(Expansion) * (nexps + 1));
+		exps[nexps].at = anchor[node - begin];
+		exps[nexps].node = expand(fn, node, callee);
+		nexps++;
+	}
+
+	// 文atを、展開した本体の後に元の文を置くブロックにする
+	qsort(exps, nexps, sizeof(Expansion), cmp_expansion);
+	for(int i = 0; i < nexps;){
+		NodeId at = exps[i].at;
+		int n = 0;
+		while(i + n < nexps && exps[i + n].at == at){
+			n++;
+		}
+		NodeId copy = new_typed(ast.kind[at], ast.lhs[at], ast.rhs[at], ast.ty[at]);
+		int list = new_extra(n + 2);
+		ast.extra[list] = n + 1;
+		for(int k = 0; k < n; k++){
+			ast.extra[list + 1 + k] = exps[i + k].node;
+		}
+		ast.extra[list + n + 1] = copy;
+		ast.kind[at] = ND_BLOCK;
+		ast.lhs[at] = list;
+		ast.rhs[at] = 0;
+		i += n;
+	}
+
+	fn->node_end = ast.len;
+	ast.ntyped = ast.len;
+	free(exps);
+	free(anchor);
+	free(is_stmt);
+}
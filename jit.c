@@ -0,0 +1,108 @@
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "9cc.h"
+
+// JIT実行 (--run)
+//
+// 各関数の機械語 (-c と同じもの) を1つの領域に並べ、callのrel32を
+// 直接埋めてからmainを呼ぶ。プログラムの外の関数はdlsymで探す。
+// 共有ライブラリは領域から2GB以上離れていることがあるので、
+// 領域の末尾に置いた中継 (jmp [rip+0]; .quad 飛び先) を経由して呼ぶ。
+
+#define TRAMPOLINE_SIZE 16
+
+static void put32_at(char *p, long val){
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+// progを実行し、mainの返り値を返す
+int run_jit(Function *prog){
+	HashMap fn_off = {}; // 関数名 -> 領域の先頭からの位置+1
+	HashMap ext_idx = {}; // 外部の関数名 -> 中継の番号+1
+	void **ext_addr = NULL;
+	int next = 0;
+
+	size_t code_size = 0;
+	for(Function *fn = prog; fn; fn = fn->next){
+		hashmap_put(&fn_off, fn->name, strlen(fn->name), (void *)(code_size + 1));
+		code_size += fn->out.len;
+	}
+	if(!hashmap_get(&fn_off, "main", 4)){
+		error("関数 'main' がありません。");
+	}
+
+	// 外部の関数を探す
+	void *self = dlopen(NULL, RTLD_NOW);
+	for(Function *fn = prog; fn; fn = fn->next){
+		for(int i = 0; i < fn->nrelocs; i++){
+			char *sym = fn->relocs[i].sym;
+			int len = strlen(sym);
+			if(hashmap_get(&fn_off, sym, len) || hashmap_get(&ext_idx, sym, len)){
+				continue;
+			}
+			void *addr = dlsym(self, sym);
+			if(!addr){
+				error("関数 '%s' が見つかりません。", sym);
+			}
+			ext_addr = realloc(ext_addr, sizeof(void *) * (next + 1));
+			ext_addr[next++] = addr;
+			hashmap_put(&ext_idx, sym, len, (void *)(long)next);
+		}
+	}
+	dlclose(self);
+
+	// 機械語と中継を並べる
+	size_t tramp_off = (code_size + 15) & ~15;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t map_size = (tramp_off + next * TRAMPOLINE_SIZE + page - 1) / page * page;
+	char *mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED){
+		error("実行用のメモリを確保できません。");
+	}
+
+	for(int i = 0; i < next; i++){
+		char *t = mem + tramp_off + i * TRAMPOLINE_SIZE;
+		memcpy(t, "\xff\x25\0\0\0\0", 6);
+		memcpy(t + 6, &ext_addr[i], 8);
+	}
+
+	size_t off = 0;
+	for(Function *fn = prog; fn; fn = fn->next){
+		memcpy(mem + off, fn->out.data, fn->out.len);
+		for(int i = 0; i < fn->nrelocs; i++){
+			Reloc *rel = &fn->relocs[i];
+			int len = strlen(rel->sym);
+			size_t target = (size_t)hashmap_get(&fn_off, rel->sym, len);
+			if(target){
+				target--;
+			}
+			else{
+				target = tramp_off + ((long)hashmap_get(&ext_idx, rel->sym, len) - 1) * TRAMPOLINE_SIZE;
+			}
+			size_t at = off + rel->offset;
+			put32_at(mem + at, (long)target - (long)(at + 4));
+		}
+		off += fn->out.len;
+	}
+
+	if(mprotect(mem, map_size, PROT_READ | PROT_EXEC) < 0){
+		error("実行用のメモリを実行可能にできません。");
+	}
+
+	int (*main_fn)(void) = (void *)(mem + (size_t)hashmap_get(&fn_off, "main", 4) - 1);
+	hashmap_clear(&fn_off);
+	hashmap_clear(&ext_idx);
+	free(ext_addr);
+	free_asm(prog);
+
+	int ret = main_fn();
+	munmap(mem, map_size);
+	return ret;
+}
@@ -0,0 +1,411 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// 抽象構文木から中間表現への変換 (-O1以上)
+//
+// 式の値はすべて仮想レジスタに置く。アドレスを取られないint・ポインタの
+// 変数はそれ自身が仮想レジスタになり、配列とアドレスを取られる変数だけを
+// スタックフレームに置く。式の中には分岐がないので、一時的な値の
+// 仮想レジスタは基本ブロックをまたがない。
+
+static _Thread_local IrFunc *irf; // 変換中の関数
+static _Thread_local LVar *ret_var; // インライン展開した本体の結果の変数 (NULLなら関数から戻る)
+static _Thread_local int ret_label; // その本体の末尾のラベル
+
+static Ir *new_ir(IrOp op){
+	if(irf->len == irf->cap){
+		irf->cap = irf->cap ? irf->cap * 2 : 256;
+		irf->code = realloc(irf->code, sizeof(Ir) * irf->cap);
+	}
+	Ir *ir = &irf->code[irf->len++];
+	memset(ir, 0, sizeof(Ir));
+	ir->op = op;
+	ir->dst = ir->a = ir->b = -1;
+	return ir;
+}
+
+static int new_vreg(void){
+	return irf->nvregs++;
+}
+
+// dstが-1なら新しい仮想レジスタを返す
+static int dst_or_new(int dst){
+	return dst >= 0 ? dst : new_vreg();
+}
+
+static void ir_label(int label){
+	new_ir(IR_LABEL)->label = label;
+}
+
+static void ir_jmp(int label){
+	new_ir(IR_JMP)->label = label;
+}
+
+// 2項演算。bが定数ならその値を即値として使う。
+static void ir_binop(IrOp op, int dst, int a, NodeId rhs, int b){
+	Ir *ir = new_ir(op);
+	ir->dst = dst;
+	ir->a = a;
+	if(rhs && ast.kind[rhs] == ND_NUM){
+		ir->bimm = true;
+		ir->imm = ast.lhs[rhs];
+	}
+	else{
+		ir->b = b;
+	}
+}
+
+static int lower_expr(NodeId node, int dst);
+static int lower_body(int list);
+
+// 右辺が定数ならそれを即値にし、評価しない
+static int lower_rhs(NodeId rhs){
+	return ast.kind[rhs] == ND_NUM ? -1 : lower_expr(rhs, -1);
+}
+
+// 比較のノードならその演算を*opに書いてtrueを返す
+static bool is_cmp(NodeKind kind, IrOp *op){
+	switch(kind){
+	case ND_EQ: *op = IR_EQ; return true;
+	case ND_NE: *op = IR_NE; return true;
+	case ND_LT: *op = IR_LT; return true;
+	case ND_LE: *op = IR_LE; return true;
+	}
+	return false;
+}
+
+// ポインタ ± 整数。整数に要素の大きさを掛けてから足す。
+static int lower_ptr_arith(IrOp op, NodeId node, int dst){
+	long size = ast.ty[node]->base->size;
+	NodeId rhs = ast.rhs[node];
+	int a = lower_expr(ast.lhs[node], -1);
+
+	long imm = ast.kind[rhs] == ND_NUM ? ast.lhs[rhs] * size : 0;
+	if(ast.kind[rhs] == ND_NUM && imm == (int)imm){
+		Ir *ir = new_ir(op);
+		ir->dst = dst_or_new(dst);
+		ir->a = a;
+		ir->bimm = true;
+		ir->imm = imm;
+		return ir->dst;
+	}
+
+	int b = lower_expr(rhs, -1);
+	Ir *mul = new_ir(IR_MUL);
+	mul->dst = new_vreg();
+	mul->a = b;
+	mul->bimm = true;
+	mul->imm = size;
+	int t = mul->dst;
+
+	Ir *ir = new_ir(op);
+	ir->dst = dst_or_new(dst);
+	ir->a = a;
+	ir->b = t;
+	return ir->dst;
+}
+
+// 式の値を計算し、それが入った仮想レジスタを返す。
+// dstが-1でなければ結果をdstに入れる。
+static int lower_expr(NodeId node, int dst){
+	int lhs = ast.lhs[node];
+	int rhs = ast.rhs[node];
+
+	switch(ast.kind[node]){
+	case ND_NUM: {
+		Ir *ir = new_ir(IR_IMM);
+		ir->dst = dst_or_new(dst);
+		ir->imm = lhs;
+		return ir->dst;
+	}
+	case ND_LVAR: {
+		LVar *var = ast.vars[lhs];
+		if(var->vreg >= 0){
+			if(dst >= 0 && dst != var->vreg){
+				Ir *ir = new_ir(IR_MOV);
+				ir->dst = dst;
+				ir->a = var->vreg;
+				return dst;
+			}
+			return var->vreg;
+		}
+		// 配列は先頭のアドレスが値
+		Ir *ir = new_ir(var->ty->kind == TY_ARRAY ? IR_ADDR : IR_LOADVAR);
+		ir->dst = dst_or_new(dst);
+		ir->var = var;
+		return ir->dst;
+	}
+	case ND_ADDR:
+		if(ast.kind[lhs] == ND_LVAR){
+			Ir *ir = new_ir(IR_ADDR);
+			ir->dst = dst_or_new(dst);
+			ir->var = ast.vars[ast.lhs[lhs]];
+			return ir->dst;
+		}
+		// &*p は p
+		return lower_expr(ast.lhs[lhs], dst);
+	case ND_DEREF: {
+		if(ast.ty[node]->kind == TY_ARRAY){
+			return lower_expr(lhs, dst);
+		}
+		int a = lower_expr(lhs, -1);
+		Ir *ir = new_ir(IR_LOAD);
+		ir->dst = dst_or_new(dst);
+		ir->a = a;
+		return ir->dst;
+	}
+	case ND_ASSIGN: {
+		int val;
+		if(ast.kind[lhs] == ND_LVAR && ast.vars[ast.lhs[lhs]]->vreg >= 0){
+			val = lower_expr(rhs, ast.vars[ast.lhs[lhs]]->vreg);
+		}
+		else if(ast.kind[lhs] == ND_LVAR){
+			val = lower_expr(rhs, -1);
+			Ir *ir = new_ir(IR_STOREVAR);
+			ir->var = ast.vars[ast.lhs[lhs]];
+			ir->a = val;
+		}
+		else{
+			int addr = lower_expr(ast.lhs[lhs], -1);
+			val = lower_expr(rhs, -1);
+			Ir *ir = new_ir(IR_STORE);
+			ir->a = addr;
+			ir->b = val;
+		}
+		if(dst >= 0 && dst != val){
+			Ir *ir = new_ir(IR_MOV);
+			ir->dst = dst;
+			ir->a = val;
+			return dst;
+		}
+		return val;
+	}
+	case ND_FUNCCALL: {
+		int *list = &ast.extra[rhs];
+		int nargs = list[0];
+		if(nargs > 6){
+			error("関数 '%s' の引数が多すぎます。", ast.funcs[lhs]);
+		}
+		int *args = malloc(sizeof(int) * (nargs ? nargs : 1));
+		for(int i = 0; i < nargs; i++){
+			args[i] = lower_expr(list[i + 1], -1);
+		}
+		Ir *ir = new_ir(IR_CALL);
+		ir->dst = dst_or_new(dst);
+		ir->sym = ast.funcs[lhs];
+		ir->args = args;
+		ir->nargs = nargs;
+		return ir->dst;
+	}
+	case ND_PTR_ADD:
+		return lower_ptr_arith(IR_ADD, node, dst);
+	case ND_PTR_SUB:
+		return lower_ptr_arith(IR_SUB, node, dst);
+	case ND_PTR_DIFF: {
+		int a = lower_expr(lhs, -1);
+		int b = lower_expr(rhs, -1);
+		int t = new_vreg();
+		ir_binop(IR_SUB, t, a, 0, b);
+		Ir *ir = new_ir(IR_DIV);
+		ir->dst = dst_or_new(dst);
+		ir->a = t;
+		ir->bimm = true;
+		ir->imm = ast.ty[lhs]->base->size;
+		ir->exact = true;
+		return ir->dst;
+	}
+	case ND_NULL:
+		return -1;
+	}
+
+	static IrOp binop[] = {
+		[ND_ADD] = IR_ADD, [ND_SUB] = IR_SUB, [ND_MUL] = IR_MUL, [ND_DIV] = IR_DIV,
+		[ND_EQ] = IR_EQ, [ND_NE] = IR_NE, [ND_LT] = IR_LT, [ND_LE] = IR_LE,
+	};
+	int a = lower_expr(lhs, -1);
+	int b = lower_rhs(rhs);
+	dst = dst_or_new(dst);
+	ir_binop(binop[ast.kind[node]], dst, a, rhs, b);
+	return dst;
+}
+
+// 条件式condが偽ならlabelへ飛ぶ。比較はそのまま分岐にする。
+static void lower_cond(NodeId cond, int label){
+	if(!cond){
+		return;
+	}
+	if(ast.kind[cond] == ND_NUM){
+		// 畳み込みで定数になった条件
+		if(!ast.lhs[cond]){
+			ir_jmp(label);
+		}
+		return;
+	}
+	IrOp op;
+	Ir *ir;
+	if(is_cmp(ast.kind[cond], &op)){
+		int a = lower_expr(ast.lhs[cond], -1);
+		int b = lower_rhs(ast.rhs[cond]);
+		ir_binop(IR_BR, -1, a, ast.rhs[cond], b);
+		ir = &irf->code[irf->len - 1];
+		ir->cond = op;
+	}
+	else{
+		int a = lower_expr(cond, -1);
+		ir = new_ir(IR_BR);
+		ir->cond = IR_NE;
+		ir->a = a;
+		ir->bimm = true;
+		ir->imm = 0;
+	}
+	ir->label = label;
+}
+
+// 文を変換する。式文ならその値の仮想レジスタ、それ以外は-1を返す。
+static int lower_stmt(NodeId node){
+	if(!node){
+		return -1;
+	}
+	int lhs = ast.lhs[node];
+	int rhs = ast.rhs[node];
+
+	switch(ast.kind[node]){
+	case ND_RETURN: {
+		if(ret_var){
+			lower_expr(lhs, ret_var->vreg);
+			ir_jmp(ret_label);
+			return -1;
+		}
+		int val = lower_expr(lhs, -1);
+		new_ir(IR_RET)->a = val;
+		return -1;
+	}
+	case ND_IF: {
+		NodeId then = ast.extra[rhs];
+		NodeId els = ast.extra[rhs + 1];
+		int n = new_label();
+		lower_cond(lhs, label_id(els ? L_ELSE : L_END, n));
+		lower_stmt(then);
+		if(els){
+			ir_jmp(label_id(L_END, n));
+			ir_label(label_id(L_ELSE, n));
+			lower_stmt(els);
+		}
+		ir_label(label_id(L_END, n));
+		return -1;
+	}
+	case ND_WHILE: {
+		int n = new_label();
+		ir_label(label_id(L_BEGIN, n));
+		lower_cond(lhs, label_id(L_END, n));
+		lower_stmt(rhs);
+		ir_jmp(label_id(L_BEGIN, n));
+		ir_label(label_id(L_END, n));
+		return -1;
+	}
+	case ND_FOR: {
+		int *f = &ast.extra[lhs]; // init, cond, inc, 本体
+		int n = new_label();
+		lower_stmt(f[0]);
+		ir_label(label_id(L_BEGIN, n));
+		lower_cond(f[1], label_id(L_END, n));
+		lower_stmt(f[3]);
+		lower_stmt(f[2]);
+		ir_jmp(label_id(L_BEGIN, n));
+		ir_label(label_id(L_END, n));
+		return -1;
+	}
+	case ND_BLOCK: {
+		// 値は最後の文の値 (インライン展開した呼び出しを含む式文をブロックにしたとき)
+		int last = -1;
+		for(int i = 1, *list = &ast.extra[lhs]; i <= list[0]; i++){
+			last = lower_stmt(list[i]);
+		}
+		return last;
+	}
+	case ND_INLINE: {
+		LVar *outer_var = ret_var;
+		int outer_label = ret_label;
+		ret_var = ast.vars[rhs];
+		ret_label = label_id(L_END, new_label());
+		int last = lower_body(lhs);
+		// 最後まで来たら、関数から戻るときと同じく最後の式文の値か0になる
+		Ir *ir = new_ir(last >= 0 ? IR_MOV : IR_IMM);
+		ir->dst = ret_var->vreg;
+		ir->a = last;
+		ir_label(ret_label);
+		ret_var = outer_var;
+		ret_label = outer_label;
+		return -1;
+	}
+	case ND_NUM:
+		// 値を使わない定数 (畳み込みで代入が消えたものなど)
+		return -1;
+	}
+	return lower_expr(node, -1);
+}
+
+// 関数の本体の文の並び (extraの位置) を変換する。最後の文が式文なら、
+// returnがなくてもその値を返すので、その仮想レジスタを返す。
+static int lower_body(int list){
+	int *body = &ast.extra[list];
+	int last = -1;
+	for(int i = 1; i <= body[0]; i++){
+		last = lower_stmt(body[i]);
+	}
+	if(body[0] && ast.kind[body[body[0]]] == ND_NUM){
+		last = lower_expr(body[body[0]], -1);
+	}
+	return last;
+}
+
+// fnを中間表現にする
+IrFunc *lower_function(Function *fn){
+	irf = calloc(1, sizeof(IrFunc));
+
+	// アドレスを取られる変数と配列はメモリに置く
+	for(LVar *var = fn->locals; var; var = var->next){
+		var->vreg = var->ty->kind == TY_ARRAY ? -1 : 0;
+	}
+	for(NodeId node = fn->node_begin; node < fn->node_end; node++){
+		if(ast.kind[node] == ND_ADDR && ast.kind[ast.lhs[node]] == ND_LVAR){
+			ast.vars[ast.lhs[ast.lhs[node]]]->vreg = -1;
+		}
+	}
+	int nvars = 0;
+	for(LVar *var = fn->locals; var; var = var->next){
+		if(var->vreg == 0){
+			nvars++;
+		}
+	}
+	for(LVar *var = fn->locals; var; var = var->next){
+		if(var->vreg == 0){
+			var->vreg = irf->nvregs++;
+		}
+	}
+	irf->nvars = nvars;
+
+	for(int i = 0; i < fn->nparams; i++){
+		Ir *ir = new_ir(IR_PARAM);
+		ir->imm = i;
+		ir->var = fn->params[i];
+		ir->dst = fn->params[i]->vreg;
+	}
+
+	int last = lower_body(fn->body);
+	new_ir(IR_RET)->a = last;
+
+	IrFunc *ret = irf;
+	irf = NULL;
+	return ret;
+}
+
+void free_ir(IrFunc *f){
+	for(int i = 0; i < f->len; i++){
+		free(f->code[i].args);
+	}
+	free(f->code);
+	free(f);
+}
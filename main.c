@@ -4,38 +4,351 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "9cc.h"
 
 Token *token; // 現在注目しているトークン
 char *user_input; // 入力プログラム
+char *filename; // 入力ファイル名 (エラー表示用)
 
+static char *input_map; // mmapした入力の先頭 (readした場合はNULL)
+static size_t input_map_size;
 
-int main(int argc, char **argv){
+// 通常ファイルをmmapする。ファイル末尾の直後には必ず'\0'が来るように、
+// まず1バイト多く匿名領域を確保し、その先頭にファイルを重ねてマップする。
+static char *map_file(int fd, size_t size){
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t map_size = (size + 1 + page - 1) / page * page;
 
-    if(argc != 2){
-        fprintf(stderr, "コマンドライン引数の数が正しくありません。\n");
-        return 1;
+    char *buf = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buf == MAP_FAILED){
+        return NULL;
+    }
+    if(mmap(buf, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED){
+        munmap(buf, map_size);
+        return NULL;
+    }
+    madvise(buf, size, MADV_SEQUENTIAL);
+
+    input_map = buf;
+    input_map_size = map_size;
+    return buf;
+}
+
+// パイプや標準入力など、mmapできない入力はバッファに読み込む
+static char *slurp_file(int fd){
+    size_t cap = 4096, len = 0;
+    char *buf = malloc(cap);
+
+    for(;;){
+        if(cap - len < 2){
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        ssize_t n = read(fd, buf + len, cap - len - 1);
+        if(n == 0){
+            break;
+        }
+        if(n < 0){
+            error("%s の読み込みに失敗しました。", filename);
+        }
+        len += n;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+// ファイルの内容を'\0'終端の文字列として返す。"-"は標準入力。
+char *read_file(char *path){
+    int fd = 0;
+    if(strcmp(path, "-")){
+        fd = open(path, O_RDONLY);
+        if(fd < 0){
+            error("%s を開けません。", path);
+        }
     }
 
-	// トークナイズして、抽象構文木を生成
-	user_input = argv[1];
-	token = tokenize(user_input);
+    char *buf = NULL;
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        buf = map_file(fd, st.st_size);
+    }
+    if(!buf){
+        buf = slurp_file(fd);
+    }
+
+    if(fd != 0){
+        close(fd);
+    }
+    return buf;
+}
+
+static void release_file(char *buf){
+    if(input_map){
+        munmap(input_map, input_map_size);
+        input_map = NULL;
+    }
+    else{
+        free(buf);
+    }
+}
+
+// 出力ファイルを開く
+int open_output(char *path){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        error("%s を開けません。", path);
+    }
+    return fd;
+}
+
+// user_inputをコンパイルする。各関数のアセンブリはfn->outに入る。
+Function *compile(int njobs){
+	// 抽象構文木を生成。トークンはパーサが読み進めるたびに切り出すので、
+	// トークナイズの時間はほとんどparseに含まれる。
+	phase_push(PH_TOKENIZE);
+	lexer_start(user_input);
+	phase_pop();
+
+	phase_push(PH_PARSE);
     Function *prog = program();
+	phase_pop();
 
     // ローカル変数の offset を設定
+	phase_push(PH_FRAME);
     for(Function *fn = prog; fn; fn = fn->next){
         int offset = 0;
-        for(LVar *lvar = prog->locals; lvar; lvar = lvar->next){
+        for(LVar *lvar = fn->locals; lvar; lvar = lvar->next){
             offset += lvar->ty->size;
             lvar->offset = offset;
         }
-        fn->stack_size = offset;
+        fn->stack_size = (offset + 15) / 16 * 16;
+    }
+	phase_pop();
+
+	phase_push(PH_CODEGEN);
+    codegen(prog, njobs);
+	phase_pop();
+
+    if(cache_dir){
+        cache_store(prog);
+    }
+
+    return prog;
+}
+
+// 次のコンパイルに備えて状態を初期化し、メモリをまとめて回収する
+void reset_compiler(void){
+    token = NULL;
+    parse_reset();
+    arena_reset_all();
+}
+
+static void usage(void){
+    fprintf(stderr, "使い方: 9cc [オプション] <プログラム>\n");
+    fprintf(stderr, "        9cc [オプション] -f <ファイル>  (\"-\"で標準入力)\n");
+    fprintf(stderr, "オプション:\n");
+    fprintf(stderr, "  -o <ファイル>     出力先 (省略時は標準出力)\n");
+    fprintf(stderr, "  -c                アセンブリではなくELFのオブジェクトファイルを出力する\n");
+    fprintf(stderr, "  --run             出力せずにメモリ上で実行し、mainの返り値で終了する\n");
+    fprintf(stderr, "  --cache=<ディレクトリ>  関数ごとの生成結果をキャッシュする\n");
+    fprintf(stderr, "  --lex=<実装>      字句解析の実装を選ぶ (scalar, sse2, avx2)\n");
+    fprintf(stderr, "  --lex-check       すべての字句解析の実装で同じトークン列になるか確かめる\n");
+    fprintf(stderr, "  -O<N>             最適化のレベル (0: スタックマシン, 1: レジスタ割り付け,\n");
+    fprintf(stderr, "                    2: SSA形式での最適化も, 省略時は1)\n");
+    fprintf(stderr, "  -j <N>            N個のスレッドで関数ごとにコード生成する\n");
+    fprintf(stderr, "  --arena-report    アリーナの使用量を表示する\n");
+    fprintf(stderr, "  --peephole-report のぞき穴最適化のパターンごとの書き換え回数を表示する\n");
+    fprintf(stderr, "  --time-report     フェーズごとの時間とメモリを表示する\n");
+    fprintf(stderr, "  --time-report=json  同じ内容をJSONで表示する\n");
+    fprintf(stderr, "  --server[=<ソケット>]  コンパイルサーバとして動く (省略時は標準入出力)\n");
+    fprintf(stderr, "  --client=<ソケット>    サーバにコンパイルを依頼する\n");
+    exit(1);
+}
+
+int main(int argc, char **argv){
+
+    bool opt_arena_report = false;
+    bool opt_peephole_report = false;
+    char *input_path = NULL;
+    char *program_text = NULL;
+    char *output_path = NULL;
+    int njobs = 1;
+    char *server_path = NULL;
+    char *client_path = NULL;
+    bool server = false;
+    bool run = false;
+    bool lex_check_only = false;
+
+    for(int i = 1; i < argc; i++){
+        if(!strcmp(argv[i], "--arena-report")){
+            opt_arena_report = true;
+            continue;
+        }
+        if(!strcmp(argv[i], "--peephole-report")){
+            opt_peephole_report = true;
+            continue;
+        }
+        if(!strcmp(argv[i], "--time-report")){
+            stats.enabled = true;
+            continue;
+        }
+        if(!strcmp(argv[i], "--time-report=json")){
+            stats.enabled = true;
+            stats.json = true;
+            continue;
+        }
+        if(!strcmp(argv[i], "--server")){
+            server = true;
+            continue;
+        }
+        if(!strncmp(argv[i], "--server=", 9)){
+            server = true;
+            server_path = argv[i] + 9;
+            continue;
+        }
+        if(!strncmp(argv[i], "--client=", 9)){
+            client_path = argv[i] + 9;
+            continue;
+        }
+        if(!strncmp(argv[i], "--cache=", 8)){
+            cache_open(argv[i] + 8);
+            continue;
+        }
+        if(!strncmp(argv[i], "--lex=", 6)){
+            set_scanner(argv[i] + 6);
+            continue;
+        }
+        if(!strcmp(argv[i], "--lex-check")){
+            lex_check_only = true;
+            continue;
+        }
+        if(!strcmp(argv[i], "--run")){
+            run = true;
+            continue;
+        }
+        if(!strncmp(argv[i], "-O", 2)){
+            char *arg = argv[i] + 2;
+            if(*arg && (!isdigit(*arg) || arg[1])){
+                usage();
+            }
+            opt_level = *arg ? *arg - '0' : 1;
+            continue;
+        }
+        if(!strcmp(argv[i], "-c")){
+            out_format = OUT_OBJ;
+            continue;
+        }
+        if(!strcmp(argv[i], "-o")){
+            if(++i == argc){
+                usage();
+            }
+            output_path = argv[i];
+            continue;
+        }
+        if(!strncmp(argv[i], "-j", 2)){
+            char *arg = argv[i][2] ? argv[i] + 2 : argv[++i];
+            if(!arg || (njobs = atoi(arg)) < 1){
+                usage();
+            }
+            continue;
+        }
+        if(!strcmp(argv[i], "-f")){
+            if(++i == argc || input_path || program_text){
+                usage();
+            }
+            input_path = argv[i];
+            continue;
+        }
+        if(input_path || program_text){
+            usage();
+        }
+        program_text = argv[i];
     }
 
+    if(server){
+        if(input_path || program_text || client_path || out_format != OUT_ASM || run){
+            usage();
+        }
+        return run_server(server_path, njobs);
+    }
 
+    if(input_path){
+        filename = strcmp(input_path, "-") ? input_path : "<stdin>";
+        user_input = read_file(input_path);
+    }
+    else if(program_text){
+        filename = "<command-line>";
+        user_input = program_text;
+    }
+    else{
+        fprintf(stderr, "コマンドライン引数の数が正しくありません。\n");
+        usage();
+    }
+
+    if(lex_check_only){
+        return lex_check(user_input, stdout) ? 0 : 1;
+    }
+
+    if(client_path){
+        if(out_format != OUT_ASM || run){
+            usage();
+        }
+        return run_client(client_path, user_input, output_path);
+    }
 
-    codegen(prog);
+    if(run){
+        if(output_path || out_format != OUT_ASM){
+            usage();
+        }
+        out_format = OUT_OBJ;
+    }
+
+    Function *prog = compile(njobs);
+
+    int status = 0;
+    if(run){
+        phase_push(PH_RUN);
+        status = run_jit(prog);
+        phase_pop();
+    }
+    else{
+        phase_push(PH_OUTPUT);
+        int fd = output_path ? open_output(output_path) : 1;
+        if(out_format == OUT_OBJ){
+            write_obj(fd, prog);
+        }
+        else{
+            write_asm(fd, prog, NULL);
+        }
+        if(fd != 1){
+            close(fd);
+        }
+        phase_pop();
+    }
+
+    // トークン・AST・型をまとめて解放
+	phase_push(PH_FREE);
+    arena_free_all();
+    ast_free();
+    if(input_path){
+        release_file(user_input);
+    }
+	phase_pop();
+
+    if(opt_arena_report){
+        arena_report(stderr);
+    }
+    if(opt_peephole_report){
+        peephole_report(stderr);
+    }
+    if(stats.enabled){
+        stats_report(stderr);
+    }
 
-    return 0;
+    return status;
 }
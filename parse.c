@@ -10,144 +10,308 @@
 
 extern Token *token;
 LVar *locals;
+Ast ast;
 
+static HashMap var_table; // 名前 -> 現在見えている変数
+static Scope *scope; // 現在のスコープ
+
+// 文の並びや引数を集めるスタック。入れ子のブロックは上に積み、
+// 集め終わったらextraに移す。
+static int *list_stack;
+static int list_len;
+static int list_cap;
+
+static void expr_reset(void);
+
+
+// 前のコンパイルの状態を捨てる
+void parse_reset(void){
+	hashmap_clear(&var_table);
+	scope = NULL;
+	locals = NULL;
+	list_len = 0;
+	expr_reset();
+	ast_reset();
+	inline_reset();
+}
+
+void enter_scope(void){
+	Scope *sc = arena_alloc(&node_arena, sizeof(Scope));
+	sc->parent = scope;
+	scope = sc;
+}
+
+// スコープを抜ける。このスコープで宣言された変数を隠していた
+// 外側の変数を見えるように戻す。
+void leave_scope(void){
+	for(LVar *var = scope->vars; var; var = var->scope_next){
+		hashmap_put(&var_table, var->name, var->len, var->shadow);
+	}
+	scope = scope->parent;
+}
 
 // 変数を名前で検索する。ない場合はNULL。
 LVar *find_lvar(Token *tok){
-	for(LVar *var = locals; var; var = var->next){
-		if(var->len == tok->len && !memcmp(tok->str, var->name, var->len)){
-			return var;
-		}
+	return hashmap_get(&var_table, tok->str, tok->len);
+}
+
+
+//---- 抽象構文木の配列 ----
+
+// 配列*pを少なくともn要素の大きさにする
+static void ast_grow(void **p, int *cap, int n, size_t elem){
+	if(n <= *cap){
+		return;
 	}
-	return NULL;
+	int new_cap = *cap ? *cap : 1024;
+	while(new_cap < n){
+		new_cap *= 2;
+	}
+	*p = realloc(*p, elem * new_cap);
+	if(!*p){
+		error("構文木のメモリ確保に失敗しました。");
+	}
+	ast.nalloc++;
+	ast.total += elem * (new_cap - *cap);
+	ast.reserved += elem * (new_cap - *cap);
+	if(ast.reserved > ast.peak_reserved){
+		ast.peak_reserved = ast.reserved;
+	}
+	*cap = new_cap;
+}
+
+// 中身を捨てる。配列は次のコンパイルで使い回す。
+void ast_reset(void){
+	ast.len = 1; // 0番は「ノードなし」
+	ast.ntyped = 1;
+	ast.nextra = 0;
+	ast.nvars = 0;
+	ast.nfuncs = 0;
 }
 
+void ast_free(void){
+	free(ast.kind);
+	free(ast.ty);
+	free(ast.lhs);
+	free(ast.rhs);
+	free(ast.extra);
+	free(ast.vars);
+	free(ast.funcs);
+	free(list_stack);
+	Ast empty = { .nalloc = ast.nalloc, .total = ast.total, .peak_reserved = ast.peak_reserved };
+	ast = empty;
+	list_stack = NULL;
+	list_len = list_cap = 0;
+}
 
-Node *new_node(NodeKind kind){
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = kind;
+NodeId new_node(NodeKind kind){
+	if(ast.len == 0){
+		ast.len = ast.ntyped = 1; // 0番は「ノードなし」
+	}
+	if(ast.len >= ast.cap){
+		int cap = ast.cap;
+		ast_grow((void **)&ast.kind, &cap, ast.len + 1, sizeof(*ast.kind));
+		cap = ast.cap;
+		ast_grow((void **)&ast.ty, &cap, ast.len + 1, sizeof(*ast.ty));
+		cap = ast.cap;
+		ast_grow((void **)&ast.lhs, &cap, ast.len + 1, sizeof(*ast.lhs));
+		ast_grow((void **)&ast.rhs, &ast.cap, ast.len + 1, sizeof(*ast.rhs));
+	}
+	NodeId node = ast.len++;
+	ast.kind[node] = kind;
+	ast.ty[node] = NULL;
+	ast.lhs[node] = 0;
+	ast.rhs[node] = 0;
+	stats.nnodes++;
 	return node;
 }
 
-Node *new_node_binary(NodeKind kind, Node *lhs, Node *rhs){
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = kind;
-	node->lhs = lhs;
-	node->rhs = rhs;
+// extraにn個の場所を取り、その位置を返す
+int new_extra(int n){
+	ast_grow((void **)&ast.extra, &ast.cap_extra, ast.nextra + n, sizeof(*ast.extra));
+	int pos = ast.nextra;
+	ast.nextra += n;
+	return pos;
+}
+
+static void list_push(int val){
+	ast_grow((void **)&list_stack, &list_cap, list_len + 1, sizeof(*list_stack));
+	list_stack[list_len++] = val;
+}
+
+// list_stack[base..] を「数, 要素...」の形でextraに移し、その位置を返す
+static int list_finish(int base){
+	int n = list_len - base;
+	int pos = new_extra(n + 1);
+	ast.extra[pos] = n;
+	memcpy(&ast.extra[pos + 1], &list_stack[base], sizeof(int) * n);
+	list_len = base;
+	return pos;
+}
+
+NodeId new_node_binary(NodeKind kind, NodeId lhs, NodeId rhs){
+	NodeId node = new_node(kind);
+	ast.lhs[node] = lhs;
+	ast.rhs[node] = rhs;
 	return node;
 }
 
-Node *new_node_add(Node *lhs, Node *rhs){
-	add_type(lhs);
-	add_type(rhs);
+NodeId new_node_add(NodeId lhs, NodeId rhs){
+	add_type();
+	Type *lty = ast.ty[lhs], *rty = ast.ty[rhs];
 
-	if(is_integer(lhs->ty) && is_integer(rhs->ty)){
+	if(is_integer(lty) && is_integer(rty)){
 		return new_node_binary(ND_ADD, lhs, rhs);
 	}
-	if(lhs->ty->base && is_integer(rhs->ty)){
+	if(lty->base && is_integer(rty)){
 		return new_node_binary(ND_PTR_ADD, lhs, rhs);
 	}
-	if(is_integer(lhs->ty) && rhs->ty->base){
+	if(is_integer(lty) && rty->base){
 		return new_node_binary(ND_PTR_ADD, rhs, lhs);
 	}
 }
 
-Node *new_node_sub(Node *lhs, Node *rhs){
-	add_type(lhs);
-	add_type(rhs);
+NodeId new_node_sub(NodeId lhs, NodeId rhs){
+	add_type();
+	Type *lty = ast.ty[lhs], *rty = ast.ty[rhs];
 
-	if(is_integer(lhs->ty) && is_integer(rhs->ty)){
+	if(is_integer(lty) && is_integer(rty)){
 		return new_node_binary(ND_SUB, lhs, rhs);
 	}
-	if(lhs->ty->base && is_integer(rhs->ty)){
+	if(lty->base && is_integer(rty)){
 		return new_node_binary(ND_PTR_SUB, lhs, rhs);
 	}
-	if(lhs->ty->base && rhs->ty->base){
+	if(lty->base && rty->base){
 		return new_node_binary(ND_PTR_DIFF, lhs, rhs);
 	}
+	error("整数からポインタは引けません。");
 }
 
-Node *new_node_unary(NodeKind kind, Node *unary){
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = kind;
-	node->lhs = unary;
+NodeId new_node_unary(NodeKind kind, NodeId unary){
+	NodeId node = new_node(kind);
+	ast.lhs[node] = unary;
 	return node;
 }
 
-Node *new_node_ifelse(Node *cond, Node *then, Node *els){
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = ND_IF;
-	node->cond = cond;
-	node->then = then;
-	node->els  = els;
+NodeId new_node_ifelse(NodeId cond, NodeId then, NodeId els){
+	NodeId node = new_node(ND_IF);
+	int pos = new_extra(2);
+	ast.extra[pos] = then;
+	ast.extra[pos + 1] = els;
+	ast.lhs[node] = cond;
+	ast.rhs[node] = pos;
 	return node;
 }
 
-Node *new_node_while(Node *cond, Node *then){
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = ND_WHILE;
-	node->cond = cond;
-	node->then = then;
+NodeId new_node_while(NodeId cond, NodeId then){
+	NodeId node = new_node(ND_WHILE);
+	ast.lhs[node] = cond;
+	ast.rhs[node] = then;
 	return node;
 }
 
-Node *new_node_for(Node *init, Node *cond, Node *inc, Node *then){
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = ND_FOR;
-	node->init = init;
-	node->cond = cond;
-	node->inc  = inc;
-	node->then = then;
+NodeId new_node_for(NodeId init, NodeId cond, NodeId inc, NodeId then){
+	NodeId node = new_node(ND_FOR);
+	int pos = new_extra(4);
+	ast.extra[pos] = init;
+	ast.extra[pos + 1] = cond;
+	ast.extra[pos + 2] = inc;
+	ast.extra[pos + 3] = then;
+	ast.lhs[node] = pos;
 	return node;
 }
 
-Node *new_node_block(Node *body){
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = ND_BLOCK;
-	node->body = body;
+// listはextra中の「文の数, 文...」の位置
+NodeId new_node_block(int list){
+	NodeId node = new_node(ND_BLOCK);
+	ast.lhs[node] = list;
 	return node;
 }
 
-Node *new_node_num(int val){
-	Node *node = calloc(1, sizeof(Node));
-	node->kind = ND_NUM;
-	node->val = val;
+NodeId new_node_num(int val){
+	NodeId node = new_node(ND_NUM);
+	ast.lhs[node] = val;
 	return node;
 }
 
-Node *new_node_lvar(LVar *var){
-	Node *node = new_node(ND_LVAR);
-	node->lvar = var;
+// nameはintern済み。引数はlist_stack[base..]に集めてある。
+NodeId new_node_call(char *name, int base){
+	NodeId node = new_node(ND_FUNCCALL);
+	ast_grow((void **)&ast.funcs, &ast.cap_funcs, ast.nfuncs + 1, sizeof(*ast.funcs));
+	ast.funcs[ast.nfuncs] = name;
+	ast.lhs[node] = ast.nfuncs++;
+	ast.rhs[node] = list_finish(base);
 	return node;
 }
 
+NodeId new_node_lvar(LVar *var){
+	NodeId node = new_node(ND_LVAR);
+	ast.lhs[node] = var->id;
+	return node;
+}
+
+// 現在のスコープに変数を宣言する。nameはintern済みであること。
 LVar *new_lvar(char *name, Type *ty){
-	LVar *var = calloc(1, sizeof(LVar));
+	int len = strlen(name);
+	LVar *shadow = hashmap_get(&var_table, name, len);
+	if(shadow && shadow->scope == scope){
+		error("変数 '%s' が再定義されています。", name);
+	}
+
+	LVar *var = arena_alloc(&node_arena, sizeof(LVar));
 	var->name = name;
-	var->len  = strlen(name);
+	var->len  = len;
 	var->ty   = ty;
 	var->next = locals;
 	locals = var;
+
+	var->scope = scope;
+	var->shadow = shadow;
+	var->scope_next = scope->vars;
+	scope->vars = var;
+
+	ast_grow((void **)&ast.vars, &ast.cap_vars, ast.nvars + 1, sizeof(*ast.vars));
+	var->id = ast.nvars;
+	ast.vars[ast.nvars++] = var;
+	hashmap_put(&var_table, name, len, var);
 	return var;
 }
 
-LVar *read_func_params(void){
-	if(consume(")")) return NULL;
+// 名前では見えないfnのローカル変数を作る (インライン展開でコピーした変数など)
+LVar *new_local(Function *fn, char *name, Type *ty){
+	LVar *var = arena_alloc(&node_arena, sizeof(LVar));
+	var->name = name;
+	var->len = strlen(name);
+	var->ty = ty;
+	var->next = fn->locals;
+	fn->locals = var;
+
+	ast_grow((void **)&ast.vars, &ast.cap_vars, ast.nvars + 1, sizeof(*ast.vars));
+	var->id = ast.nvars;
+	ast.vars[ast.nvars++] = var;
+	return var;
+}
 
-	Type *ty = basetype();
-	char *name = expect_ident();
-	ty = read_type_suffix(ty);
-	LVar *params = new_lvar(name, ty);
+void read_func_params(Function *fn){
+	LVar *params[6];
+	int nparams = 0;
 
-	while(!consume(")")){
-		expect(",");
+	while(!consume(TK_RPAREN)){
+		if(nparams > 0){
+			expect(TK_COMMA);
+		}
+		if(nparams == sizeof(params) / sizeof(*params)){
+			error_at(token->str, "引数が多すぎます。");
+		}
 		Type *ty = basetype();
 		char *name = expect_ident();
 		ty = read_type_suffix(ty);
-		params = new_lvar(name, ty);
+		params[nparams++] = new_lvar(name, ty);
 	}
 
-	return params;
+	fn->nparams = nparams;
+	fn->params = arena_alloc(&node_arena, sizeof(LVar *) * nparams);
+	memcpy(fn->params, params, sizeof(LVar *) * nparams);
 }
 
 Function *program(){
@@ -163,20 +327,20 @@ Function *program(){
 }
 
 Type *basetype(){
-	expect("int");
+	expect(TK_INT);
 	Type *ty = int_type;
-	while(consume("*")){
+	while(consume(TK_STAR)){
 		ty = pointer_to(ty);
 	}
 	return ty;
 }
 
 Type *read_type_suffix(Type *base){
-	if(!consume("[")){
+	if(!consume(TK_LBRACKET)){
 		return base;
 	}
 	int array_len = expect_number();
-	expect("]");
+	expect(TK_RBRACKET);
 	return array_of(base, array_len);
 }
 
@@ -184,290 +348,431 @@ Function *function(){
 	locals = NULL;
 
 	// Function 構造体を生成
-	Function *fn = calloc(1, sizeof(Function));
+	Function *fn = arena_alloc(&node_arena, sizeof(Function));
+
+	// キャッシュにあれば本体はパースしない。ただし-O1以上では、後の関数に
+	// インライン展開できるように本体もパースする (コード生成はしない)。
+	long start = 0;
+	if(cache_dir){
+		char *end = cache_key(token->str, &fn->cache_key);
+		if(end && cache_load(fn, fn->cache_key)){
+			fn->cached = true;
+			stats.cache_hits++;
+			if(opt_level == 0){
+				basetype();
+				fn->name = expect_ident();
+				lexer_seek(end);
+				stats.cache_saved_ns += fn->cost_ns;
+				return fn;
+			}
+		}
+		else{
+			stats.cache_misses++;
+		}
+		start = clock_ns();
+	}
 
 	// 関数名をパース
 	basetype();
 	fn->name = expect_ident();
 
-	// 引数をパース
-	expect("(");
-	fn->params = read_func_params();
+	// 引数をパース。引数と関数本体の最も外側のブロックは同じスコープ。
+	enter_scope();
+	expect(TK_LPAREN);
+	read_func_params(fn);
 
 	// ブロックをパース
-	expect("{");
+	expect(TK_LBRACE);
 
-	Node head = {};
-	Node *cur = &head;
-
-	while(!consume("}")){
-		cur->next = stmt();
-		cur = cur->next;
+	int base = list_len;
+	fn->node_begin = ast.len ? ast.len : 1;
+	while(!consume(TK_RBRACE)){
+		list_push(stmt());
 	}
 
-	fn->node = head.next;
+	leave_scope();
+
+	fn->body = list_finish(base);
+	fn->node_end = ast.len ? ast.len : 1;
 	fn->locals = locals;
+	if(opt_level >= 1){
+		inline_calls(fn);
+		fold_function(fn);
+		inline_register(fn);
+	}
+	if(fn->cached){
+		stats.cache_saved_ns += fn->cost_ns - (clock_ns() - start);
+	}
+	else if(cache_dir){
+		fn->cost_ns = clock_ns() - start;
+	}
 
 	return fn;
 }
 
-Node *declaration(){
+NodeId declaration(){
 	Type *ty = basetype();
 	char *name = expect_ident();
 	ty = read_type_suffix(ty);
 	LVar *var = new_lvar(name, ty);
 
-	if(consume(";")){
+	if(consume(TK_SEMI)){
 		return new_node(ND_NULL);
 	}
 
-	expect("=");
-	Node *lhs = new_node_lvar(var);
-	Node *rhs = expr();
-	expect(";");
+	expect(TK_ASSIGN);
+	NodeId lhs = new_node_lvar(var);
+	NodeId rhs = expr();
+	expect(TK_SEMI);
 
-	Node *node = new_node_binary(ND_ASSIGN, lhs, rhs);
-	return node;
+	return new_node_binary(ND_ASSIGN, lhs, rhs);
 }
 
-Node *stmt(){
-	Node *node = stmt2();
-	add_type(node);
+NodeId stmt(){
+	NodeId node = stmt2();
+	add_type();
 	return node;
 }
 
-Node *stmt2(){
-    Node *node;
+NodeId stmt2(){
+    NodeId node;
 
-	if(consume("return")){
-		Node *node = new_node_unary(ND_RETURN, expr());
-		expect(";");
+	switch(token->kind){
+	case TK_RETURN:
+		next_token();
+		node = new_node_unary(ND_RETURN, expr());
+		expect(TK_SEMI);
 		return node;
-	}
-	else if(consume("if")){
-		Node *cond, *then, *els;
-		expect("(");
+	case TK_IF: {
+		NodeId cond, then, els = 0;
+		next_token();
+		expect(TK_LPAREN);
 		cond = expr();
-		expect(")");
+		expect(TK_RPAREN);
 		then = stmt();
-		if(consume("else")){
+		if(consume(TK_ELSE)){
 			els = stmt();
 		}
 		return new_node_ifelse(cond, then, els);
 	}
-	else if(consume("while")){
-		expect("(");
+	case TK_WHILE:
+		next_token();
+		expect(TK_LPAREN);
 		node = expr();
-		expect(")");
+		expect(TK_RPAREN);
 		return new_node_while(node, stmt());
-	}
-	else if(consume("for")){
-		Node *init = NULL, *cond = NULL, *inc = NULL;
-		expect("(");
-		if(strncmp(token->str, ";", 1) != 0){
+	case TK_FOR: {
+		NodeId init = 0, cond = 0, inc = 0;
+		next_token();
+		expect(TK_LPAREN);
+		if(token->kind != TK_SEMI){
 			init = expr();
 		}
-		expect(";");
-		if(strncmp(token->str, ";", 1) != 0){
+		expect(TK_SEMI);
+		if(token->kind != TK_SEMI){
 			cond = expr();
 		}
-		expect(";");
-		if(strncmp(token->str, ")", 1) != 0){
+		expect(TK_SEMI);
+		if(token->kind != TK_RPAREN){
 			inc = expr();
 		}
-		expect(")");
+		expect(TK_RPAREN);
 		return new_node_for(init, cond, inc, stmt());
 	}
-	else if(consume("{")){
-		Node head = {}; // define & initialize
-		Node *cur = new_node(ND_BLOCK);
-		head.next = cur;
-		while(!consume("}")){
-			cur->body = stmt();
-			cur->next = new_node(ND_BLOCK);
-			cur = cur->next;
+	case TK_LBRACE: {
+		next_token();
+		enter_scope();
+		int base = list_len;
+		while(!consume(TK_RBRACE)){
+			list_push(stmt());
 		}
-		cur->next = NULL;
+		leave_scope();
 
-		return head.next;
+		return new_node_block(list_finish(base));
 	}
-	else if(!strncmp(token->str, "int", token->len)){
+	case TK_INT:
 		return declaration();
-	}
-	else{
+	default:
 		node = expr();
+		expect(TK_SEMI);
+		return node;
 	}
-
-    expect(";");
-    return node;
-}
-
-Node *expr(){
-	return assign();
 }
 
-Node *assign(){
-    Node *node = equality();
-
-    if(consume("=")){
-         node = new_node_binary(ND_ASSIGN, node, assign());
-    }
-    return node;
+//---- 式 ----
+//
+// 式は優先順位表と明示的なスタックで解析する (演算子順位法)。
+// 再帰しないので、どれだけ深く入れ子になった式でもCのスタックを使い切らない。
+//
+//   expr    = unary (binop unary)*          binopは下の表、"="だけ右結合
+//   unary   = "sizeof" unary | ("*" | "&") unary
+//           | ("+" | "-") primary | postfix
+//   postfix = primary ("[" expr "]")*
+//   primary = "(" expr ")" | ident ("(" (expr ("," expr)*)? ")")? | num
+
+// 2項演算子の優先順位。0は2項演算子ではない。
+static unsigned char binop_prec[TK_EOF + 1] = {
+	[TK_ASSIGN] = 1,
+	[TK_EQ] = 2, [TK_NE] = 2,
+	[TK_LT] = 3, [TK_LE] = 3, [TK_GT] = 3, [TK_GE] = 3,
+	[TK_PLUS] = 4, [TK_MINUS] = 4,
+	[TK_STAR] = 5, [TK_SLASH] = 5,
+};
+
+// 演算子スタックの要素の種類
+typedef enum {
+	OP_BINARY, // 2項演算子 (tkが演算子)
+	OP_SIZEOF, // 前置 sizeof
+	OP_DEREF, // 前置 *
+	OP_ADDR, // 前置 &
+	OP_PLUS, // 前置 + (primaryにだけ付く)
+	OP_NEG, // 前置 - (primaryにだけ付く)
+	OP_PAREN, // "(" expr ")" の "("
+	OP_CALL, // 関数呼び出しの "("
+	OP_INDEX, // 添字の "["
+} OpKind;
+
+typedef struct {
+	OpKind kind;
+	TokenKind tk; // OP_BINARYの演算子
+	char *name; // OP_CALLの関数名 (intern済み)
+	int base; // OP_CALLの引数を集め始めたlist_stackの位置
+} Op;
+
+static Op *op_stack;
+static int op_len;
+static int op_cap;
+
+static NodeId *val_stack; // 解析済みの被演算子
+static int val_len;
+static int val_cap;
+
+// エラーで式の途中から抜けた場合に備えてスタックを空にする
+static void expr_reset(void){
+	op_len = 0;
+	val_len = 0;
 }
 
-Node *equality(){
-	Node *node = relational();
-
-	for(;;){
-		if(consume("==")){
-			node = new_node_binary(ND_EQ, node, relational());
-		}
-		else if(consume("!=")){
-			node = new_node_binary(ND_NE, node, relational());
-		}
-		else{
-			return node;
-		}
+static void push_op(OpKind kind){
+	if(op_len == op_cap){
+		op_cap = op_cap ? op_cap * 2 : 256;
+		op_stack = realloc(op_stack, sizeof(Op) * op_cap);
 	}
+	Op *op = &op_stack[op_len++];
+	op->kind = kind;
+	op->tk = 0;
+	op->name = NULL;
+	op->base = 0;
 }
 
-Node *relational(){
-	Node *node = add();
-
-	for(;;){
-		if(consume("<")){
-			node = new_node_binary(ND_LT, node, add());
-		}
-		else if(consume(">")){
-			node = new_node_binary(ND_LT, add(), node);
-		}
-		else if(consume("<=")){
-			node = new_node_binary(ND_LE, node, add());
-		}
-		else if(consume(">=")){
-			node = new_node_binary(ND_LE, add(), node);
-		}
-		else{
-			return node;
-		}
+static void push_val(NodeId node){
+	if(val_len == val_cap){
+		val_cap = val_cap ? val_cap * 2 : 256;
+		val_stack = realloc(val_stack, sizeof(NodeId) * val_cap);
 	}
+	val_stack[val_len++] = node;
 }
 
-Node *add(){
-	Node *node = mul();
+static NodeId pop_val(void){
+	return val_stack[--val_len];
+}
 
-	for(;;){
-		if(consume("+")){
-			node = new_node_add(node, mul());
-		}
-		else if(consume("-")){
-			node = new_node_binary(ND_SUB, node, mul());
-		}
-		else{
-			return node;
-		}
+// 2項演算子のノードを作る
+static NodeId new_node_binop(TokenKind tk, NodeId lhs, NodeId rhs){
+	switch(tk){
+	case TK_ASSIGN: return new_node_binary(ND_ASSIGN, lhs, rhs);
+	case TK_EQ: return new_node_binary(ND_EQ, lhs, rhs);
+	case TK_NE: return new_node_binary(ND_NE, lhs, rhs);
+	case TK_LT: return new_node_binary(ND_LT, lhs, rhs);
+	case TK_LE: return new_node_binary(ND_LE, lhs, rhs);
+	case TK_GT: return new_node_binary(ND_LT, rhs, lhs); // a > b は b < a
+	case TK_GE: return new_node_binary(ND_LE, rhs, lhs); // a >= b は b <= a
+	case TK_PLUS: return new_node_add(lhs, rhs);
+	case TK_MINUS: return new_node_sub(lhs, rhs);
+	case TK_STAR: return new_node_binary(ND_MUL, lhs, rhs);
+	case TK_SLASH: return new_node_binary(ND_DIV, lhs, rhs);
 	}
+	return 0;
 }
 
-Node *mul(){
-	Node *node = unary();
+// 演算子スタックの先頭の2項演算子を1つ適用する
+static void reduce_binop(void){
+	TokenKind tk = op_stack[--op_len].tk;
+	NodeId rhs = pop_val();
+	NodeId lhs = pop_val();
+	push_val(new_node_binop(tk, lhs, rhs));
+}
 
-	for(;;){
-		if(consume("*")){
-			node = new_node_binary(ND_MUL, node, unary());
-		}
-		else if(consume("/")){
-			node = new_node_binary(ND_DIV, node, unary());
-		}
-		else{
-			return node;
+// base より上の、優先順位がprec以上の2項演算子を適用する。
+// 右結合の "=" は同じ優先順位では適用しない。
+static void reduce_binops(int base, int prec){
+	while(op_len > base && op_stack[op_len - 1].kind == OP_BINARY){
+		int top = binop_prec[op_stack[op_len - 1].tk];
+		if(top < prec || (top == prec && prec == binop_prec[TK_ASSIGN])){
+			return;
 		}
+		reduce_binop();
 	}
 }
 
-Node *unary(){
-	if(consume("sizeof")){
-		Node *node = unary();
-		add_type(node);
-		if(node->lvar->ty->kind == TY_INT){
-			return new_node_num(4);
+// 前置演算子を1つ適用する
+static void reduce_prefix(OpKind kind){
+	NodeId node = pop_val();
+	switch(kind){
+	case OP_SIZEOF:
+		add_type();
+		if(ast.ty[node]->kind == TY_INT){
+			push_val(new_node_num(4));
+			return;
 		}
-		if(node->lvar->ty->kind == TY_PTR){
-			return new_node_num(8);
+		if(ast.ty[node]->kind == TY_PTR){
+			push_val(new_node_num(8));
+			return;
 		}
+		error_at(token->str, "sizeofを適用できない型です。");
+	case OP_DEREF:
+		push_val(new_node_unary(ND_DEREF, node));
+		return;
+	case OP_ADDR:
+		push_val(new_node_unary(ND_ADDR, node));
+		return;
+	case OP_PLUS:
+		push_val(node);
+		return;
+	case OP_NEG:
+		push_val(new_node_binary(ND_SUB, new_node_num(0), node));
+		return;
 	}
+}
 
-	if(consume("+")){
-		return primary();
-	}
-	if(consume("-")){
-		return new_node_binary(ND_SUB, new_node_num(0), primary());
-	}
-	if(consume("*")){
-		return new_node_unary(ND_DEREF, unary());
-	}
-	if(consume("&")){
-		return new_node_unary(ND_ADDR, unary());
-	}
-	return postfix();
+static bool is_prefix(OpKind kind){
+	return kind == OP_SIZEOF || kind == OP_DEREF || kind == OP_ADDR;
 }
 
-Node *postfix(){
-	Node *node = primary();
+NodeId expr(){
+	int op_base = op_len;
+	int val_base = val_len;
+	bool want_operand = true; // 次は被演算子
+	bool primary_only = false; // 直前が前置の + か - で、次はprimaryしか来ない
 
-	while(consume("[")){
-		Node *exp = new_node_add(node, expr());
-		expect("]");
-		node = new_node_unary(ND_DEREF, exp);
-	}
-	return node;
-}
+	for(;;){
+		if(want_operand){
+			// 被演算子の前置部分と primary
+			if(!primary_only){
+				if(consume(TK_SIZEOF)){
+					push_op(OP_SIZEOF);
+					continue;
+				}
+				if(consume(TK_STAR)){
+					push_op(OP_DEREF);
+					continue;
+				}
+				if(consume(TK_AMP)){
+					push_op(OP_ADDR);
+					continue;
+				}
+				if(consume(TK_PLUS)){
+					push_op(OP_PLUS);
+					primary_only = true;
+					continue;
+				}
+				if(consume(TK_MINUS)){
+					push_op(OP_NEG);
+					primary_only = true;
+					continue;
+				}
+			}
+			primary_only = false;
 
-Node *primary(){
-	if(consume("(")){
-		Node *node = expr();
-		expect(")");
-		return node;
-	}
+			if(consume(TK_LPAREN)){
+				push_op(OP_PAREN);
+				continue;
+			}
 
-    Token *tok = consume_ident();
-    if(tok){
-		// function call
-		if(consume("(")){
-			Node *node = new_node(ND_FUNCCALL);
-			node->funcname = strndup(tok->str, tok->len);
-			if(consume(")")){
-				node->args = NULL;
+			Token *tok = consume_ident();
+			if(tok){
+				if(consume(TK_LPAREN)){
+					// tokは引数を読む間にリングから消えるので名前を控えておく
+					char *name = intern(tok->str, tok->len);
+					push_op(OP_CALL);
+					op_stack[op_len - 1].name = name;
+					op_stack[op_len - 1].base = list_len;
+					if(!consume(TK_RPAREN)){
+						continue;
+					}
+					// 引数なし
+					op_len--;
+					push_val(new_node_call(name, list_len));
+				}
+				else{
+					LVar *lvar = find_lvar(tok);
+					if(!lvar){
+						error_at(tok->str, "宣言されていない変数です。");
+					}
+					push_val(new_node_lvar(lvar));
+				}
 			}
 			else{
-				Node *head = assign();
-				Node *cur = head;
-				while(consume(",")){
-					cur->next = assign();
-					cur = cur->next;
-				}
-				expect(")");
-				node->args = head;
+				push_val(new_node_num(expect_number()));
 			}
-			return node;
 		}
-		// local variable
 		else{
-			Node *node = calloc(1, sizeof(Node));
-			node->kind = ND_LVAR;
-
-			LVar *lvar = find_lvar(tok);
-			if(!lvar){
-				lvar = calloc(1, sizeof(LVar));
-				lvar->next = locals;
-				lvar->name = tok->str;
-				lvar->len = tok->len;
-				locals = lvar;
+			// 2項演算子
+			int prec = binop_prec[token->kind];
+			if(prec){
+				reduce_binops(op_base, prec);
+				push_op(OP_BINARY);
+				op_stack[op_len - 1].tk = token->kind;
+				next_token();
+				want_operand = true;
+				continue;
+			}
+
+			// 括弧や引数の終わり。対応する開き括弧までの2項演算子を適用する。
+			reduce_binops(op_base, 0);
+			if(op_len == op_base){
+				// 式の終わり
+				return pop_val();
+			}
+
+			Op *op = &op_stack[op_len - 1];
+			if(op->kind == OP_CALL && consume(TK_COMMA)){
+				list_push(pop_val());
+				want_operand = true;
+				continue;
+			}
+			if(op->kind == OP_CALL && consume(TK_RPAREN)){
+				list_push(pop_val());
+				op_len--;
+				push_val(new_node_call(op->name, op->base));
+			}
+			else if(op->kind == OP_INDEX){
+				expect(TK_RBRACKET);
+				op_len--;
+				NodeId index = pop_val();
+				NodeId base = pop_val();
+				push_val(new_node_unary(ND_DEREF, new_node_add(base, index)));
+				// 続く添字は primary の後と同じに扱う
+			}
+			else{
+				expect(TK_RPAREN);
+				op_len--;
 			}
-			node->lvar = lvar;
-			return node;
 		}
-    }
 
-	return new_node_num(expect_number());
-}
\ No newline at end of file
+		// primary が1つ解析できた。前置の + と - が付いていればそれを適用し、
+		// そうでなければ添字を読む。
+		if(op_len > op_base && (op_stack[op_len - 1].kind == OP_PLUS || op_stack[op_len - 1].kind == OP_NEG)){
+			reduce_prefix(op_stack[--op_len].kind);
+		}
+		else if(consume(TK_LBRACKET)){
+			push_op(OP_INDEX);
+			want_operand = true;
+			continue;
+		}
+		while(op_len > op_base && is_prefix(op_stack[op_len - 1].kind)){
+			reduce_prefix(op_stack[--op_len].kind);
+		}
+		want_operand = false;
+	}
+}
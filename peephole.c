@@ -0,0 +1,538 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "9cc.h"
+
+// 命令列ののぞき穴最適化
+//
+// gen_functionが作ったfn->instsを、出力の前に小さなパターンで書き換える。
+// 書き換えは命令をその場で変えるか、IN_NOPにして消すだけで、1回なめる
+// ごとにIN_NOPを詰める。どのパターンも当たらなくなるまで繰り返す。
+//
+// どちらのコード生成も、フラグはcmpの直後のsetccかjccでしか読まない。
+// そのため、フラグの値が変わる書き換え (subを消すなど) も許す。
+// 値を捨てるレジスタは、その先で読まれないこと (dead_at) を確かめる。
+
+typedef enum {
+	PP_PUSH_POP, // push A; pop B -> mov B, A
+	PP_PUSH_POP_SINK, // push A; I...; pop B -> I...; mov B, A
+	PP_PUSH_POP_HOIST, // push A; I...; pop B -> mov B, A; I...
+	PP_MOV_SELF, // mov r, r -> (なし)
+	PP_MOV_MOV, // mov r, X; mov s, r -> mov s, X
+	PP_MOV_OP_MOV, // mov r, X; op r, Y; mov s, r -> mov s, X; op s, Y
+	PP_FRAME_LOAD, // mov r, rbp; sub r, K; mov s, [r+d] -> mov s, [rbp+d-K]
+	PP_FRAME_STORE, // mov r, rbp; sub r, K; I...; mov [r+d], s -> I...; mov [rbp+d-K], s
+	PP_SHIFT_ADD, // shl r, k; I...; add d, r -> I...; lea d, [d+r*2^k]
+	PP_SETCC_BRANCH, // setcc r; cmp r, 0; je L -> jncc L
+	PP_JMP_NEXT, // jmp L; L: -> L:
+	PP_UNREACHABLE, // jmpやretの後ろからラベルまで
+	PP_DEAD_LABEL, // どこからも飛んでこないラベル
+	NUM_PEEPHOLES,
+} Peephole;
+
+static char *peephole_name[] = {
+	[PP_PUSH_POP] = "push-pop",
+	[PP_PUSH_POP_SINK] = "push-pop-sink",
+	[PP_PUSH_POP_HOIST] = "push-pop-hoist",
+	[PP_MOV_SELF] = "mov-self",
+	[PP_MOV_MOV] = "mov-mov",
+	[PP_MOV_OP_MOV] = "mov-op-mov",
+	[PP_FRAME_LOAD] = "frame-load",
+	[PP_FRAME_STORE] = "frame-store",
+	[PP_SHIFT_ADD] = "shift-add",
+	[PP_SETCC_BRANCH] = "setcc-branch",
+	[PP_JMP_NEXT] = "jmp-next",
+	[PP_UNREACHABLE] = "unreachable",
+	[PP_DEAD_LABEL] = "dead-label",
+};
+
+static atomic_long peephole_hits[NUM_PEEPHOLES]; // --peephole-report 用
+
+// push A とpop Bの間に挟める命令の数
+#define MAX_WINDOW 4
+// dead_atが先を調べる命令の数
+#define DEAD_SCAN 32
+
+#define BIT(r) (1u << (r))
+#define ARG_REGS (BIT(RDI) | BIT(RSI) | BIT(RDX) | BIT(RCX) | BIT(R8) | BIT(R9))
+#define CALLER_SAVED (BIT(RAX) | BIT(RCX) | BIT(RDX) | BIT(RSI) | BIT(RDI) \
+	| BIT(R8) | BIT(R9) | BIT(R10) | BIT(R11))
+#define CALLEE_SAVED (BIT(RBX) | BIT(RBP) | BIT(RSP) | BIT(R12) | BIT(R13) | BIT(R14) | BIT(R15))
+
+// 1回なめる間の状態。関数は別々のスレッドで最適化されうる。
+static _Thread_local Inst *insts;
+static _Thread_local int ninsts;
+static _Thread_local int *label_pos; // ラベル番号 -> 命令の位置
+static _Thread_local int *label_refs; // ラベル番号 -> 飛んでくるジャンプの数
+static _Thread_local long hits[NUM_PEEPHOLES];
+
+static bool is_jump(InstKind kind){
+	return IN_JMP <= kind && kind <= IN_JGE;
+}
+
+// 命令が読むレジスタ
+static unsigned reads(Inst *in){
+	switch(in->kind){
+	case IN_PUSH:
+		return BIT(RSP) | (in->imm ? 0 : BIT(in->dst));
+	case IN_POP:
+		return BIT(RSP);
+	case IN_MOV:
+		return in->imm ? 0 : BIT(in->src);
+	case IN_ADD:
+	case IN_SUB:
+	case IN_IMUL:
+	case IN_AND:
+	case IN_CMP:
+		return BIT(in->dst) | (in->imm ? 0 : BIT(in->src));
+	case IN_SHL:
+	case IN_SAR:
+	case IN_SHR:
+		return BIT(in->dst);
+	case IN_LEA:
+		return BIT(in->dst) | BIT(in->src);
+	case IN_LOAD:
+		return BIT(in->src);
+	case IN_STORE:
+		return BIT(in->dst) | BIT(in->src);
+	case IN_CQO:
+		return BIT(RAX);
+	case IN_IDIV:
+		return BIT(RAX) | BIT(RDX) | BIT(in->dst);
+	case IN_MULH:
+		return BIT(RAX) | BIT(in->dst);
+	case IN_CALL:
+		return ARG_REGS | BIT(RAX) | BIT(RSP);
+	case IN_RET:
+		return BIT(RAX) | CALLEE_SAVED;
+	}
+	return 0;
+}
+
+// 命令が書くレジスタ
+static unsigned writes(Inst *in){
+	switch(in->kind){
+	case IN_PUSH:
+		return BIT(RSP);
+	case IN_POP:
+		return BIT(RSP) | BIT(in->dst);
+	case IN_MOV:
+	case IN_ADD:
+	case IN_SUB:
+	case IN_IMUL:
+	case IN_AND:
+	case IN_SHL:
+	case IN_SAR:
+	case IN_SHR:
+	case IN_LEA:
+	case IN_LOAD:
+	case IN_SETE:
+	case IN_SETNE:
+	case IN_SETL:
+	case IN_SETLE:
+		return BIT(in->dst);
+	case IN_CQO:
+		return BIT(RDX);
+	case IN_IDIV:
+	case IN_MULH:
+		return BIT(RAX) | BIT(RDX);
+	case IN_CALL:
+		return CALLER_SAVED | BIT(RSP);
+	}
+	return 0;
+}
+
+// スタックにもラベルにも触らず、間に挟んだpush/popと入れ替えてよい命令
+static bool is_plain(Inst *in){
+	if(in->kind == IN_NOP || in->kind == IN_LABEL || in->kind == IN_RET || is_jump(in->kind)){
+		return false;
+	}
+	return !((reads(in) | writes(in)) & BIT(RSP));
+}
+
+// iの次の (消していない) 命令の位置
+static int next(int i){
+	do{
+		i++;
+	}while(i < ninsts && insts[i].kind == IN_NOP);
+	return i;
+}
+
+// 位置iの命令の直前で、レジスタrの値がもう読まれないか。
+// ジャンプは両方の行き先をたどる。分からなければfalse。
+static bool dead_at(int i, Reg r, int budget){
+	for(; i < ninsts && budget > 0; i++, budget--){
+		Inst *in = &insts[i];
+		if(reads(in) & BIT(r)){
+			return false;
+		}
+		if(writes(in) & BIT(r) || in->kind == IN_RET){
+			return true;
+		}
+		if(!is_jump(in->kind)){
+			continue;
+		}
+		if(in->kind == IN_JMP){
+			i = label_pos[in->label];
+			continue;
+		}
+		if(!dead_at(label_pos[in->label], r, budget - 1)){
+			return false;
+		}
+	}
+	return false;
+}
+
+static void kill(int i){
+	insts[i].kind = IN_NOP;
+}
+
+// inを "mov dst, A" にする。Aはpush A (from) のオペランド。
+static void set_mov(Inst *in, Reg dst, Inst *from){
+	Inst mov = { .kind = IN_MOV, .dst = dst, .src = from->dst, .imm = from->imm, .val = from->val };
+	*in = mov;
+}
+
+// push A; I...; pop B
+static Peephole push_pop(int i){
+	Inst *push = &insts[i];
+	unsigned rd = 0, wr = 0;
+	int j = next(i);
+	for(int n = 0; j < ninsts && n <= MAX_WINDOW; n++, j = next(j)){
+		Inst *in = &insts[j];
+		if(in->kind == IN_POP){
+			break;
+		}
+		if(!is_plain(in)){
+			return NUM_PEEPHOLES;
+		}
+		rd |= reads(in);
+		wr |= writes(in);
+	}
+	if(j >= ninsts || insts[j].kind != IN_POP){
+		return NUM_PEEPHOLES;
+	}
+
+	Inst *pop = &insts[j];
+	Reg b = pop->dst;
+	bool same = !push->imm && push->dst == b;
+	if(next(i) == j){
+		if(same){
+			kill(j);
+		}
+		else{
+			set_mov(pop, b, push);
+		}
+		kill(i);
+		return PP_PUSH_POP;
+	}
+	// 間の命令がAを書かなければ、popの位置でAを移す
+	if(push->imm || !(wr & BIT(push->dst))){
+		if(same){
+			kill(j);
+		}
+		else{
+			set_mov(pop, b, push);
+		}
+		kill(i);
+		return PP_PUSH_POP_SINK;
+	}
+	// 間の命令がBを読み書きしなければ、pushの位置でBに移す
+	if(!((rd | wr) & BIT(b))){
+		set_mov(push, b, push);
+		kill(j);
+		return PP_PUSH_POP_HOIST;
+	}
+	return NUM_PEEPHOLES;
+}
+
+// mov r, X; ...
+static Peephole mov_chain(int i){
+	Inst *a = &insts[i];
+	Reg r = a->dst;
+	int j = next(i);
+	if(j >= ninsts){
+		return NUM_PEEPHOLES;
+	}
+	Inst *b = &insts[j];
+
+	// mov r, X; mov s, r -> mov s, X
+	if(b->kind == IN_MOV && !b->imm && b->src == r && b->dst != r && dead_at(next(j), r, DEAD_SCAN)){
+		a->dst = b->dst;
+		kill(j);
+		return PP_MOV_MOV;
+	}
+
+	// mov r, X; op r, Y; mov s, r -> mov s, X; op s, Y
+	switch(b->kind){
+	case IN_ADD:
+	case IN_SUB:
+	case IN_IMUL:
+	case IN_AND:
+	case IN_SHL:
+	case IN_SAR:
+	case IN_SHR:
+	case IN_LEA:
+		break;
+	default:
+		return NUM_PEEPHOLES;
+	}
+	int k = next(j);
+	if(k >= ninsts || b->dst != r){
+		return NUM_PEEPHOLES;
+	}
+	Inst *c = &insts[k];
+	if(c->kind != IN_MOV || c->imm || c->src != r || c->dst == r){
+		return NUM_PEEPHOLES;
+	}
+	Reg s = c->dst;
+	if(!b->imm && (b->src == s || b->src == r)){
+		return NUM_PEEPHOLES;
+	}
+	if(!dead_at(next(k), r, DEAD_SCAN)){
+		return NUM_PEEPHOLES;
+	}
+	a->dst = s;
+	b->dst = s;
+	kill(k);
+	return PP_MOV_OP_MOV;
+}
+
+// mov r, rbp; sub r, K; ... でrが変数のアドレス
+static Peephole frame_addr(int i){
+	Reg r = insts[i].dst;
+	int j = next(i);
+	if(j >= ninsts || insts[j].kind != IN_SUB || insts[j].dst != r || !insts[j].imm){
+		return NUM_PEEPHOLES;
+	}
+	long off = -insts[j].val;
+
+	unsigned rw = 0;
+	int k = next(j);
+	for(int n = 0; k < ninsts && n <= MAX_WINDOW; n++, k = next(k)){
+		Inst *in = &insts[k];
+		if(in->kind == IN_LOAD && in->src == r){
+			if(in->dst != r && !dead_at(next(k), r, DEAD_SCAN)){
+				return NUM_PEEPHOLES;
+			}
+			in->src = RBP;
+			in->val += off;
+			kill(i);
+			kill(j);
+			return PP_FRAME_LOAD;
+		}
+		if(in->kind == IN_STORE && in->dst == r){
+			if(in->src == r || !dead_at(next(k), r, DEAD_SCAN)){
+				return NUM_PEEPHOLES;
+			}
+			in->dst = RBP;
+			in->val += off;
+			kill(i);
+			kill(j);
+			return PP_FRAME_STORE;
+		}
+		if(!is_plain(in)){
+			return NUM_PEEPHOLES;
+		}
+		rw |= reads(in) | writes(in);
+		if(rw & BIT(r)){
+			return NUM_PEEPHOLES;
+		}
+	}
+	return NUM_PEEPHOLES;
+}
+
+// shl r, k (kは1..3); I...; add d, r でrがその後読まれなければ、
+// 間の命令がrに触らない限りaddの位置でスケール付きのleaにできる
+static Peephole shift_add(int i){
+	Inst *shl = &insts[i];
+	Reg r = shl->dst;
+	if(shl->val < 1 || shl->val > 3){
+		return NUM_PEEPHOLES;
+	}
+	int j = next(i);
+	for(int n = 0; j < ninsts && n <= MAX_WINDOW; n++, j = next(j)){
+		Inst *in = &insts[j];
+		if(in->kind == IN_ADD && !in->imm && in->src == r && in->dst != r){
+			break;
+		}
+		if(!is_plain(in) || ((reads(in) | writes(in)) & BIT(r))){
+			return NUM_PEEPHOLES;
+		}
+	}
+	if(j >= ninsts || insts[j].kind != IN_ADD || insts[j].imm || insts[j].src != r || insts[j].dst == r){
+		return NUM_PEEPHOLES;
+	}
+	if(!dead_at(next(j), r, DEAD_SCAN)){
+		return NUM_PEEPHOLES;
+	}
+	insts[j].kind = IN_LEA;
+	insts[j].val = 1 << shl->val;
+	kill(i);
+	return PP_SHIFT_ADD;
+}
+
+// setcc r; cmp r, 0; je/jne L
+static Peephole setcc_branch(int i){
+	static InstKind jcc[][2] = { // [setcc][je, jne]
+		[IN_SETE - IN_SETE] = { IN_JNE, IN_JE },
+		[IN_SETNE - IN_SETE] = { IN_JE, IN_JNE },
+		[IN_SETL - IN_SETE] = { IN_JGE, IN_JL },
+		[IN_SETLE - IN_SETE] = { IN_JG, IN_JLE },
+	};
+	Reg r = insts[i].dst;
+	int j = next(i);
+	if(j >= ninsts){
+		return NUM_PEEPHOLES;
+	}
+	Inst *cmp = &insts[j];
+	if(cmp->kind != IN_CMP || cmp->dst != r || !cmp->imm || cmp->val != 0){
+		return NUM_PEEPHOLES;
+	}
+	int k = next(j);
+	if(k >= ninsts || (insts[k].kind != IN_JE && insts[k].kind != IN_JNE)){
+		return NUM_PEEPHOLES;
+	}
+	insts[k].kind = jcc[insts[i].kind - IN_SETE][insts[k].kind == IN_JNE];
+	kill(j);
+	if(dead_at(k, r, DEAD_SCAN)){
+		kill(i);
+	}
+	return PP_SETCC_BRANCH;
+}
+
+// ジャンプとラベル
+static Peephole control(int i){
+	Inst *in = &insts[i];
+	if(in->kind == IN_LABEL){
+		if(label_refs[in->label] == 0){
+			kill(i);
+			return PP_DEAD_LABEL;
+		}
+		return NUM_PEEPHOLES;
+	}
+
+	// 直後のラベルへのジャンプ
+	if(is_jump(in->kind)){
+		for(int j = next(i); j < ninsts && insts[j].kind == IN_LABEL; j = next(j)){
+			if(insts[j].label == in->label){
+				label_refs[in->label]--;
+				kill(i);
+				return PP_JMP_NEXT;
+			}
+		}
+	}
+
+	// 無条件のジャンプやretの後ろは次のラベルまで実行されない
+	if(in->kind == IN_JMP || in->kind == IN_RET){
+		int j = next(i);
+		if(j < ninsts && insts[j].kind != IN_LABEL){
+			if(is_jump(insts[j].kind)){
+				label_refs[insts[j].label]--;
+			}
+			kill(j);
+			return PP_UNREACHABLE;
+		}
+	}
+	return NUM_PEEPHOLES;
+}
+
+static Peephole match(int i){
+	Inst *in = &insts[i];
+	switch(in->kind){
+	case IN_PUSH:
+		return push_pop(i);
+	case IN_MOV:
+		if(!in->imm && in->dst == in->src){
+			kill(i);
+			return PP_MOV_SELF;
+		}
+		if(!in->imm && in->src == RBP){
+			Peephole p = frame_addr(i);
+			if(p != NUM_PEEPHOLES){
+				return p;
+			}
+		}
+		return mov_chain(i);
+	case IN_LOAD:
+		return mov_chain(i);
+	case IN_SHL:
+		return shift_add(i);
+	case IN_SETE:
+	case IN_SETNE:
+	case IN_SETL:
+	case IN_SETLE:
+		return setcc_branch(i);
+	}
+	return control(i);
+}
+
+// 1回なめる。何か書き換えたらtrue。
+static bool sweep(Function *fn){
+	for(int l = 0; l < fn->nlabels; l++){
+		label_refs[l] = 0;
+	}
+	for(int i = 0; i < ninsts; i++){
+		if(insts[i].kind == IN_LABEL){
+			label_pos[insts[i].label] = i;
+		}
+		else if(is_jump(insts[i].kind)){
+			label_refs[insts[i].label]++;
+		}
+	}
+	// L_RETURNは関数の出口なので、飛んでこなくても残す
+	label_refs[label_id(L_RETURN, 0)]++;
+
+	bool changed = false;
+	for(int i = 0; i < ninsts; i++){
+		if(insts[i].kind == IN_NOP){
+			continue;
+		}
+		Peephole p = match(i);
+		if(p != NUM_PEEPHOLES){
+			hits[p]++;
+			changed = true;
+		}
+	}
+
+	int n = 0;
+	for(int i = 0; i < ninsts; i++){
+		if(insts[i].kind != IN_NOP){
+			insts[n++] = insts[i];
+		}
+	}
+	ninsts = n;
+	return changed;
+}
+
+// fn->instsをのぞき穴最適化する
+void peephole(Function *fn){
+	insts = fn->insts;
+	ninsts = fn->ninsts;
+	label_pos = malloc(sizeof(int) * fn->nlabels);
+	label_refs = malloc(sizeof(int) * fn->nlabels);
+	for(int p = 0; p < NUM_PEEPHOLES; p++){
+		hits[p] = 0;
+	}
+
+	while(sweep(fn)){
+	}
+
+	fn->ninsts = ninsts;
+	free(label_pos);
+	free(label_refs);
+	for(int p = 0; p < NUM_PEEPHOLES; p++){
+		if(hits[p]){
+			atomic_fetch_add(&peephole_hits[p], hits[p]);
+		}
+	}
+}
+
+// パターンごとの書き換えの回数を表示する
+void peephole_report(FILE *out){
+	fprintf(out, "%-16s %10s\n", "peephole", "hits");
+	for(int p = 0; p < NUM_PEEPHOLES; p++){
+		fprintf(out, "%-16s %10ld\n", peephole_name[p], atomic_load(&peephole_hits[p]));
+	}
+}
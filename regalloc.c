@@ -0,0 +1,719 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// 線形スキャンによるレジスタ割り当て (-O1以上)
+//
+// 中間表現の各仮想レジスタに、最初に現れる命令から最後に現れる命令までの
+// 1つの生存区間を付け、開始位置の順にレジスタを割り当てる。空きがなければ
+// 終わりが最も遠い区間をスピルし、その仮想レジスタは関数全体でスタック
+// フレームに置く。変数の生存区間はブロック間の生存解析で広げる。
+//
+// 関数呼び出しをまたぐ区間は呼び出し先保存のレジスタにだけ置く。
+// RAX, RDX, R11は除算・返り値・スピルした値の読み書きに使うので
+// 割り当てない。
+
+static Reg callee_saved[] = {RBX, R12, R13, R14, R15};
+static Reg caller_saved[] = {RCX, RSI, RDI, R8, R9, R10};
+
+#define NUM_CALLEE_SAVED (int)(sizeof(callee_saved) / sizeof(*callee_saved))
+#define NUM_CALLER_SAVED (int)(sizeof(caller_saved) / sizeof(*caller_saved))
+
+// 仮想レジスタの割り当て結果
+typedef struct {
+	int start; // 生存区間 [start, end] (命令番号)。startが-1なら現れない。
+	int end;
+	int nuses; // 値が読まれる回数
+	bool call; // 区間の途中に関数呼び出しがある
+	Reg reg;
+	int slot; // スピルした場合のRBPからのオフセット。0ならreg。
+} VReg;
+
+static _Thread_local IrFunc *irf;
+static _Thread_local VReg *vr;
+
+//---- 生存区間 ----
+
+static void touch(int v, int pos){
+	if(vr[v].start < 0 || pos < vr[v].start){
+		vr[v].start = pos;
+	}
+	if(pos > vr[v].end){
+		vr[v].end = pos;
+	}
+}
+
+// 命令が読む仮想レジスタをusesに書き、その数を返す
+static int ir_uses(Ir *ir, int *uses){
+	if(ir->op == IR_CALL){
+		memcpy(uses, ir->args, sizeof(int) * ir->nargs);
+		return ir->nargs;
+	}
+	int n = 0;
+	if(ir->a >= 0){
+		uses[n++] = ir->a;
+	}
+	if(ir->b >= 0){
+		uses[n++] = ir->b;
+	}
+	return n;
+}
+
+static bool ends_block(IrOp op){
+	return op == IR_JMP || op == IR_BR || op == IR_RET;
+}
+
+#define BIT_TEST(set, i) ((set)[(i) / 64] >> ((i) % 64) & 1)
+#define BIT_SET(set, i) ((set)[(i) / 64] |= 1UL << ((i) % 64))
+
+// 変数の仮想レジスタについてブロック間の生存解析をし、ブロックの入口・出口で
+// 生きている変数の区間をそこまで広げる。関数の入口で生きている (値を入れる
+// 前に読まれうる) 変数をuninitに記録する。
+static void var_liveness(bool *uninit){
+	int n = irf->len;
+	int nvars = irf->nvars;
+	if(nvars == 0){
+		return;
+	}
+
+	// 基本ブロックに分ける
+	int *block_of = malloc(sizeof(int) * n);
+	int nblocks = 0;
+	int max_label = 0;
+	for(int i = 0; i < n; i++){
+		if(i == 0 || irf->code[i].op == IR_LABEL || ends_block(irf->code[i - 1].op)){
+			nblocks++;
+		}
+		block_of[i] = nblocks - 1;
+		if(irf->code[i].label > max_label){
+			max_label = irf->code[i].label;
+		}
+	}
+	int *first = malloc(sizeof(int) * nblocks);
+	int *last = malloc(sizeof(int) * nblocks);
+	int *label_block = malloc(sizeof(int) * (max_label + 1));
+	for(int i = 0; i < n; i++){
+		if(i == 0 || block_of[i] != block_of[i - 1]){
+			first[block_of[i]] = i;
+		}
+		last[block_of[i]] = i;
+		if(irf->code[i].op == IR_LABEL){
+			label_block[irf->code[i].label] = block_of[i];
+		}
+	}
+
+	// ブロックごとの use (定義より先に読む変数) と def
+	int words = (nvars + 63) / 64;
+	unsigned long *use = calloc((size_t)nblocks * words, sizeof(long));
+	unsigned long *def = calloc((size_t)nblocks * words, sizeof(long));
+	unsigned long *in = calloc((size_t)nblocks * words, sizeof(long));
+	unsigned long *out = calloc((size_t)nblocks * words, sizeof(long));
+	int *uses = malloc(sizeof(int) * 8);
+	int cap_uses = 8;
+	for(int i = 0; i < n; i++){
+		Ir *ir = &irf->code[i];
+		unsigned long *u = &use[(size_t)block_of[i] * words];
+		unsigned long *d = &def[(size_t)block_of[i] * words];
+		if(ir->op == IR_CALL && ir->nargs > cap_uses){
+			cap_uses = ir->nargs;
+			uses = realloc(uses, sizeof(int) * cap_uses);
+		}
+		int nu = ir_uses(ir, uses);
+		for(int j = 0; j < nu; j++){
+			if(uses[j] < nvars && !BIT_TEST(d, uses[j])){
+				BIT_SET(u, uses[j]);
+			}
+		}
+		if(ir->dst >= 0 && ir->dst < nvars){
+			BIT_SET(d, ir->dst);
+		}
+	}
+
+	// 後ろのブロックから不動点まで繰り返す
+	bool changed = true;
+	while(changed){
+		changed = false;
+		for(int b = nblocks - 1; b >= 0; b--){
+			unsigned long *o = &out[(size_t)b * words];
+			Ir *tail = &irf->code[last[b]];
+			int succ[2];
+			int nsucc = 0;
+			if(tail->op == IR_JMP || tail->op == IR_BR){
+				succ[nsucc++] = label_block[tail->label];
+			}
+			if(tail->op != IR_JMP && tail->op != IR_RET && b + 1 < nblocks){
+				succ[nsucc++] = b + 1;
+			}
+			for(int s = 0; s < nsucc; s++){
+				unsigned long *si = &in[(size_t)succ[s] * words];
+				for(int w = 0; w < words; w++){
+					o[w] |= si[w];
+				}
+			}
+			unsigned long *bi = &in[(size_t)b * words];
+			unsigned long *u = &use[(size_t)b * words];
+			unsigned long *d = &def[(size_t)b * words];
+			for(int w = 0; w < words; w++){
+				unsigned long v = u[w] | (o[w] & ~d[w]);
+				if(v != bi[w]){
+					bi[w] = v;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	for(int b = 0; b < nblocks; b++){
+		for(int v = 0; v < nvars; v++){
+			if(BIT_TEST(&in[(size_t)b * words], v)){
+				touch(v, first[b]);
+			}
+			if(BIT_TEST(&out[(size_t)b * words], v)){
+				touch(v, last[b]);
+			}
+		}
+	}
+	for(int v = 0; v < nvars; v++){
+		uninit[v] = BIT_TEST(in, v);
+	}
+
+	free(uses);
+	free(out);
+	free(in);
+	free(def);
+	free(use);
+	free(label_block);
+	free(last);
+	free(first);
+	free(block_of);
+}
+
+// 各仮想レジスタの生存区間を求める
+static void build_intervals(bool *uninit){
+	int n = irf->len;
+	for(int v = 0; v < irf->nvregs; v++){
+		vr[v].start = vr[v].end = -1;
+	}
+
+	int *uses = NULL;
+	int cap_uses = 0;
+	for(int i = 0; i < n; i++){
+		Ir *ir = &irf->code[i];
+		if(ir->op == IR_CALL && ir->nargs > cap_uses){
+			cap_uses = ir->nargs;
+			uses = realloc(uses, sizeof(int) * cap_uses);
+		}
+		else if(!uses){
+			cap_uses = 2;
+			uses = malloc(sizeof(int) * cap_uses);
+		}
+		int nu = ir_uses(ir, uses);
+		for(int j = 0; j < nu; j++){
+			touch(uses[j], i);
+			vr[uses[j]].nuses++;
+		}
+		if(ir->dst >= 0){
+			touch(ir->dst, i);
+		}
+	}
+	free(uses);
+
+	var_liveness(uninit);
+
+	// 区間の途中 (両端を除く) に呼び出しがあるか
+	int *calls = malloc(sizeof(int) * (n + 1)); // calls[i]は命令iより前の呼び出しの数
+	calls[0] = 0;
+	for(int i = 0; i < n; i++){
+		calls[i + 1] = calls[i] + (irf->code[i].op == IR_CALL);
+	}
+	for(int v = 0; v < irf->nvregs; v++){
+		if(vr[v].start >= 0){
+			vr[v].call = calls[vr[v].end] - calls[vr[v].start + 1] > 0;
+		}
+	}
+	free(calls);
+}
+
+//---- 割り当て ----
+
+static int cmp_start(const void *a, const void *b){
+	int x = *(int *)a, y = *(int *)b;
+	if(vr[x].start != vr[y].start){
+		return vr[x].start - vr[y].start;
+	}
+	return x - y;
+}
+
+static bool is_callee_saved(Reg reg){
+	for(int i = 0; i < NUM_CALLEE_SAVED; i++){
+		if(callee_saved[i] == reg){
+			return true;
+		}
+	}
+	return false;
+}
+
+// 線形スキャンで割り当て、スピルする仮想レジスタにはspill[v]をtrueにする。
+// 使った呼び出し先保存のレジスタをusedに記録する。
+static void linear_scan(bool *spill, bool *used){
+	int *order = malloc(sizeof(int) * (irf->nvregs + 1));
+	int norder = 0;
+	for(int v = 0; v < irf->nvregs; v++){
+		if(vr[v].start >= 0 && !spill[v]){
+			order[norder++] = v;
+		}
+	}
+	qsort(order, norder, sizeof(int), cmp_start);
+
+	int active[NUM_CALLEE_SAVED + NUM_CALLER_SAVED];
+	int nactive = 0;
+
+	for(int k = 0; k < norder; k++){
+		int v = order[k];
+
+		// 終わった区間のレジスタを空ける。同じ命令で終わる値と
+		// 始まる値は同じレジスタを使ってよい。
+		bool busy[16] = {};
+		int j = 0;
+		for(int i = 0; i < nactive; i++){
+			if(vr[active[i]].end > vr[v].start){
+				active[j++] = active[i];
+				busy[vr[active[i]].reg] = true;
+			}
+		}
+		nactive = j;
+
+		int reg = -1;
+		if(!vr[v].call){
+			for(int i = 0; i < NUM_CALLER_SAVED && reg < 0; i++){
+				if(!busy[caller_saved[i]]){
+					reg = caller_saved[i];
+				}
+			}
+		}
+		for(int i = 0; i < NUM_CALLEE_SAVED && reg < 0; i++){
+			if(!busy[callee_saved[i]]){
+				reg = callee_saved[i];
+			}
+		}
+
+		if(reg < 0){
+			// 置けるレジスタを持つ区間のうち終わりが最も遠いものと比べ、
+			// 遠いほうをスピルする
+			int victim = -1;
+			for(int i = 0; i < nactive; i++){
+				int w = active[i];
+				if(vr[v].call && !is_callee_saved(vr[w].reg)){
+					continue;
+				}
+				if(victim < 0 || vr[w].end > vr[active[victim]].end){
+					victim = i;
+				}
+			}
+			if(victim < 0 || vr[active[victim]].end <= vr[v].end){
+				spill[v] = true;
+				continue;
+			}
+			reg = vr[active[victim]].reg;
+			spill[active[victim]] = true;
+			active[victim] = active[--nactive];
+		}
+
+		vr[v].reg = reg;
+		if(is_callee_saved(reg)){
+			used[reg] = true;
+		}
+		active[nactive++] = v;
+	}
+	free(order);
+}
+
+//---- 命令の生成 ----
+
+static void emit_mov(Reg dst, Reg src){
+	if(dst != src){
+		emit_rr(IN_MOV, dst, src);
+	}
+}
+
+// vの値が入ったレジスタを返す。スピルしていればscratchに読み込む。
+static Reg use_reg(int v, Reg scratch){
+	if(vr[v].slot){
+		emit_load(scratch, RBP, -vr[v].slot);
+		return scratch;
+	}
+	return vr[v].reg;
+}
+
+// vの値をdstに入れる
+static void move_to(Reg dst, int v){
+	if(vr[v].slot){
+		emit_load(dst, RBP, -vr[v].slot);
+	}
+	else{
+		emit_mov(dst, vr[v].reg);
+	}
+}
+
+// vに書く値を計算するレジスタ。スピルしていればRAXで計算してから書く。
+static Reg def_reg(int v){
+	return vr[v].slot ? RAX : vr[v].reg;
+}
+
+static void def_done(int v, Reg reg){
+	if(vr[v].slot){
+		emit_store(RBP, -vr[v].slot, reg);
+	}
+}
+
+// dst[i] = src[i] を同時に行う。循環はR11を使って断ち切る。
+static void parallel_move(Reg *dst, Reg *src, int n){
+	bool done[6] = {};
+	int left = n;
+	for(int i = 0; i < n; i++){
+		if(dst[i] == src[i]){
+			done[i] = true;
+			left--;
+		}
+	}
+	while(left > 0){
+		bool progress = false;
+		for(int i = 0; i < n; i++){
+			if(done[i]){
+				continue;
+			}
+			// dst[i]をまだ読む移動があれば後にする
+			bool blocked = false;
+			for(int j = 0; j < n; j++){
+				if(!done[j] && j != i && src[j] == dst[i]){
+					blocked = true;
+				}
+			}
+			if(!blocked){
+				emit_mov(dst[i], src[i]);
+				done[i] = true;
+				left--;
+				progress = true;
+			}
+		}
+		if(!progress){
+			for(int i = 0; i < n; i++){
+				if(!done[i]){
+					emit_mov(R11, src[i]);
+					src[i] = R11;
+					break;
+				}
+			}
+		}
+	}
+}
+
+static void emit_jump_to(InstKind kind, int label){
+	emit_jmp(kind, label % NUM_LABEL_KINDS, label / NUM_LABEL_KINDS);
+}
+
+static InstKind alu_inst[] = {
+	[IR_ADD] = IN_ADD, [IR_SUB] = IN_SUB, [IR_MUL] = IN_IMUL,
+};
+
+static InstKind setcc_inst[] = {
+	[IR_EQ] = IN_SETE, [IR_NE] = IN_SETNE, [IR_LT] = IN_SETL, [IR_LE] = IN_SETLE,
+};
+
+// 条件が成り立たないときに飛ぶジャンプ
+static InstKind jump_if_not[] = {
+	[IR_EQ] = IN_JNE, [IR_NE] = IN_JE, [IR_LT] = IN_JGE, [IR_LE] = IN_JG,
+};
+
+// dst = a op b (2番地の命令にする)
+static void gen_binop(Ir *ir){
+	InstKind kind = alu_inst[ir->op];
+	Reg d = def_reg(ir->dst);
+	if(ir->bimm){
+		move_to(d, ir->a);
+		if(ir->op == IR_MUL){
+			emit_mul_imm(d, ir->imm);
+		}
+		else{
+			emit_ri(kind, d, ir->imm);
+		}
+	}
+	else{
+		Reg b = use_reg(ir->b, R11);
+		bool a_in_d = !vr[ir->a].slot && vr[ir->a].reg == d;
+		if(b == d && !a_in_d){
+			// aを入れるとbが壊れる
+			if(ir->op != IR_SUB){
+				emit_rr(kind, d, use_reg(ir->a, RDX));
+				def_done(ir->dst, d);
+				return;
+			}
+			emit_mov(R11, b);
+			b = R11;
+		}
+		move_to(d, ir->a);
+		emit_rr(kind, d, b);
+	}
+	def_done(ir->dst, d);
+}
+
+// aとb (または即値) を比べる
+static void gen_cmp(Ir *ir){
+	Reg a = use_reg(ir->a, RAX);
+	if(ir->bimm){
+		emit_ri(IN_CMP, a, ir->imm);
+	}
+	else{
+		emit_rr(IN_CMP, a, use_reg(ir->b, R11));
+	}
+}
+
+static void gen_call(Ir *ir){
+	Reg dst[6], src[6];
+	int n = 0;
+	for(int i = 0; i < ir->nargs; i++){
+		if(!vr[ir->args[i]].slot){
+			dst[n] = argreg[i];
+			src[n] = vr[ir->args[i]].reg;
+			n++;
+		}
+	}
+	parallel_move(dst, src, n);
+	for(int i = 0; i < ir->nargs; i++){
+		if(vr[ir->args[i]].slot){
+			emit_load(argreg[i], RBP, -vr[ir->args[i]].slot);
+		}
+	}
+	emit_ri(IN_MOV, RAX, 0);
+	emit_sym(IN_CALL, ir->sym);
+	if(vr[ir->dst].nuses){
+		Reg d = def_reg(ir->dst);
+		emit_mov(d, RAX);
+		def_done(ir->dst, d);
+	}
+}
+
+// 関数の先頭で引数をレジスタかスタックフレームに移す
+static void gen_params(Ir *code, int n){
+	Reg dst[6], src[6];
+	int nmoves = 0;
+	for(int i = 0; i < n; i++){
+		Ir *ir = &code[i];
+		Reg arg = argreg[ir->imm];
+		if(ir->dst < 0){
+			emit_store(RBP, -ir->var->offset, arg);
+		}
+		else if(vr[ir->dst].slot){
+			emit_store(RBP, -vr[ir->dst].slot, arg);
+		}
+		else if(vr[ir->dst].nuses){
+			dst[nmoves] = vr[ir->dst].reg;
+			src[nmoves] = arg;
+			nmoves++;
+		}
+	}
+	parallel_move(dst, src, nmoves);
+}
+
+static void gen_ir(Ir *ir, bool last){
+	switch(ir->op){
+	case IR_IMM: {
+		Reg d = def_reg(ir->dst);
+		emit_ri(IN_MOV, d, ir->imm);
+		def_done(ir->dst, d);
+		return;
+	}
+	case IR_MOV:
+		if(vr[ir->dst].slot && !vr[ir->a].slot){
+			emit_store(RBP, -vr[ir->dst].slot, vr[ir->a].reg);
+			return;
+		}
+		move_to(def_reg(ir->dst), ir->a);
+		def_done(ir->dst, def_reg(ir->dst));
+		return;
+	case IR_ADD:
+	case IR_SUB:
+	case IR_MUL:
+		gen_binop(ir);
+		return;
+	case IR_DIV: {
+		if(ir->bimm && ir->exact){
+			Reg d = def_reg(ir->dst);
+			move_to(d, ir->a);
+			emit_exact_div_imm(d, ir->imm);
+			def_done(ir->dst, d);
+			return;
+		}
+		if(ir->bimm && can_div_imm(ir->imm)){
+			Reg d = def_reg(ir->dst);
+			emit_div_imm(d, use_reg(ir->a, R11), ir->imm);
+			def_done(ir->dst, d);
+			return;
+		}
+		move_to(RAX, ir->a);
+		Reg b = R11;
+		if(ir->bimm){
+			emit_ri(IN_MOV, R11, ir->imm);
+		}
+		else{
+			b = use_reg(ir->b, R11);
+		}
+		emit0(IN_CQO);
+		emit_r(IN_IDIV, b);
+		Reg d = def_reg(ir->dst);
+		emit_mov(d, RAX);
+		def_done(ir->dst, d);
+		return;
+	}
+	case IR_EQ:
+	case IR_NE:
+	case IR_LT:
+	case IR_LE: {
+		gen_cmp(ir);
+		Reg d = def_reg(ir->dst);
+		emit_setcc(setcc_inst[ir->op], d);
+		def_done(ir->dst, d);
+		return;
+	}
+	case IR_ADDR: {
+		Reg d = def_reg(ir->dst);
+		emit_rr(IN_MOV, d, RBP);
+		emit_ri(IN_SUB, d, ir->var->offset);
+		def_done(ir->dst, d);
+		return;
+	}
+	case IR_LOAD: {
+		Reg a = use_reg(ir->a, R11);
+		Reg d = def_reg(ir->dst);
+		emit_load(d, a, 0);
+		def_done(ir->dst, d);
+		return;
+	}
+	case IR_STORE: {
+		Reg a = use_reg(ir->a, R11);
+		emit_store(a, 0, use_reg(ir->b, RAX));
+		return;
+	}
+	case IR_LOADVAR: {
+		Reg d = def_reg(ir->dst);
+		emit_load(d, RBP, -ir->var->offset);
+		def_done(ir->dst, d);
+		return;
+	}
+	case IR_STOREVAR:
+		emit_store(RBP, -ir->var->offset, use_reg(ir->a, RAX));
+		return;
+	case IR_LABEL:
+		emit_label(ir->label % NUM_LABEL_KINDS, ir->label / NUM_LABEL_KINDS);
+		return;
+	case IR_JMP:
+		emit_jump_to(IN_JMP, ir->label);
+		return;
+	case IR_BR:
+		gen_cmp(ir);
+		emit_jump_to(jump_if_not[ir->cond], ir->label);
+		return;
+	case IR_CALL:
+		gen_call(ir);
+		return;
+	case IR_PARAM:
+		return;
+	case IR_RET:
+		if(ir->a >= 0){
+			move_to(RAX, ir->a);
+		}
+		else{
+			emit_ri(IN_MOV, RAX, 0);
+		}
+		if(!last){
+			emit_jmp(IN_JMP, L_RETURN, 0);
+		}
+		return;
+	}
+}
+
+// fnのレジスタ割り当て済みの命令列を生成する
+void gen_function_ra(Function *fn){
+	irf = lower_function(fn);
+	if(opt_level >= 2){
+		optimize_ir(fn, irf);
+	}
+	int n = irf->len;
+	vr = calloc(irf->nvregs + 1, sizeof(VReg));
+
+	// 値を入れる前に読まれうる変数は、はじめからスピルしておく
+	bool *spill = calloc(irf->nvregs + 1, sizeof(bool));
+	build_intervals(spill);
+	bool used[16] = {};
+	linear_scan(spill, used);
+
+	// スタックフレーム: 保存したレジスタ、メモリに置く変数、スピルの順
+	int nsaved = 0;
+	for(int i = 0; i < NUM_CALLEE_SAVED; i++){
+		nsaved += used[callee_saved[i]];
+	}
+	int offset = nsaved * 8;
+	for(LVar *var = fn->locals; var; var = var->next){
+		if(var->vreg < 0){
+			offset += var->ty->size;
+			var->offset = offset;
+		}
+	}
+	for(int v = 0; v < irf->nvregs; v++){
+		if(spill[v]){
+			offset += 8;
+			vr[v].slot = offset;
+		}
+	}
+	int frame = offset - nsaved * 8;
+	if(offset % 16){
+		frame += 16 - offset % 16;
+	}
+
+	// プロローグ
+	emit_r(IN_PUSH, RBP);
+	emit_rr(IN_MOV, RBP, RSP);
+	for(int i = 0; i < NUM_CALLEE_SAVED; i++){
+		if(used[callee_saved[i]]){
+			emit_r(IN_PUSH, callee_saved[i]);
+		}
+	}
+	if(frame){
+		emit_ri(IN_SUB, RSP, frame);
+	}
+
+	int nparams = 0;
+	while(nparams < n && irf->code[nparams].op == IR_PARAM){
+		nparams++;
+	}
+	gen_params(irf->code, nparams);
+
+	// 最後のIR_RETの直前がreturnやジャンプならそこには来ない
+	int end = n;
+	if(n >= 2 && (irf->code[n - 2].op == IR_RET || irf->code[n - 2].op == IR_JMP)){
+		end = n - 1;
+	}
+	for(int i = nparams; i < end; i++){
+		gen_ir(&irf->code[i], i == end - 1);
+	}
+
+	// エピローグ
+	emit_label(L_RETURN, 0);
+	if(frame){
+		emit_ri(IN_ADD, RSP, frame);
+	}
+	for(int i = NUM_CALLEE_SAVED - 1; i >= 0; i--){
+		if(used[callee_saved[i]]){
+			emit_r(IN_POP, callee_saved[i]);
+		}
+	}
+	emit_r(IN_POP, RBP);
+	emit0(IN_RET);
+
+	free(spill);
+	free(vr);
+	vr = NULL;
+	free_ir(irf);
+	irf = NULL;
+}
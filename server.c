@@ -0,0 +1,278 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "9cc.h"
+
+// コンパイルサーバ
+//
+// 起動したプロセスで複数のプログラムを続けてコンパイルし、プロセスの
+// 起動と終了のコストを省く。要求と応答は次の形式で、長さは10進数。
+//
+//   要求: "<n>\n" の後にnバイトのプログラム
+//   応答: "<status> <n>\n" の後にnバイト
+//         statusが0ならアセンブリ、1ならエラーメッセージ
+//
+// --server では標準入力から要求を読み標準出力に応答する。
+// --server=<パス> ではUnixドメインソケットで接続を1つずつ受け付け、
+// 1つの接続で何個でも要求を送れる。
+
+extern char *user_input;
+extern char *filename;
+
+// fdからのバッファ付き読み込み
+typedef struct {
+	int fd;
+	char buf[65536];
+	int pos;
+	int len;
+} Reader;
+
+static int reader_getc(Reader *r){
+	if(r->pos == r->len){
+		ssize_t n;
+		do{
+			n = read(r->fd, r->buf, sizeof(r->buf));
+		}while(n < 0 && errno == EINTR);
+		if(n <= 0){
+			return EOF;
+		}
+		r->pos = 0;
+		r->len = n;
+	}
+	return (unsigned char)r->buf[r->pos++];
+}
+
+// nバイト読む。途中で入力が終わったらfalse。
+static bool reader_read(Reader *r, char *dst, size_t n){
+	while(n > 0){
+		if(r->pos == r->len){
+			if(reader_getc(r) == EOF){
+				return false;
+			}
+			r->pos--;
+		}
+		size_t chunk = r->len - r->pos;
+		if(chunk > n){
+			chunk = n;
+		}
+		memcpy(dst, r->buf + r->pos, chunk);
+		r->pos += chunk;
+		dst += chunk;
+		n -= chunk;
+	}
+	return true;
+}
+
+// "<数>[ <数>]\n" を読む。入力の終わりや形式の誤りならfalse。
+static bool read_header(Reader *r, long *vals, int nvals){
+	for(int i = 0; i < nvals; i++){
+		int c = reader_getc(r);
+		if(c < '0' || '9' < c){
+			return false;
+		}
+		long v = 0;
+		while('0' <= c && c <= '9'){
+			v = v * 10 + (c - '0');
+			c = reader_getc(r);
+		}
+		vals[i] = v;
+		if(c != (i == nvals - 1 ? '\n' : ' ')){
+			return false;
+		}
+	}
+	return true;
+}
+
+static void put_header(OutBuf *buf, int status, size_t len){
+	if(status >= 0){
+		buf_putint(buf, status);
+		buf_putc(buf, ' ');
+	}
+	buf_putint(buf, len);
+	buf_putc(buf, '\n');
+}
+
+// 1つの要求をコンパイルして応答を書く。接続が切れたらfalse。
+static bool handle_request(char *src, int out, int njobs){
+	char *msg = NULL;
+	size_t msglen = 0;
+	FILE *errfp = open_memstream(&msg, &msglen);
+	volatile bool sending = false;
+	volatile bool ok = true;
+	Function *volatile prog = NULL;
+
+	jmp_buf jb;
+	error_out = errfp;
+	error_jmp = &jb;
+
+	if(setjmp(jb) == 0){
+		user_input = src;
+		filename = "<request>";
+		prog = compile(njobs);
+
+		OutBuf frame = {};
+		put_header(&frame, 0, asm_length(prog));
+		sending = true;
+		write_asm(out, prog, &frame);
+		buf_free(&frame);
+		prog = NULL;
+	}
+	else if(sending){
+		// 応答の途中で書き込みに失敗した
+		ok = false;
+	}
+	else{
+		// コンパイルエラー
+		if(prog){
+			free_asm(prog);
+		}
+		fflush(errfp);
+		OutBuf frame = {};
+		put_header(&frame, 1, msglen);
+		buf_putn(&frame, msg, msglen);
+		sending = true;
+		if(setjmp(jb) == 0){
+			OutBuf *bufs[] = { &frame };
+			buf_write(out, bufs, 1);
+		}
+		else{
+			ok = false;
+		}
+		buf_free(&frame);
+	}
+
+	error_out = NULL;
+	error_jmp = NULL;
+	fclose(errfp);
+	free(msg);
+	reset_compiler();
+	return ok;
+}
+
+// 入力が終わるまで要求を処理する
+static void serve(int in, int out, int njobs){
+	Reader *r = calloc(1, sizeof(Reader));
+	r->fd = in;
+	size_t cap = 0;
+	char *src = NULL;
+
+	for(;;){
+		long len;
+		if(!read_header(r, &len, 1)){
+			break;
+		}
+		if(cap < len + 1){
+			cap = len + 1;
+			src = realloc(src, cap);
+		}
+		if(!reader_read(r, src, len)){
+			break;
+		}
+		src[len] = '\0';
+		if(!handle_request(src, out, njobs)){
+			break;
+		}
+	}
+
+	free(src);
+	free(r);
+}
+
+static int unix_socket(char *path, struct sockaddr_un *addr){
+	if(strlen(path) >= sizeof(addr->sun_path)){
+		error("ソケットのパスが長すぎます: %s", path);
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0){
+		error("ソケットを作れません: %s", strerror(errno));
+	}
+	return fd;
+}
+
+// pathがNULLなら標準入出力、そうでなければUnixドメインソケットで待ち受ける
+int run_server(char *path, int njobs){
+	signal(SIGPIPE, SIG_IGN);
+	stats.enabled = false;
+
+	if(!path){
+		serve(0, 1, njobs);
+		return 0;
+	}
+
+	struct sockaddr_un addr;
+	int sock = unix_socket(path, &addr);
+	unlink(path);
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0){
+		error("%s で待ち受けできません: %s", path, strerror(errno));
+	}
+
+	for(;;){
+		int conn = accept(sock, NULL, NULL);
+		if(conn < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			error("接続を受け付けられません: %s", strerror(errno));
+		}
+		serve(conn, conn, njobs);
+		close(conn);
+	}
+}
+
+// サーバにinputのコンパイルを依頼し、結果をoutput_path (NULLなら標準出力) に書く。
+// エラーの場合はメッセージを標準エラー出力に書いて1を返す。
+int run_client(char *path, char *input, char *output_path){
+	struct sockaddr_un addr;
+	int sock = unix_socket(path, &addr);
+	if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		error("%s に接続できません: %s", path, strerror(errno));
+	}
+
+	OutBuf req = {};
+	size_t len = strlen(input);
+	put_header(&req, -1, len);
+	buf_putn(&req, input, len);
+	OutBuf *bufs[] = { &req };
+	buf_write(sock, bufs, 1);
+	buf_free(&req);
+
+	Reader *r = calloc(1, sizeof(Reader));
+	r->fd = sock;
+	long hdr[2];
+	if(!read_header(r, hdr, 2)){
+		error("サーバからの応答が不正です。");
+	}
+	OutBuf res = {};
+	buf_reserve(&res, hdr[1]);
+	if(!reader_read(r, res.data, hdr[1])){
+		error("サーバからの応答が途中で切れました。");
+	}
+	res.len = hdr[1];
+	free(r);
+	close(sock);
+
+	int fd = 2;
+	if(hdr[0] == 0){
+		fd = 1;
+		if(output_path){
+			fd = open_output(output_path);
+		}
+	}
+	OutBuf *out[] = { &res };
+	buf_write(fd, out, 1);
+	if(fd > 2){
+		close(fd);
+	}
+	buf_free(&res);
+	return hdr[0] == 0 ? 0 : 1;
+}
@@ -0,0 +1,2192 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "9cc.h"
+
+// SSA形式の中間表現での最適化 (-O2以上)
+//
+// lower_functionの命令列を基本ブロックに分け、レジスタに置く変数に
+// phiを置いてSSA形式にする。そのうえで次のパスを、どれも何も変えなく
+// なるまで (最大MAX_ROUNDS回) 順に回す。
+//
+//   sccp  疎な条件付き定数伝播。定数になる値を即値にし、通らない分岐を消す。
+//   gvn   支配木をたどる値番号付け。同じ計算とコピーを1つにまとめ、
+//         ブロック内では変数やポインタの読み出しを前の読み書きから再利用する。
+//   dce   副作用のある命令から使われない値の計算を消す。
+//   dse   読まれないメモリの変数への書き込みを消す。
+//
+// 最後にphiを先行ブロックの末尾のコピーに戻して命令列を作り直し、
+// ブロックをまたぐ値を0..nvars-1に並べてregalloc.cに渡す。
+
+#define MAX_ROUNDS 4
+
+typedef struct {
+	int dst;
+	int orig; // SSAにする前の仮想レジスタ
+	int *args; // 先行ブロックごとの値 (predsと同じ順)。-1は値が入っていない。
+} Phi;
+
+typedef struct {
+	Ir *code; // 最後の命令は必ずIR_JMP, IR_BR, IR_RETのどれか
+	int len;
+	int cap;
+	Phi *phis;
+	int nphis;
+	int cap_phis;
+	int succ[2]; // IR_BRでは条件が成り立てばsucc[0]、成り立たなければsucc[1]
+	int nsucc;
+	int *preds;
+	int npreds;
+	int cap_preds;
+	int label; // ブロックの先頭のラベル番号 (-1ならなし)
+	bool live; // 入口から到達できる
+	bool split; // 臨界辺を分けるために足したブロック
+	int rpo; // 逆後順での番号
+	int idom; // 直接の支配ブロック
+	int child; // 支配木の最初の子
+	int sibling; // 支配木の次の兄弟
+} Block;
+
+static _Thread_local IrFunc *irf;
+static _Thread_local Function *cur_fn;
+static _Thread_local Block *blocks;
+static _Thread_local int nblocks;
+static _Thread_local int cap_blocks;
+static _Thread_local int *order; // 到達できるブロックの逆後順
+static _Thread_local int norder;
+static _Thread_local int undef = -1; // 値を入れる前の変数を読んだときの値
+static _Thread_local int max_uses; // 1命令のオペランドの最大数
+
+static bool ends_block(IrOp op){
+	return op == IR_JMP || op == IR_BR || op == IR_RET;
+}
+
+static bool is_binop(IrOp op){
+	return op >= IR_ADD && op <= IR_LE;
+}
+
+static bool is_commutative(IrOp op){
+	return op == IR_ADD || op == IR_MUL || op == IR_EQ || op == IR_NE;
+}
+
+static int new_value(void){
+	return irf->nvregs++;
+}
+
+static int new_block(void){
+	if(nblocks == cap_blocks){
+		cap_blocks = cap_blocks ? cap_blocks * 2 : 16;
+		blocks = realloc(blocks, sizeof(Block) * cap_blocks);
+	}
+	Block *b = &blocks[nblocks];
+	memset(b, 0, sizeof(Block));
+	b->label = -1;
+	b->idom = -1;
+	b->child = -1;
+	b->sibling = -1;
+	return nblocks++;
+}
+
+static void block_insert(int b, int i, Ir *ir){
+	Block *bl = &blocks[b];
+	if(bl->len == bl->cap){
+		bl->cap = bl->cap ? bl->cap * 2 : 8;
+		bl->code = realloc(bl->code, sizeof(Ir) * bl->cap);
+	}
+	memmove(&bl->code[i + 1], &bl->code[i], sizeof(Ir) * (bl->len - i));
+	bl->code[i] = *ir;
+	bl->len++;
+}
+
+static void block_push(int b, Ir *ir){
+	block_insert(b, blocks[b].len, ir);
+}
+
+static void jump_to(int b, int target){
+	Ir ir = {.op = IR_JMP, .dst = -1, .a = -1, .b = -1};
+	block_push(b, &ir);
+	blocks[b].succ[0] = target;
+	blocks[b].nsucc = 1;
+}
+
+static void add_pred(int b, int pred){
+	Block *bl = &blocks[b];
+	if(bl->npreds == bl->cap_preds){
+		bl->cap_preds = bl->cap_preds ? bl->cap_preds * 2 : 4;
+		bl->preds = realloc(bl->preds, sizeof(int) * bl->cap_preds);
+	}
+	bl->preds[bl->npreds++] = pred;
+}
+
+static int pred_index(int b, int pred){
+	for(int j = 0; j < blocks[b].npreds; j++){
+		if(blocks[b].preds[j] == pred){
+			return j;
+		}
+	}
+	return -1;
+}
+
+// bのj番目の先行ブロックからの辺を消す
+static void remove_pred_at(int b, int j){
+	Block *bl = &blocks[b];
+	bl->npreds--;
+	memmove(&bl->preds[j], &bl->preds[j + 1], sizeof(int) * (bl->npreds - j));
+	for(int k = 0; k < bl->nphis; k++){
+		int *args = bl->phis[k].args;
+		memmove(&args[j], &args[j + 1], sizeof(int) * (bl->npreds - j));
+	}
+}
+
+// 命令のオペランドの仮想レジスタへのポインタを usesに並べ、その数を返す
+static int operands(Ir *ir, int **uses){
+	int n = 0;
+	if(ir->a >= 0){
+		uses[n++] = &ir->a;
+	}
+	if(ir->b >= 0 && !ir->bimm){
+		uses[n++] = &ir->b;
+	}
+	for(int i = 0; i < ir->nargs; i++){
+		uses[n++] = &ir->args[i];
+	}
+	return n;
+}
+
+// 消した命令 (IR_NOP) を詰める
+static void compact(int b){
+	Block *bl = &blocks[b];
+	int n = 0;
+	for(int i = 0; i < bl->len; i++){
+		if(bl->code[i].op != IR_NOP){
+			bl->code[n++] = bl->code[i];
+		}
+	}
+	bl->len = n;
+}
+
+static void kill_ir(Ir *ir){
+	free(ir->args);
+	memset(ir, 0, sizeof(Ir));
+	ir->op = IR_NOP;
+	ir->dst = ir->a = ir->b = -1;
+}
+
+// 命令列を基本ブロックに分ける。ブロック0は引数だけを置く入口。
+static void build_cfg(void){
+	int entry = new_block();
+	int i = 0;
+	for(; i < irf->len && irf->code[i].op == IR_PARAM; i++){
+		block_push(entry, &irf->code[i]);
+	}
+
+	int nlabels = 0;
+	for(int j = i; j < irf->len; j++){
+		if(irf->code[j].op == IR_LABEL && irf->code[j].label >= nlabels){
+			nlabels = irf->code[j].label + 1;
+		}
+	}
+	int *label_block = malloc(sizeof(int) * (nlabels + 1));
+
+	int cur = -1;
+	for(; i < irf->len; i++){
+		Ir *ir = &irf->code[i];
+		if(ir->op == IR_LABEL){
+			cur = new_block();
+			blocks[cur].label = ir->label;
+			label_block[ir->label] = cur;
+			continue;
+		}
+		if(cur < 0){
+			cur = new_block();
+		}
+		block_push(cur, ir);
+		if(ends_block(ir->op)){
+			cur = -1;
+		}
+	}
+
+	// 落ちていく先も含めて後続ブロックをつなぐ
+	for(int b = 0; b < nblocks; b++){
+		Block *bl = &blocks[b];
+		Ir *last = bl->len ? &bl->code[bl->len - 1] : NULL;
+		if(last && last->op == IR_JMP){
+			bl->succ[0] = label_block[last->label];
+			bl->nsucc = 1;
+		}
+		else if(last && last->op == IR_BR){
+			bl->succ[0] = b + 1;
+			bl->succ[1] = label_block[last->label];
+			bl->nsucc = 2;
+			if(bl->succ[0] == bl->succ[1]){
+				last->op = IR_JMP;
+				last->a = last->b = -1;
+				bl->nsucc = 1;
+			}
+		}
+		else if(!last || last->op != IR_RET){
+			jump_to(b, b + 1);
+		}
+	}
+	for(int b = 0; b < nblocks; b++){
+		for(int k = 0; k < blocks[b].nsucc; k++){
+			add_pred(blocks[b].succ[k], b);
+		}
+	}
+	free(label_block);
+}
+
+static int intersect(int b1, int b2){
+	while(b1 != b2){
+		while(blocks[b1].rpo > blocks[b2].rpo){
+			b1 = blocks[b1].idom;
+		}
+		while(blocks[b2].rpo > blocks[b1].rpo){
+			b2 = blocks[b2].idom;
+		}
+	}
+	return b1;
+}
+
+// 到達できるブロックを逆後順に並べ、支配木を作る (Cooper, Harvey, Kennedy)。
+// 到達できないブロックからの辺はここで消す。
+static void compute_dominators(void){
+	for(int b = 0; b < nblocks; b++){
+		blocks[b].live = false;
+		blocks[b].idom = -1;
+		blocks[b].child = -1;
+		blocks[b].sibling = -1;
+		blocks[b].rpo = -1;
+	}
+
+	// 後順 (再帰せずにスタックでたどる)
+	int *stack = malloc(sizeof(int) * nblocks);
+	int *next = calloc(nblocks, sizeof(int));
+	int *post = malloc(sizeof(int) * nblocks);
+	int npost = 0, sp = 0;
+	stack[sp++] = 0;
+	blocks[0].live = true;
+	while(sp){
+		int b = stack[sp - 1];
+		if(next[b] < blocks[b].nsucc){
+			int s = blocks[b].succ[next[b]++];
+			if(!blocks[s].live){
+				blocks[s].live = true;
+				stack[sp++] = s;
+			}
+			continue;
+		}
+		post[npost++] = b;
+		sp--;
+	}
+	free(order);
+	order = malloc(sizeof(int) * npost);
+	norder = npost;
+	for(int i = 0; i < npost; i++){
+		order[i] = post[npost - 1 - i];
+		blocks[order[i]].rpo = i;
+	}
+	free(stack);
+	free(next);
+	free(post);
+
+	for(int i = 0; i < norder; i++){
+		Block *bl = &blocks[order[i]];
+		for(int j = bl->npreds - 1; j >= 0; j--){
+			if(!blocks[bl->preds[j]].live){
+				remove_pred_at(order[i], j);
+			}
+		}
+	}
+
+	blocks[0].idom = 0;
+	for(bool changed = true; changed;){
+		changed = false;
+		for(int i = 1; i < norder; i++){
+			Block *bl = &blocks[order[i]];
+			int idom = -1;
+			for(int j = 0; j < bl->npreds; j++){
+				int p = bl->preds[j];
+				if(blocks[p].idom < 0){
+					continue;
+				}
+				idom = idom < 0 ? p : intersect(p, idom);
+			}
+			if(bl->idom != idom){
+				bl->idom = idom;
+				changed = true;
+			}
+		}
+	}
+
+	// 子は逆後順に並ぶように、後ろから先頭に足していく
+	for(int i = norder - 1; i >= 1; i--){
+		int b = order[i];
+		Block *parent = &blocks[blocks[b].idom];
+		blocks[b].sibling = parent->child;
+		parent->child = b;
+	}
+}
+
+// 支配木を前順にたどる。enterとleaveは各ブロックに入るときと出るときに呼ぶ。
+static void walk_domtree(void (*enter)(int), void (*leave)(int)){
+	int *stack = malloc(sizeof(int) * (norder + 1));
+	int *next = malloc(sizeof(int) * nblocks);
+	int sp = 0;
+	stack[sp++] = 0;
+	enter(0);
+	next[0] = blocks[0].child;
+	while(sp){
+		int b = stack[sp - 1];
+		int c = next[b];
+		if(c >= 0){
+			next[b] = blocks[c].sibling;
+			stack[sp++] = c;
+			enter(c);
+			next[c] = blocks[c].child;
+			continue;
+		}
+		if(leave){
+			leave(b);
+		}
+		sp--;
+	}
+	free(stack);
+	free(next);
+}
+
+//
+// SSA形式への変換
+//
+
+static _Thread_local int *cur_name; // 変換前の仮想レジスタ -> 今の値
+static _Thread_local int *undo; // (仮想レジスタ, 前の値) の組
+static _Thread_local int nundo;
+static _Thread_local int cap_undo;
+static _Thread_local int *undo_mark; // ブロックに入ったときのnundo
+
+static void push_name(int orig, int val){
+	if(nundo + 2 > cap_undo){
+		cap_undo = cap_undo ? cap_undo * 2 : 64;
+		undo = realloc(undo, sizeof(int) * cap_undo);
+	}
+	undo[nundo++] = orig;
+	undo[nundo++] = cur_name[orig];
+	cur_name[orig] = val;
+}
+
+static int undef_value(void){
+	if(undef < 0){
+		undef = new_value();
+	}
+	return undef;
+}
+
+static void rename_enter(int b){
+	Block *bl = &blocks[b];
+	undo_mark[b] = nundo;
+	for(int i = 0; i < bl->nphis; i++){
+		bl->phis[i].dst = new_value();
+		push_name(bl->phis[i].orig, bl->phis[i].dst);
+	}
+	int **uses = malloc(sizeof(int *) * max_uses);
+	for(int i = 0; i < bl->len; i++){
+		Ir *ir = &bl->code[i];
+		int nu = operands(ir, uses);
+		for(int j = 0; j < nu; j++){
+			int v = cur_name[*uses[j]];
+			*uses[j] = v >= 0 ? v : undef_value();
+		}
+		if(ir->dst >= 0){
+			int v = new_value();
+			push_name(ir->dst, v);
+			ir->dst = v;
+		}
+	}
+	free(uses);
+	for(int k = 0; k < bl->nsucc; k++){
+		Block *s = &blocks[bl->succ[k]];
+		int j = pred_index(bl->succ[k], b);
+		for(int i = 0; i < s->nphis; i++){
+			s->phis[i].args[j] = cur_name[s->phis[i].orig];
+		}
+	}
+}
+
+static void rename_leave(int b){
+	while(nundo > undo_mark[b]){
+		nundo -= 2;
+		cur_name[undo[nundo]] = undo[nundo + 1];
+	}
+}
+
+static void add_phi(int b, int orig){
+	Block *bl = &blocks[b];
+	if(bl->nphis == bl->cap_phis){
+		bl->cap_phis = bl->cap_phis ? bl->cap_phis * 2 : 4;
+		bl->phis = realloc(bl->phis, sizeof(Phi) * bl->cap_phis);
+	}
+	Phi *phi = &bl->phis[bl->nphis++];
+	phi->dst = -1;
+	phi->orig = orig;
+	phi->args = malloc(sizeof(int) * (bl->npreds ? bl->npreds : 1));
+	for(int j = 0; j < bl->npreds; j++){
+		phi->args[j] = -1;
+	}
+}
+
+// 支配辺境にphiを置き (ブロックをまたいで読まれる値だけ)、名前を付け替える
+static void build_ssa(void){
+	int nv = irf->nvregs;
+
+	// 支配辺境
+	int **df = calloc(nblocks, sizeof(int *));
+	int *ndf = calloc(nblocks, sizeof(int));
+	int *last_df = malloc(sizeof(int) * nblocks);
+	for(int b = 0; b < nblocks; b++){
+		last_df[b] = -1;
+	}
+	for(int i = 0; i < norder; i++){
+		int b = order[i];
+		if(blocks[b].npreds < 2){
+			continue;
+		}
+		for(int j = 0; j < blocks[b].npreds; j++){
+			for(int r = blocks[b].preds[j]; r != blocks[b].idom; r = blocks[r].idom){
+				if(last_df[r] == b){
+					break;
+				}
+				last_df[r] = b;
+				df[r] = realloc(df[r], sizeof(int) * (ndf[r] + 1));
+				df[r][ndf[r]++] = b;
+			}
+		}
+	}
+
+	// 定義より前にブロックの外から読まれる値と、それを定義するブロック
+	bool *global = calloc(nv, sizeof(bool));
+	int *def_stamp = malloc(sizeof(int) * nv);
+	int *ndefs = calloc(nv, sizeof(int));
+	for(int v = 0; v < nv; v++){
+		def_stamp[v] = -1;
+	}
+	int **uses = malloc(sizeof(int *) * max_uses);
+	for(int i = 0; i < norder; i++){
+		Block *bl = &blocks[order[i]];
+		for(int k = 0; k < bl->len; k++){
+			int nu = operands(&bl->code[k], uses);
+			for(int j = 0; j < nu; j++){
+				if(def_stamp[*uses[j]] != order[i]){
+					global[*uses[j]] = true;
+				}
+			}
+			int d = bl->code[k].dst;
+			if(d >= 0 && def_stamp[d] != order[i]){
+				def_stamp[d] = order[i];
+				ndefs[d]++;
+			}
+		}
+	}
+	int *start = calloc(nv + 1, sizeof(int));
+	for(int v = 0; v < nv; v++){
+		start[v + 1] = start[v] + ndefs[v];
+		ndefs[v] = 0;
+		def_stamp[v] = -1;
+	}
+	int *def_blocks = malloc(sizeof(int) * (start[nv] + 1));
+	for(int i = 0; i < norder; i++){
+		Block *bl = &blocks[order[i]];
+		for(int k = 0; k < bl->len; k++){
+			int d = bl->code[k].dst;
+			if(d >= 0 && def_stamp[d] != order[i]){
+				def_stamp[d] = order[i];
+				def_blocks[start[d] + ndefs[d]++] = order[i];
+			}
+		}
+	}
+
+	int *has_phi = malloc(sizeof(int) * nblocks);
+	int *queued = malloc(sizeof(int) * nblocks);
+	int *work = malloc(sizeof(int) * (nblocks + start[nv] + 1));
+	for(int b = 0; b < nblocks; b++){
+		has_phi[b] = queued[b] = -1;
+	}
+	for(int v = 0; v < nv; v++){
+		if(!global[v]){
+			continue;
+		}
+		int nwork = 0;
+		for(int k = start[v]; k < start[v + 1]; k++){
+			work[nwork++] = def_blocks[k];
+			queued[def_blocks[k]] = v;
+		}
+		while(nwork){
+			int x = work[--nwork];
+			for(int k = 0; k < ndf[x]; k++){
+				int y = df[x][k];
+				if(has_phi[y] == v){
+					continue;
+				}
+				add_phi(y, v);
+				has_phi[y] = v;
+				if(queued[y] != v){
+					queued[y] = v;
+					work[nwork++] = y;
+				}
+			}
+		}
+	}
+
+	cur_name = malloc(sizeof(int) * nv);
+	for(int v = 0; v < nv; v++){
+		cur_name[v] = -1;
+	}
+	undo_mark = malloc(sizeof(int) * nblocks);
+	walk_domtree(rename_enter, rename_leave);
+
+	for(int b = 0; b < nblocks; b++){
+		free(df[b]);
+	}
+	free(df);
+	free(ndf);
+	free(last_df);
+	free(global);
+	free(def_stamp);
+	free(ndefs);
+	free(uses);
+	free(start);
+	free(def_blocks);
+	free(has_phi);
+	free(queued);
+	free(work);
+	free(cur_name);
+	free(undo);
+	free(undo_mark);
+	cur_name = undo = undo_mark = NULL;
+	nundo = cap_undo = 0;
+}
+
+//
+// sccp: 疎な条件付き定数伝播
+//
+
+enum { TOP, CONST, BOTTOM };
+
+static _Thread_local char *lat; // 値ごとの束の要素
+static _Thread_local long *cval; // latがCONSTの値
+static _Thread_local char *edge_state; // ブロック*2+kの辺。1なら通ると分かり、2なら処理済み。
+static _Thread_local bool *block_done;
+static _Thread_local int *flow; // 通ると分かった辺 (ブロック*2+k)
+static _Thread_local int nflow;
+static _Thread_local int *ssa_work; // 束の要素が変わった値
+static _Thread_local int nssa;
+
+// 値を使う場所。idxが負ならphi (-1-idx番目)。
+typedef struct {
+	int block;
+	int idx;
+} Site;
+
+static _Thread_local Site *use_sites;
+static _Thread_local int *use_start;
+
+// 到達できるブロックの命令とphiについて、値ごとの使う場所を作る。
+// 1回目に数を数えて、値vの場所がuse_start[v]から並ぶようにする。
+static void build_uses(void){
+	int nv = irf->nvregs;
+	use_start = calloc(nv + 2, sizeof(int));
+	int **uses = malloc(sizeof(int *) * max_uses);
+	for(int pass = 0; pass < 2; pass++){
+		for(int i = 0; i < norder; i++){
+			Block *bl = &blocks[order[i]];
+			for(int k = 0; k < bl->nphis; k++){
+				for(int j = 0; j < bl->npreds; j++){
+					int v = bl->phis[k].args[j];
+					if(v < 0){
+						continue;
+					}
+					if(pass){
+						use_sites[use_start[v + 1]++] = (Site){order[i], -1 - k};
+					}
+					else{
+						use_start[v + 2]++;
+					}
+				}
+			}
+			for(int k = 0; k < bl->len; k++){
+				int nu = operands(&bl->code[k], uses);
+				for(int j = 0; j < nu; j++){
+					int v = *uses[j];
+					if(pass){
+						use_sites[use_start[v + 1]++] = (Site){order[i], k};
+					}
+					else{
+						use_start[v + 2]++;
+					}
+				}
+			}
+		}
+		if(!pass){
+			for(int v = 0; v < nv; v++){
+				use_start[v + 2] += use_start[v + 1];
+			}
+			use_sites = malloc(sizeof(Site) * (use_start[nv + 1] + 1));
+		}
+	}
+	free(uses);
+}
+
+static void set_lattice(int v, int l, long c){
+	if(lat[v] == BOTTOM || (lat[v] == l && (l != CONST || cval[v] == c))){
+		return;
+	}
+	if(lat[v] == CONST && l == CONST){
+		l = BOTTOM;
+	}
+	lat[v] = l;
+	cval[v] = c;
+	ssa_work[nssa++] = v;
+}
+
+// 2つの定数の演算。64ビットで回り込む。0での除算などは畳み込まない。
+static bool eval_binop(IrOp op, long a, long b, long *val){
+	unsigned long ua = a, ub = b;
+	switch(op){
+	case IR_ADD: *val = ua + ub; return true;
+	case IR_SUB: *val = ua - ub; return true;
+	case IR_MUL: *val = ua * ub; return true;
+	case IR_DIV:
+		if(b == 0 || (a == LONG_MIN && b == -1)){
+			return false;
+		}
+		*val = a / b;
+		return true;
+	case IR_EQ: *val = a == b; return true;
+	case IR_NE: *val = a != b; return true;
+	case IR_LT: *val = a < b; return true;
+	case IR_LE: *val = a <= b; return true;
+	default:
+		return false;
+	}
+}
+
+// a op b の束の要素
+static int eval_lattice(IrOp op, Ir *ir, long *val){
+	int la = lat[ir->a];
+	int lb = ir->bimm ? CONST : lat[ir->b];
+	long b = ir->bimm ? ir->imm : cval[ir->b];
+	if(la == BOTTOM || lb == BOTTOM){
+		return BOTTOM;
+	}
+	if(la == TOP || lb == TOP){
+		return TOP;
+	}
+	return eval_binop(op, cval[ir->a], b, val) ? CONST : BOTTOM;
+}
+
+static void mark_edge(int b, int k){
+	if(!edge_state[b * 2 + k]){
+		edge_state[b * 2 + k] = 1;
+		flow[nflow++] = b * 2 + k;
+	}
+}
+
+static void visit_phi(int b, Phi *phi){
+	Block *bl = &blocks[b];
+	int l = TOP;
+	long c = 0;
+	for(int j = 0; j < bl->npreds && l != BOTTOM; j++){
+		int p = bl->preds[j];
+		int k = blocks[p].succ[0] == b ? 0 : 1;
+		int v = phi->args[j];
+		if(edge_state[p * 2 + k] != 2 || (v >= 0 && lat[v] == TOP)){
+			continue;
+		}
+		if(v < 0 || lat[v] == BOTTOM || (l == CONST && c != cval[v])){
+			l = BOTTOM;
+		}
+		else{
+			l = CONST;
+			c = cval[v];
+		}
+	}
+	set_lattice(phi->dst, l, c);
+}
+
+static void visit_ir(int b, Ir *ir){
+	long val = 0;
+	switch(ir->op){
+	case IR_IMM:
+		set_lattice(ir->dst, CONST, ir->imm);
+		return;
+	case IR_MOV:
+		set_lattice(ir->dst, lat[ir->a], cval[ir->a]);
+		return;
+	case IR_ADD:
+	case IR_SUB:
+	case IR_MUL:
+	case IR_DIV:
+	case IR_EQ:
+	case IR_NE:
+	case IR_LT:
+	case IR_LE: {
+		int l = eval_lattice(ir->op, ir, &val);
+		set_lattice(ir->dst, l, val);
+		return;
+	}
+	case IR_JMP:
+		mark_edge(b, 0);
+		return;
+	case IR_BR: {
+		int l = eval_lattice(ir->cond, ir, &val);
+		if(l == BOTTOM || (l == CONST && val)){
+			mark_edge(b, 0);
+		}
+		if(l == BOTTOM || (l == CONST && !val)){
+			mark_edge(b, 1);
+		}
+		return;
+	}
+	default:
+		if(ir->dst >= 0){
+			set_lattice(ir->dst, BOTTOM, 0);
+		}
+	}
+}
+
+static bool fits_imm32(long val){
+	return val == (int)val;
+}
+
+// 定数になった値を使うオペランドを、入るところは即値にする
+static bool use_constants(Ir *ir){
+	if(!is_binop(ir->op) && ir->op != IR_BR){
+		return false;
+	}
+	if(!ir->bimm && is_commutative(ir->op) && lat[ir->a] == CONST && lat[ir->b] != CONST){
+		int t = ir->a;
+		ir->a = ir->b;
+		ir->b = t;
+	}
+	if(!ir->bimm && lat[ir->b] == CONST && fits_imm32(cval[ir->b])){
+		ir->imm = cval[ir->b];
+		ir->bimm = true;
+		ir->b = -1;
+		return true;
+	}
+	return false;
+}
+
+static bool sccp(void){
+	int nv = irf->nvregs;
+	lat = calloc(nv, 1);
+	cval = calloc(nv, sizeof(long));
+	edge_state = calloc(nblocks * 2, 1);
+	block_done = calloc(nblocks, sizeof(bool));
+	flow = malloc(sizeof(int) * (nblocks * 2 + 1));
+	ssa_work = malloc(sizeof(int) * (nv * 2 + 1));
+	nflow = nssa = 0;
+	build_uses();
+	if(undef >= 0){
+		lat[undef] = BOTTOM;
+	}
+
+	block_done[0] = true;
+	for(int i = 0; i < blocks[0].len; i++){
+		visit_ir(0, &blocks[0].code[i]);
+	}
+	while(nflow || nssa){
+		while(nflow){
+			int e = flow[--nflow];
+			if(edge_state[e] == 2){
+				continue;
+			}
+			edge_state[e] = 2;
+			int s = blocks[e / 2].succ[e % 2];
+			for(int i = 0; i < blocks[s].nphis; i++){
+				visit_phi(s, &blocks[s].phis[i]);
+			}
+			if(!block_done[s]){
+				block_done[s] = true;
+				for(int i = 0; i < blocks[s].len; i++){
+					visit_ir(s, &blocks[s].code[i]);
+				}
+			}
+		}
+		while(nssa){
+			int v = ssa_work[--nssa];
+			for(int k = use_start[v]; k < use_start[v + 1]; k++){
+				Site *site = &use_sites[k];
+				if(!block_done[site->block]){
+					continue;
+				}
+				if(site->idx < 0){
+					visit_phi(site->block, &blocks[site->block].phis[-1 - site->idx]);
+				}
+				else{
+					visit_ir(site->block, &blocks[site->block].code[site->idx]);
+				}
+			}
+		}
+	}
+
+	bool changed = false;
+	bool cfg_changed = false;
+	for(int i = 0; i < norder; i++){
+		int b = order[i];
+		Block *bl = &blocks[b];
+		if(!block_done[b]){
+			cfg_changed = true;
+			continue;
+		}
+
+		// 通らない分岐を消す
+		Ir *last = &bl->code[bl->len - 1];
+		if(last->op == IR_BR && !edge_state[b * 2] != !edge_state[b * 2 + 1]){
+			int k = edge_state[b * 2] ? 0 : 1;
+			int dead = bl->succ[1 - k];
+			remove_pred_at(dead, pred_index(dead, b));
+			last->op = IR_JMP;
+			last->a = last->b = -1;
+			last->bimm = false;
+			bl->succ[0] = bl->succ[k];
+			bl->nsucc = 1;
+			cfg_changed = true;
+		}
+
+		// 定数になったphiはブロックの先頭の即値にする
+		int n = 0;
+		for(int k = 0; k < bl->nphis; k++){
+			Phi *phi = &bl->phis[k];
+			if(lat[phi->dst] == CONST){
+				Ir ir = {.op = IR_IMM, .dst = phi->dst, .a = -1, .b = -1, .imm = cval[phi->dst]};
+				block_insert(b, 0, &ir);
+				free(phi->args);
+				changed = true;
+			}
+			else{
+				bl->phis[n++] = *phi;
+			}
+		}
+		bl->nphis = n;
+
+		for(int k = 0; k < bl->len; k++){
+			Ir *ir = &bl->code[k];
+			if(ir->dst >= 0 && ir->op != IR_IMM && lat[ir->dst] == CONST){
+				int dst = ir->dst;
+				kill_ir(ir);
+				ir->op = IR_IMM;
+				ir->dst = dst;
+				ir->imm = cval[dst];
+				changed = true;
+			}
+			else if(use_constants(ir)){
+				changed = true;
+			}
+		}
+	}
+
+	free(lat);
+	free(cval);
+	free(edge_state);
+	free(block_done);
+	free(flow);
+	free(ssa_work);
+	free(use_sites);
+	free(use_start);
+	lat = NULL;
+	cval = NULL;
+	edge_state = NULL;
+	block_done = NULL;
+	flow = ssa_work = use_start = NULL;
+	use_sites = NULL;
+
+	if(cfg_changed){
+		compute_dominators();
+	}
+	return changed || cfg_changed;
+}
+
+//
+// gvn: 値番号付け
+//
+
+typedef struct {
+	IrOp op;
+	int a;
+	int b;
+	bool bimm;
+	long imm;
+	int val; // -1なら空き
+} ValueKey;
+
+// ブロック内で分かっているメモリの中身。varがNULLならaddrの指す先。
+typedef struct {
+	LVar *var;
+	int addr;
+	int val;
+} MemEntry;
+
+#define MAX_MEM_ENTRIES 32
+
+static _Thread_local int *repl; // 値 -> 置き換える値
+static _Thread_local ValueKey *table;
+static _Thread_local int table_mask;
+static _Thread_local int *inserted; // 入れた順のtableの添字
+static _Thread_local int ninserted;
+static _Thread_local int *insert_mark;
+static _Thread_local bool gvn_changed;
+
+static int find(int v){
+	while(v >= 0 && repl[v] != v){
+		repl[v] = repl[repl[v]];
+		v = repl[v];
+	}
+	return v;
+}
+
+static unsigned hash_key(Ir *ir){
+	unsigned h = ir->op * 31u + ir->a;
+	h = h * 31u + (ir->bimm ? (unsigned)ir->imm : (unsigned)ir->b);
+	return h * 2654435761u;
+}
+
+// irと同じ計算の値を返す。なければirを入れて-1を返す。
+static int lookup_or_insert(Ir *ir){
+	for(unsigned i = hash_key(ir) & table_mask;; i = (i + 1) & table_mask){
+		ValueKey *k = &table[i];
+		if(k->val < 0){
+			*k = (ValueKey){ir->op, ir->a, ir->b, ir->bimm, ir->imm, ir->dst};
+			inserted[ninserted++] = i;
+			return -1;
+		}
+		if(k->op == ir->op && k->a == ir->a && k->bimm == ir->bimm && (ir->bimm ? k->imm == ir->imm : k->b == ir->b)){
+			return k->val;
+		}
+	}
+}
+
+static void replace_value(Ir *ir, int val){
+	repl[ir->dst] = val;
+	kill_ir(ir);
+	gvn_changed = true;
+}
+
+static int mem_lookup(MemEntry *mem, int n, LVar *var, int addr){
+	for(int i = n - 1; i >= 0; i--){
+		if(mem[i].var == var && (var || mem[i].addr == addr)){
+			return mem[i].val;
+		}
+	}
+	return -1;
+}
+
+static int mem_add(MemEntry *mem, int n, LVar *var, int addr, int val){
+	if(n == MAX_MEM_ENTRIES){
+		memmove(&mem[0], &mem[1], sizeof(MemEntry) * --n);
+	}
+	mem[n] = (MemEntry){var, addr, val};
+	return n + 1;
+}
+
+static void gvn_enter(int b){
+	Block *bl = &blocks[b];
+	insert_mark[b] = ninserted;
+
+	// 引数がみな同じ値 (自分自身を除く) のphiと、前のphiと同じphiを消す
+	int n = 0;
+	for(int k = 0; k < bl->nphis; k++){
+		Phi *phi = &bl->phis[k];
+		int same = -1;
+		bool trivial = true;
+		for(int j = 0; j < bl->npreds; j++){
+			int v = phi->args[j] = find(phi->args[j]);
+			if(v < 0 || v == phi->dst || v == same){
+				continue;
+			}
+			if(same >= 0){
+				trivial = false;
+			}
+			same = v;
+		}
+		int val = -1;
+		if(trivial){
+			val = same >= 0 ? same : undef;
+		}
+		for(int i = 0; i < n && val < 0; i++){
+			if(!memcmp(bl->phis[i].args, phi->args, sizeof(int) * bl->npreds)){
+				val = bl->phis[i].dst;
+			}
+		}
+		if(val >= 0){
+			repl[phi->dst] = val;
+			free(phi->args);
+			gvn_changed = true;
+		}
+		else{
+			bl->phis[n++] = *phi;
+		}
+	}
+	bl->nphis = n;
+
+	MemEntry mem[MAX_MEM_ENTRIES];
+	int nmem = 0;
+	int **uses = malloc(sizeof(int *) * max_uses);
+	for(int i = 0; i < bl->len; i++){
+		Ir *ir = &bl->code[i];
+		int nu = operands(ir, uses);
+		for(int j = 0; j < nu; j++){
+			*uses[j] = find(*uses[j]);
+		}
+
+		int v;
+		switch(ir->op){
+		case IR_MOV:
+			replace_value(ir, ir->a);
+			break;
+		case IR_ADD:
+		case IR_SUB:
+		case IR_MUL:
+		case IR_DIV:
+		case IR_EQ:
+		case IR_NE:
+		case IR_LT:
+		case IR_LE:
+			// x+0, x-0, x*1, x/1 はxのまま
+			if(ir->bimm && ((ir->imm == 0 && (ir->op == IR_ADD || ir->op == IR_SUB)) || (ir->imm == 1 && (ir->op == IR_MUL || ir->op == IR_DIV)))){
+				replace_value(ir, ir->a);
+				break;
+			}
+			if(!ir->bimm && is_commutative(ir->op) && ir->a > ir->b){
+				int t = ir->a;
+				ir->a = ir->b;
+				ir->b = t;
+			}
+			if((v = lookup_or_insert(ir)) >= 0){
+				replace_value(ir, v);
+			}
+			break;
+		case IR_LOADVAR:
+			if((v = mem_lookup(mem, nmem, ir->var, -1)) >= 0){
+				replace_value(ir, v);
+				break;
+			}
+			nmem = mem_add(mem, nmem, ir->var, -1, ir->dst);
+			break;
+		case IR_STOREVAR: {
+			// ポインタ経由の読み出しはこの変数を指すかもしれない
+			int m = 0;
+			for(int j = 0; j < nmem; j++){
+				if(mem[j].var && mem[j].var != ir->var){
+					mem[m++] = mem[j];
+				}
+			}
+			nmem = mem_add(mem, m, ir->var, -1, ir->a);
+			break;
+		}
+		case IR_LOAD:
+			if((v = mem_lookup(mem, nmem, NULL, ir->a)) >= 0){
+				replace_value(ir, v);
+				break;
+			}
+			nmem = mem_add(mem, nmem, NULL, ir->a, ir->dst);
+			break;
+		case IR_STORE:
+			nmem = mem_add(mem, 0, NULL, ir->a, ir->b);
+			break;
+		case IR_CALL:
+			nmem = 0;
+			break;
+		default:
+			break;
+		}
+	}
+	free(uses);
+	compact(b);
+}
+
+static void gvn_leave(int b){
+	while(ninserted > insert_mark[b]){
+		table[inserted[--ninserted]].val = -1;
+	}
+}
+
+static bool gvn(void){
+	// 引数がどれも値を持たないphiは、値を入れる前の変数の読み出しにする
+	undef_value();
+	int nv = irf->nvregs;
+	int ninsts = 0;
+	for(int i = 0; i < norder; i++){
+		ninsts += blocks[order[i]].len;
+	}
+	int size = 16;
+	while(size < ninsts * 2){
+		size *= 2;
+	}
+	table = malloc(sizeof(ValueKey) * size);
+	for(int i = 0; i < size; i++){
+		table[i].val = -1;
+	}
+	table_mask = size - 1;
+	inserted = malloc(sizeof(int) * (ninsts + 1));
+	ninserted = 0;
+	insert_mark = malloc(sizeof(int) * nblocks);
+	repl = malloc(sizeof(int) * nv);
+	for(int v = 0; v < nv; v++){
+		repl[v] = v;
+	}
+	gvn_changed = false;
+
+	walk_domtree(gvn_enter, gvn_leave);
+
+	// ループの戻り辺のように、置き換えより先に見た使用も直す
+	int **uses = malloc(sizeof(int *) * max_uses);
+	for(int i = 0; i < norder; i++){
+		Block *bl = &blocks[order[i]];
+		for(int k = 0; k < bl->nphis; k++){
+			for(int j = 0; j < bl->npreds; j++){
+				bl->phis[k].args[j] = find(bl->phis[k].args[j]);
+			}
+		}
+		for(int k = 0; k < bl->len; k++){
+			int nu = operands(&bl->code[k], uses);
+			for(int j = 0; j < nu; j++){
+				*uses[j] = find(*uses[j]);
+			}
+		}
+	}
+	free(uses);
+
+	free(table);
+	free(inserted);
+	free(insert_mark);
+	free(repl);
+	table = NULL;
+	inserted = insert_mark = repl = NULL;
+	return gvn_changed;
+}
+
+//
+// dce: 使われない値の計算を消す
+//
+
+// 値を使われなくても消せない命令
+static bool is_critical(Ir *ir){
+	switch(ir->op){
+	case IR_STORE:
+	case IR_STOREVAR:
+	case IR_CALL:
+	case IR_PARAM:
+	case IR_JMP:
+	case IR_BR:
+	case IR_RET:
+		return true;
+	case IR_DIV:
+		// 0や-1で割ると落ちうる
+		return !ir->bimm || ir->imm == 0 || ir->imm == -1;
+	default:
+		return false;
+	}
+}
+
+static bool dce(void){
+	int nv = irf->nvregs;
+	bool *live = calloc(nv, sizeof(bool));
+	Site *def = malloc(sizeof(Site) * nv);
+	for(int v = 0; v < nv; v++){
+		def[v].block = -1;
+	}
+	int *work = malloc(sizeof(int) * (nv + 1));
+	int nwork = 0;
+	int **uses = malloc(sizeof(int *) * max_uses);
+
+	for(int i = 0; i < norder; i++){
+		Block *bl = &blocks[order[i]];
+		for(int k = 0; k < bl->nphis; k++){
+			def[bl->phis[k].dst] = (Site){order[i], -1 - k};
+		}
+		for(int k = 0; k < bl->len; k++){
+			Ir *ir = &bl->code[k];
+			if(ir->dst >= 0){
+				def[ir->dst] = (Site){order[i], k};
+			}
+			if(!is_critical(ir)){
+				continue;
+			}
+			int nu = operands(ir, uses);
+			for(int j = 0; j < nu; j++){
+				if(!live[*uses[j]]){
+					live[*uses[j]] = true;
+					work[nwork++] = *uses[j];
+				}
+			}
+		}
+	}
+	while(nwork){
+		int v = work[--nwork];
+		Site *site = &def[v];
+		if(site->block < 0){
+			continue;
+		}
+		Block *bl = &blocks[site->block];
+		if(site->idx < 0){
+			Phi *phi = &bl->phis[-1 - site->idx];
+			for(int j = 0; j < bl->npreds; j++){
+				int a = phi->args[j];
+				if(a >= 0 && !live[a]){
+					live[a] = true;
+					work[nwork++] = a;
+				}
+			}
+			continue;
+		}
+		int nu = operands(&bl->code[site->idx], uses);
+		for(int j = 0; j < nu; j++){
+			if(!live[*uses[j]]){
+				live[*uses[j]] = true;
+				work[nwork++] = *uses[j];
+			}
+		}
+	}
+
+	bool changed = false;
+	for(int i = 0; i < norder; i++){
+		Block *bl = &blocks[order[i]];
+		int n = 0;
+		for(int k = 0; k < bl->nphis; k++){
+			if(live[bl->phis[k].dst]){
+				bl->phis[n++] = bl->phis[k];
+			}
+			else{
+				free(bl->phis[k].args);
+				changed = true;
+			}
+		}
+		bl->nphis = n;
+		for(int k = 0; k < bl->len; k++){
+			Ir *ir = &bl->code[k];
+			if(ir->dst >= 0 && !live[ir->dst] && !is_critical(ir)){
+				kill_ir(ir);
+				changed = true;
+			}
+		}
+		compact(order[i]);
+	}
+
+	free(live);
+	free(def);
+	free(work);
+	free(uses);
+	return changed;
+}
+
+//
+// dse: メモリの変数への無駄な書き込みを消す
+//
+
+static bool dse(void){
+	int var_base = ast.nvars;
+	for(LVar *var = cur_fn->locals; var; var = var->next){
+		var_base = var->id;
+	}
+	int nv = ast.nvars - var_base + 1;
+	int *nreads = calloc(nv, sizeof(int)); // IR_LOADVARとIR_ADDRの数
+	bool *dead = calloc(nv, sizeof(bool));
+
+	for(int i = 0; i < norder; i++){
+		Block *bl = &blocks[order[i]];
+		for(int k = 0; k < bl->len; k++){
+			Ir *ir = &bl->code[k];
+			if(ir->op == IR_LOADVAR || ir->op == IR_ADDR){
+				nreads[ir->var->id - var_base]++;
+			}
+		}
+	}
+
+	// ブロックを後ろから見て、次に読まれる前に上書きされるか関数を抜ける書き込みを消す。
+	// ポインタ経由の読み出しと呼び出しはどの変数も読みうる。
+	bool changed = false;
+	for(int i = 0; i < norder; i++){
+		Block *bl = &blocks[order[i]];
+		bool ret = bl->code[bl->len - 1].op == IR_RET;
+		for(int v = 0; v < nv; v++){
+			dead[v] = ret;
+		}
+		for(int k = bl->len - 1; k >= 0; k--){
+			Ir *ir = &bl->code[k];
+			switch(ir->op){
+			case IR_STOREVAR: {
+				int v = ir->var->id - var_base;
+				if(dead[v] || !nreads[v]){
+					kill_ir(ir);
+					changed = true;
+				}
+				dead[v] = true;
+				break;
+			}
+			case IR_LOADVAR:
+				dead[ir->var->id - var_base] = false;
+				break;
+			case IR_LOAD:
+			case IR_CALL:
+				memset(dead, 0, sizeof(bool) * nv);
+				break;
+			default:
+				break;
+			}
+		}
+		compact(order[i]);
+	}
+
+	free(nreads);
+	free(dead);
+	return changed;
+}
+
+//
+// licm: ループ不変式の移動と誘導変数の強さの軽減
+//
+
+// ループの中で分かった誘導変数。phiの値は1周ごとにstepずつ増える。
+typedef struct {
+	int val; // ループの中でこの誘導変数を表す値 (phiかそのコピー)
+	int phi;
+	int init; // プリヘッダから入る値
+	long step;
+	int next; // 戻り辺から入る値
+	bool reduced; // ここで作ったもの
+	bool shifted; // phiを持たず、誘導変数に定数を足したもの (a[i+1]の添字など)
+	Ir how; // 作ったときの計算 (aは元のphi、bは operand_key)。shiftedならinitの計算。
+} IndVar;
+
+static _Thread_local int *def_at; // 値 -> 定義するブロック (-1なら不明)
+static _Thread_local int cap_def;
+static _Thread_local char *in_loop; // 今見ているループのブロック
+
+static void set_def(int v, int b){
+	if(v >= cap_def){
+		int n = cap_def;
+		cap_def = v * 2 + 16;
+		def_at = realloc(def_at, sizeof(int) * cap_def);
+		for(; n < cap_def; n++){
+			def_at[n] = -1;
+		}
+	}
+	def_at[v] = b;
+}
+
+static bool loop_defines(int v){
+	return v >= 0 && v < cap_def && def_at[v] >= 0 && in_loop[def_at[v]];
+}
+
+static bool dominates(int a, int b){
+	while(b != a && b != 0){
+		b = blocks[b].idom;
+	}
+	return b == a;
+}
+
+// hを先頭とする自然なループのブロックをin_loopに印し、外から入る唯一の
+// 先行ブロックを返す。外からの入口が1つでなければ-1。
+static int mark_loop(int h){
+	int *stack = malloc(sizeof(int) * (nblocks + 1));
+	int sp = 0;
+	int outside = -1;
+	in_loop[h] = 1;
+	for(int j = 0; j < blocks[h].npreds; j++){
+		int p = blocks[h].preds[j];
+		if(!dominates(h, p)){
+			outside = outside < 0 ? p : -2;
+			continue;
+		}
+		if(!in_loop[p]){
+			in_loop[p] = 1;
+			stack[sp++] = p;
+		}
+	}
+	while(sp){
+		int b = stack[--sp];
+		for(int j = 0; j < blocks[b].npreds; j++){
+			int p = blocks[b].preds[j];
+			if(!in_loop[p]){
+				in_loop[p] = 1;
+				stack[sp++] = p;
+			}
+		}
+	}
+	free(stack);
+	return outside >= 0 ? outside : -1;
+}
+
+// 外からの入口oとhの間に、ループに入る前に1度だけ通るブロックを用意する
+static int preheader(int h, int o){
+	if(blocks[o].nsucc == 1){
+		return o;
+	}
+	int e = new_block();
+	blocks[e].live = true;
+	blocks[e].split = true;
+	jump_to(e, h);
+	add_pred(e, o);
+	blocks[o].succ[blocks[o].succ[0] == h ? 0 : 1] = e;
+	blocks[h].preds[pred_index(h, o)] = e;
+	return e;
+}
+
+static bool stores_var(int *body, int nbody, LVar *var){
+	for(int i = 0; i < nbody; i++){
+		Block *bl = &blocks[body[i]];
+		for(int k = 0; k < bl->len; k++){
+			if(bl->code[k].op == IR_STOREVAR && bl->code[k].var == var){
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// 定数と変数のアドレスは、ループの外に置いてレジスタを使い続けるより
+// 使う場所で作り直すほうが安い
+static bool is_cheap(Ir *ir){
+	return ir->op == IR_IMM || ir->op == IR_ADDR;
+}
+
+// ループの中で毎回同じ値になる計算をプリヘッダへ移す。定数とアドレスは
+// 移す計算が使うものだけ移す。ループが0回でも実行されるので、落ちうるものは移さない。
+static bool hoist_invariants(int *body, int nbody, int pre){
+	bool writes_memory = false;
+	for(int i = 0; i < nbody; i++){
+		Block *bl = &blocks[body[i]];
+		for(int k = 0; k < bl->len; k++){
+			IrOp op = bl->code[k].op;
+			writes_memory |= op == IR_STORE || op == IR_CALL;
+		}
+	}
+
+	int nv = irf->nvregs;
+	bool *inv = calloc(nv, sizeof(bool));
+	bool *need = calloc(nv, sizeof(bool));
+	int **uses = malloc(sizeof(int *) * max_uses);
+	for(int i = 0; i < nbody; i++){
+		Block *bl = &blocks[body[i]];
+		for(int k = 0; k < bl->len; k++){
+			Ir *ir = &bl->code[k];
+			if(ir->dst < 0 || is_critical(ir)){
+				continue;
+			}
+			switch(ir->op){
+			case IR_LOADVAR:
+				if(writes_memory || stores_var(body, nbody, ir->var)){
+					continue;
+				}
+				break;
+			case IR_LOAD:
+			case IR_PARAM:
+				continue;
+			default:
+				break;
+			}
+			int nu = operands(ir, uses);
+			bool ok = true;
+			for(int j = 0; j < nu && ok; j++){
+				ok = !loop_defines(*uses[j]) || inv[*uses[j]];
+			}
+			inv[ir->dst] = ok;
+		}
+	}
+
+	// 使う側から見て、移すものを決める
+	for(int i = nbody - 1; i >= 0; i--){
+		Block *bl = &blocks[body[i]];
+		for(int k = bl->len - 1; k >= 0; k--){
+			Ir *ir = &bl->code[k];
+			if(ir->dst < 0 || !inv[ir->dst] || (is_cheap(ir) && !need[ir->dst])){
+				continue;
+			}
+			need[ir->dst] = true;
+			int nu = operands(ir, uses);
+			for(int j = 0; j < nu; j++){
+				need[*uses[j]] = true;
+			}
+		}
+	}
+
+	bool changed = false;
+	for(int i = 0; i < nbody; i++){
+		Block *bl = &blocks[body[i]];
+		for(int k = 0; k < bl->len; k++){
+			Ir *ir = &bl->code[k];
+			if(ir->dst < 0 || !inv[ir->dst] || !need[ir->dst]){
+				continue;
+			}
+			block_insert(pre, blocks[pre].len - 1, ir);
+			set_def(ir->dst, pre);
+			bl = &blocks[body[i]];
+			ir = &bl->code[k];
+			ir->op = IR_NOP;
+			ir->dst = ir->a = ir->b = -1;
+			changed = true;
+		}
+		compact(body[i]);
+	}
+	free(inv);
+	free(need);
+	free(uses);
+	return changed;
+}
+
+// プリヘッダでのivの初期値。shiftedなら初めて使うときに計算する。
+static int iv_init(IndVar *iv, int pre){
+	if(iv->init < 0){
+		Ir ir = iv->how;
+		ir.dst = new_value();
+		block_insert(pre, blocks[pre].len - 1, &ir);
+		set_def(ir.dst, pre);
+		iv->init = ir.dst;
+	}
+	return iv->init;
+}
+
+static bool is_iv_next(IndVar *ivs, int n, int v){
+	for(int i = 0; i < n; i++){
+		if(ivs[i].next == v){
+			return true;
+		}
+	}
+	return false;
+}
+
+// vを定義する命令 (phiならNULL)
+static Ir *def_ir(int v){
+	Block *bl = &blocks[def_at[v]];
+	for(int i = 0; i < bl->len; i++){
+		if(bl->code[i].dst == v){
+			return &bl->code[i];
+		}
+	}
+	return NULL;
+}
+
+// vがループの外の値か、プリヘッダで作り直せる値か
+static bool available_before(int v){
+	if(!loop_defines(v)){
+		return true;
+	}
+	Ir *ir = def_ir(v);
+	return ir && is_cheap(ir);
+}
+
+// プリヘッダで使えるvの値
+static int value_before(int v, int pre){
+	if(!loop_defines(v)){
+		return v;
+	}
+	Ir ir = *def_ir(v);
+	ir.dst = new_value();
+	block_insert(pre, blocks[pre].len - 1, &ir);
+	set_def(ir.dst, pre);
+	return ir.dst;
+}
+
+// 同じ変数のアドレスは同じものとして比べるためのキー
+static int operand_key(int v){
+	Ir *ir = loop_defines(v) ? def_ir(v) : NULL;
+	return ir && ir->op == IR_ADDR ? -2 - ir->var->id : v;
+}
+
+static IndVar *find_reduced(IndVar *ivs, int n, Ir *how){
+	for(int i = 0; i < n; i++){
+		Ir *h = &ivs[i].how;
+		if(ivs[i].reduced && h->op == how->op && h->a == how->a && h->bimm == how->bimm && h->b == how->b && h->imm == how->imm){
+			return &ivs[i];
+		}
+	}
+	return NULL;
+}
+
+static IndVar *find_iv(IndVar *ivs, int n, int v){
+	for(int i = 0; i < n; i++){
+		if(ivs[i].val == v){
+			return &ivs[i];
+		}
+	}
+	return NULL;
+}
+
+// 誘導変数iから i*c, p+i (iがここで作ったもの) を計算する命令を、
+// 戻り辺の直前で足していく新しいphiで置き換える。a[i]のアドレスはポインタの増分になる。
+static bool reduce_ivs(int h, int *body, int nbody, int pre){
+	Block *hb = &blocks[h];
+	if(hb->npreds != 2){
+		return false;
+	}
+	int jpre = pred_index(h, pre);
+	int jlatch = 1 - jpre;
+	int latch = hb->preds[jlatch];
+
+	int cap = hb->nphis * 2 + 8;
+	IndVar *ivs = malloc(sizeof(IndVar) * cap);
+	int nivs = 0;
+	for(int k = 0; k < hb->nphis; k++){
+		Phi *phi = &hb->phis[k];
+		int next = phi->args[jlatch];
+		if(phi->args[jpre] < 0 || !loop_defines(next)){
+			continue;
+		}
+		Block *bl = &blocks[def_at[next]];
+		for(int i = 0; i < bl->len; i++){
+			Ir *ir = &bl->code[i];
+			if(ir->dst != next){
+				continue;
+			}
+			if((ir->op == IR_ADD || ir->op == IR_SUB) && ir->bimm && ir->a == phi->dst){
+				long step = ir->op == IR_ADD ? ir->imm : -ir->imm;
+				ivs[nivs++] = (IndVar){phi->dst, phi->dst, phi->args[jpre], step, next};
+				// 増やした値は、同じ周の中ではphi+stepを表す
+				Ir how = {.op = IR_ADD, .a = phi->args[jpre], .b = -1, .bimm = true, .imm = step};
+				ivs[nivs++] = (IndVar){next, next, -1, step, -1, false, true, how};
+			}
+			break;
+		}
+	}
+	if(!nivs){
+		free(ivs);
+		return false;
+	}
+
+	bool changed = false;
+	for(int i = 0; i < nbody; i++){
+		for(int k = 0; k < blocks[body[i]].len; k++){
+			Ir *ir = &blocks[body[i]].code[k];
+			IndVar *iv = NULL;
+			int other = -1;
+			long step = 0;
+			if(ir->dst < 0 || is_iv_next(ivs, nivs, ir->dst)){
+				continue;
+			}
+			if(ir->op == IR_MUL && ir->bimm && (iv = find_iv(ivs, nivs, ir->a))){
+				step = iv->step * ir->imm;
+			}
+			else if(ir->op == IR_ADD && !ir->bimm){
+				iv = find_iv(ivs, nivs, ir->a);
+				other = ir->b;
+				if(!iv){
+					iv = find_iv(ivs, nivs, ir->b);
+					other = ir->a;
+				}
+				if(!iv || !iv->reduced || !available_before(other)){
+					continue;
+				}
+				step = iv->step;
+			}
+			else if(ir->op == IR_ADD || ir->op == IR_SUB){
+				iv = find_iv(ivs, nivs, ir->a);
+				if(iv && !iv->reduced && !iv->shifted && ir->bimm){
+					IndVar shifted = {ir->dst, ir->dst, -1, iv->step, -1, false, true};
+					shifted.how = (Ir){.op = ir->op, .a = iv->init, .b = -1, .bimm = true, .imm = ir->imm};
+					if(nivs == cap){
+						cap *= 2;
+						ivs = realloc(ivs, sizeof(IndVar) * cap);
+					}
+					ivs[nivs++] = shifted;
+					continue;
+				}
+				if(!iv || !iv->reduced || (!ir->bimm && !available_before(ir->b))){
+					continue;
+				}
+				step = iv->step;
+			}
+			if(!iv || !fits_imm32(step)){
+				continue;
+			}
+
+			// a[i]を何度も読み書きするときのように、同じものがあればそれを使う
+			Ir how = {.op = ir->op, .a = iv->phi, .b = -1, .bimm = ir->bimm, .imm = ir->bimm ? ir->imm : 0};
+			if(!ir->bimm){
+				how.b = operand_key(other >= 0 ? other : ir->b);
+			}
+			IndVar *same = find_reduced(ivs, nivs, &how);
+			int phi_dst, init_dst, next;
+			if(same){
+				phi_dst = same->phi;
+				init_dst = same->init;
+				next = same->next;
+			}
+			else{
+				// プリヘッダで初期値を計算する
+				Ir init = *ir;
+				init.dst = new_value();
+				init.a = iv_init(iv, pre);
+				if(other >= 0){
+					init.b = value_before(other, pre);
+				}
+				else if(!ir->bimm){
+					init.b = value_before(ir->b, pre);
+				}
+				block_insert(pre, blocks[pre].len - 1, &init);
+				set_def(init.dst, pre);
+
+				add_phi(h, -1);
+				Phi *phi = &blocks[h].phis[blocks[h].nphis - 1];
+				phi_dst = phi->dst = new_value();
+				init_dst = phi->args[jpre] = init.dst;
+				next = phi->args[jlatch] = new_value();
+				set_def(phi_dst, h);
+
+				Ir inc = {.op = IR_ADD, .dst = next, .a = phi_dst, .b = -1, .bimm = true, .imm = step};
+				block_insert(latch, blocks[latch].len - 1, &inc);
+				set_def(next, latch);
+			}
+
+			ir = &blocks[body[i]].code[k];
+			ir->op = IR_MOV;
+			ir->a = phi_dst;
+			ir->b = -1;
+			ir->bimm = false;
+
+			// 置き換えた値も、このループの中では同じ誘導変数として扱う
+			if(nivs + 2 > cap){
+				cap *= 2;
+				ivs = realloc(ivs, sizeof(IndVar) * cap);
+			}
+			ivs[nivs++] = (IndVar){phi_dst, phi_dst, init_dst, step, next, true, false, how};
+			ivs[nivs++] = (IndVar){ir->dst, phi_dst, init_dst, step, next, true, false, how};
+			changed = true;
+		}
+	}
+	free(ivs);
+	return changed;
+}
+
+static bool licm(void){
+	for(int i = 0; i < norder; i++){
+		Block *bl = &blocks[order[i]];
+		for(int k = 0; k < bl->nphis; k++){
+			set_def(bl->phis[k].dst, order[i]);
+		}
+		for(int k = 0; k < bl->len; k++){
+			if(bl->code[k].dst >= 0){
+				set_def(bl->code[k].dst, order[i]);
+			}
+		}
+	}
+
+	// 内側のループから (先頭が逆後順で後ろのものから) 見る
+	int *headers = malloc(sizeof(int) * (norder + 1));
+	int nheaders = 0;
+	for(int i = norder - 1; i >= 0; i--){
+		int b = order[i];
+		for(int j = 0; j < blocks[b].npreds; j++){
+			if(dominates(b, blocks[b].preds[j])){
+				headers[nheaders++] = b;
+				break;
+			}
+		}
+	}
+
+	bool changed = false;
+	for(int i = 0; i < nheaders; i++){
+		int h = headers[i];
+		if(!blocks[h].live){
+			continue;
+		}
+		in_loop = calloc(nblocks + 1, 1);
+		int o = mark_loop(h);
+		if(o < 0){
+			free(in_loop);
+			continue;
+		}
+		int n = nblocks;
+		int pre = preheader(h, o);
+
+		int *body = malloc(sizeof(int) * (norder + 1));
+		int nbody = 0;
+		for(int k = 0; k < norder; k++){
+			if(in_loop[order[k]]){
+				body[nbody++] = order[k];
+			}
+		}
+		bool hoisted = hoist_invariants(body, nbody, pre);
+		bool reduced = reduce_ivs(h, body, nbody, pre);
+		changed |= hoisted || reduced;
+		free(body);
+		free(in_loop);
+		in_loop = NULL;
+		if(nblocks != n){
+			compute_dominators();
+			changed = true;
+		}
+	}
+
+	free(headers);
+	free(def_at);
+	def_at = NULL;
+	cap_def = 0;
+	return changed;
+}
+
+//
+// パスの管理
+//
+
+typedef struct {
+	char *name;
+	bool (*run)(void);
+} Pass;
+
+static Pass passes[] = {
+	{"sccp", sccp},
+	{"gvn", gvn},
+	{"licm", licm},
+	{"dce", dce},
+	{"dse", dse},
+};
+
+static void run_passes(void){
+	for(int round = 0; round < MAX_ROUNDS; round++){
+		bool changed = false;
+		for(int i = 0; i < sizeof(passes) / sizeof(passes[0]); i++){
+			changed |= passes[i].run();
+		}
+		if(!changed){
+			return;
+		}
+	}
+}
+
+//
+// SSA形式から戻す
+//
+
+// 後続が2つあるブロックから、phiを持つブロックへの辺にブロックを挟む
+static void split_critical_edges(void){
+	int n = nblocks;
+	for(int s = 0; s < n; s++){
+		if(!blocks[s].live || !blocks[s].nphis){
+			continue;
+		}
+		for(int j = 0; j < blocks[s].npreds; j++){
+			int p = blocks[s].preds[j];
+			if(blocks[p].nsucc < 2){
+				continue;
+			}
+			int e = new_block();
+			blocks[e].live = true;
+			blocks[e].split = true;
+			jump_to(e, s);
+			add_pred(e, p);
+			blocks[p].succ[blocks[p].succ[0] == s ? 0 : 1] = e;
+			blocks[s].preds[j] = e;
+		}
+	}
+}
+
+// phiの引数を、先行ブロックの最後のジャンプの前で並行にコピーする
+static void insert_copies(int s){
+	Block *bl = &blocks[s];
+	int *dst = malloc(sizeof(int) * (bl->nphis + 1));
+	int *src = malloc(sizeof(int) * (bl->nphis + 1));
+	for(int j = 0; j < bl->npreds; j++){
+		int p = bl->preds[j];
+		int n = 0;
+		for(int k = 0; k < bl->nphis; k++){
+			int a = bl->phis[k].args[j];
+			if(a >= 0 && a != bl->phis[k].dst){
+				dst[n] = bl->phis[k].dst;
+				src[n] = a;
+				n++;
+			}
+		}
+
+		// ほかのコピーが読む値に書かないものから順に出す。循環していたら1つを退避する。
+		while(n){
+			int i = 0;
+			for(; i < n; i++){
+				bool read = false;
+				for(int k = 0; k < n && !read; k++){
+					read = k != i && src[k] == dst[i];
+				}
+				if(!read){
+					break;
+				}
+			}
+			Ir ir = {.op = IR_MOV, .a = -1, .b = -1};
+			if(i == n){
+				i = 0;
+				int t = new_value();
+				ir.dst = t;
+				ir.a = dst[i];
+				block_insert(p, blocks[p].len - 1, &ir);
+				for(int k = 0; k < n; k++){
+					if(src[k] == dst[i]){
+						src[k] = t;
+					}
+				}
+			}
+			ir.dst = dst[i];
+			ir.a = src[i];
+			block_insert(p, blocks[p].len - 1, &ir);
+			dst[i] = dst[n - 1];
+			src[i] = src[n - 1];
+			n--;
+		}
+	}
+	free(dst);
+	free(src);
+}
+
+// d = s のコピーで、sがブロック内で定義されてこのコピーでしか使われず、
+// 定義からコピーまでにdを読み書きしなければ、sの定義で直接dに書く
+static void coalesce_copies(void){
+	int nv = irf->nvregs;
+	int *nuses = calloc(nv, sizeof(int));
+	int **uses = malloc(sizeof(int *) * max_uses);
+	for(int b = 0; b < nblocks; b++){
+		if(!blocks[b].live){
+			continue;
+		}
+		for(int k = 0; k < blocks[b].len; k++){
+			int nu = operands(&blocks[b].code[k], uses);
+			for(int j = 0; j < nu; j++){
+				nuses[*uses[j]]++;
+			}
+		}
+	}
+
+	for(int b = 0; b < nblocks; b++){
+		Block *bl = &blocks[b];
+		if(!bl->live){
+			continue;
+		}
+		for(int c = 0; c < bl->len; c++){
+			Ir *copy = &bl->code[c];
+			if(copy->op != IR_MOV || nuses[copy->a] != 1){
+				continue;
+			}
+			int d = copy->dst, s = copy->a;
+			int k = c - 1;
+			for(; k >= 0 && bl->code[k].dst != s; k--){
+				Ir *ir = &bl->code[k];
+				int nu = operands(ir, uses);
+				bool touch = ir->dst == d;
+				for(int j = 0; j < nu && !touch; j++){
+					touch = *uses[j] == d;
+				}
+				if(touch){
+					break;
+				}
+			}
+			if(k < 0 || bl->code[k].dst != s){
+				continue;
+			}
+			bl->code[k].dst = d;
+			kill_ir(copy);
+		}
+		compact(b);
+	}
+	free(nuses);
+	free(uses);
+}
+
+static int block_label(int b){
+	if(blocks[b].label < 0){
+		blocks[b].label = label_id(L_BEGIN, new_label());
+	}
+	return blocks[b].label;
+}
+
+static void emit_ir(Ir *ir){
+	if(irf->len == irf->cap){
+		irf->cap = irf->cap ? irf->cap * 2 : 16;
+		irf->code = realloc(irf->code, sizeof(Ir) * irf->cap);
+	}
+	irf->code[irf->len++] = *ir;
+}
+
+// ブロックを元の順に並べて命令列に戻す。挟んだブロックは行き先の直前に置く。
+static void linearize(void){
+	int *layout = malloc(sizeof(int) * nblocks);
+	bool *target = calloc(nblocks + 1, sizeof(bool));
+	int n = 0;
+	for(int b = 0; b < nblocks; b++){
+		if(!blocks[b].live || blocks[b].split){
+			continue;
+		}
+		for(int e = 0; e < blocks[b].npreds; e++){
+			int p = blocks[b].preds[e];
+			if(blocks[p].split){
+				layout[n++] = p;
+			}
+		}
+		layout[n++] = b;
+	}
+
+	// どこかから飛んでくるブロックにはラベルを付ける
+	for(int i = 0; i < n; i++){
+		Block *bl = &blocks[layout[i]];
+		int next = i + 1 < n ? layout[i + 1] : -1;
+		if(bl->nsucc == 2){
+			target[bl->succ[1]] = true;
+			target[bl->succ[0]] |= bl->succ[0] != next;
+		}
+		else if(bl->nsucc == 1 && bl->succ[0] != next){
+			target[bl->succ[0]] = true;
+		}
+	}
+
+	irf->len = 0;
+	for(int i = 0; i < n; i++){
+		int b = layout[i];
+		Block *bl = &blocks[b];
+		int next = i + 1 < n ? layout[i + 1] : -1;
+		if(target[b]){
+			Ir ir = {.op = IR_LABEL, .dst = -1, .a = -1, .b = -1, .label = block_label(b)};
+			emit_ir(&ir);
+		}
+		for(int k = 0; k < bl->len - 1; k++){
+			emit_ir(&bl->code[k]);
+		}
+		Ir *last = &bl->code[bl->len - 1];
+		if(last->op == IR_RET){
+			emit_ir(last);
+			continue;
+		}
+		if(last->op == IR_BR){
+			last->label = block_label(bl->succ[1]);
+			emit_ir(last);
+		}
+		if(bl->succ[0] != next){
+			Ir ir = {.op = IR_JMP, .dst = -1, .a = -1, .b = -1, .label = block_label(bl->succ[0])};
+			emit_ir(&ir);
+		}
+	}
+
+	// 落ちてこないブロックの呼び出しの引数は、命令列に戻らないので解放する
+	for(int b = 0; b < nblocks; b++){
+		if(!blocks[b].live){
+			for(int k = 0; k < blocks[b].len; k++){
+				free(blocks[b].code[k].args);
+			}
+		}
+	}
+	free(layout);
+	free(target);
+}
+
+// ブロックをまたぐ値と何度も代入される値を0..nvars-1に、それ以外を後ろに並べ直す
+static void renumber(void){
+	int nv = irf->nvregs;
+	int *def_block = malloc(sizeof(int) * nv);
+	bool *global = calloc(nv, sizeof(bool));
+	int *map = malloc(sizeof(int) * nv);
+	for(int v = 0; v < nv; v++){
+		def_block[v] = -1;
+		map[v] = -1;
+	}
+
+	int **uses = malloc(sizeof(int *) * max_uses);
+	int block = 0;
+	for(int i = 0; i < irf->len; i++){
+		Ir *ir = &irf->code[i];
+		if(i > 0 && (ir->op == IR_LABEL || ends_block(irf->code[i - 1].op))){
+			block++;
+		}
+		int nu = operands(ir, uses);
+		for(int j = 0; j < nu; j++){
+			if(def_block[*uses[j]] != block){
+				global[*uses[j]] = true;
+			}
+		}
+		if(ir->dst >= 0){
+			if(def_block[ir->dst] >= 0){
+				global[ir->dst] = true;
+			}
+			def_block[ir->dst] = block;
+		}
+	}
+
+	int n = 0;
+	for(int pass = 0; pass < 2; pass++){
+		for(int i = 0; i < irf->len; i++){
+			Ir *ir = &irf->code[i];
+			int nu = operands(ir, uses);
+			int *vals[nu + 1];
+			memcpy(vals, uses, sizeof(int *) * nu);
+			if(ir->dst >= 0){
+				vals[nu++] = &ir->dst;
+			}
+			for(int j = 0; j < nu; j++){
+				int v = *vals[j];
+				if(map[v] < 0 && global[v] == !pass){
+					map[v] = n++;
+				}
+			}
+		}
+		if(!pass){
+			irf->nvars = n;
+		}
+	}
+	for(int i = 0; i < irf->len; i++){
+		Ir *ir = &irf->code[i];
+		int nu = operands(ir, uses);
+		for(int j = 0; j < nu; j++){
+			*uses[j] = map[*uses[j]];
+		}
+		if(ir->dst >= 0){
+			ir->dst = map[ir->dst];
+		}
+	}
+	irf->nvregs = n;
+
+	free(def_block);
+	free(global);
+	free(map);
+	free(uses);
+}
+
+// lower_functionで作ったfnの中間表現をSSA形式で最適化する
+void optimize_ir(Function *fn, IrFunc *f){
+	phase_push(PH_SSA);
+	irf = f;
+	cur_fn = fn;
+	undef = -1;
+	max_uses = 2;
+	for(int i = 0; i < f->len; i++){
+		if(f->code[i].nargs + 2 > max_uses){
+			max_uses = f->code[i].nargs + 2;
+		}
+	}
+
+	build_cfg();
+	compute_dominators();
+	build_ssa();
+	run_passes();
+
+	split_critical_edges();
+	for(int b = 0; b < nblocks; b++){
+		if(blocks[b].live && blocks[b].nphis){
+			insert_copies(b);
+		}
+	}
+	coalesce_copies();
+	linearize();
+	renumber();
+
+	for(int b = 0; b < nblocks; b++){
+		free(blocks[b].code);
+		for(int k = 0; k < blocks[b].nphis; k++){
+			free(blocks[b].phis[k].args);
+		}
+		free(blocks[b].phis);
+		free(blocks[b].preds);
+	}
+	free(blocks);
+	free(order);
+	blocks = NULL;
+	order = NULL;
+	nblocks = cap_blocks = norder = 0;
+	irf = NULL;
+	cur_fn = NULL;
+	phase_pop();
+}
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "9cc.h"
+
+// コンパイラの統計情報
+Stats stats;
+
+static char *phase_name[] = {
+	[PH_TOKENIZE] = "tokenize",
+	[PH_PARSE] = "parse",
+	[PH_TYPE] = "type",
+	[PH_FOLD] = "fold",
+	[PH_SSA] = "ssa",
+	[PH_FRAME] = "frame",
+	[PH_CODEGEN] = "codegen",
+	[PH_OUTPUT] = "output",
+	[PH_RUN] = "run",
+	[PH_FREE] = "free",
+};
+
+// フェーズごとに集計した値
+typedef struct {
+	double wall; // 経過時間 (秒)
+	double cpu; // CPU時間 (秒)。全スレッドの合計。
+	long ntokens;
+	long nnodes;
+	long nalloc; // アリーナ・構文木・出力バッファの確保回数
+	long bytes; // 確保したバイト数
+	long peak_rss; // フェーズ終了時点の最大RSS (KB)
+	bool used;
+} PhaseStat;
+
+// カウンタのスナップショット
+typedef struct {
+	double wall;
+	double cpu;
+	long ntokens;
+	long nnodes;
+	long nalloc;
+	long bytes;
+} Sample;
+
+static PhaseStat phase_stats[NUM_PHASES];
+static Phase phase_stack[16];
+static int phase_depth;
+static Sample last; // 直前のフェーズ切り替え時点の値
+
+static double clock_sec(clockid_t id){
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 単調増加の時計 (ns)
+long clock_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static Sample sample(void){
+	Arena *arenas[] = { &token_arena, &node_arena, &type_arena };
+	Sample s = {};
+	s.wall = clock_sec(CLOCK_MONOTONIC);
+	s.cpu = clock_sec(CLOCK_PROCESS_CPUTIME_ID);
+	s.ntokens = stats.ntokens;
+	s.nnodes = stats.nnodes;
+	s.nalloc = atomic_load(&stats.buf_nalloc);
+	s.bytes = atomic_load(&stats.buf_bytes);
+	for(int i = 0; i < sizeof(arenas) / sizeof(*arenas); i++){
+		s.nalloc += arenas[i]->nalloc;
+		s.bytes += arenas[i]->total;
+	}
+	s.nalloc += ast.nalloc;
+	s.bytes += ast.total;
+	return s;
+}
+
+// 前回の切り替えからの差分を現在のフェーズに加算する
+static void account(void){
+	Sample now = sample();
+	if(phase_depth > 0){
+		PhaseStat *ps = &phase_stats[phase_stack[phase_depth - 1]];
+		ps->wall += now.wall - last.wall;
+		ps->cpu += now.cpu - last.cpu;
+		ps->ntokens += now.ntokens - last.ntokens;
+		ps->nnodes += now.nnodes - last.nnodes;
+		ps->nalloc += now.nalloc - last.nalloc;
+		ps->bytes += now.bytes - last.bytes;
+		ps->used = true;
+
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		ps->peak_rss = ru.ru_maxrss;
+	}
+	last = now;
+}
+
+// フェーズphに入る。入れ子にでき、内側のフェーズの時間は外側に含めない。
+void phase_push(Phase ph){
+	if(!stats.enabled){
+		return;
+	}
+	account();
+	phase_stack[phase_depth++] = ph;
+}
+
+void phase_pop(void){
+	if(!stats.enabled){
+		return;
+	}
+	account();
+	phase_depth--;
+}
+
+static void report_text(FILE *out){
+	PhaseStat total = {};
+
+	fprintf(out, "%-10s %10s %10s %10s %10s %10s %12s %12s\n",
+		"phase", "wall(ms)", "cpu(ms)", "tokens", "nodes", "allocs", "bytes", "peak RSS(KB)");
+	for(int i = 0; i < NUM_PHASES; i++){
+		PhaseStat *ps = &phase_stats[i];
+		if(!ps->used){
+			continue;
+		}
+		fprintf(out, "%-10s %10.3f %10.3f %10ld %10ld %10ld %12ld %12ld\n",
+			phase_name[i], ps->wall * 1e3, ps->cpu * 1e3,
+			ps->ntokens, ps->nnodes, ps->nalloc, ps->bytes, ps->peak_rss);
+		total.wall += ps->wall;
+		total.cpu += ps->cpu;
+		total.ntokens += ps->ntokens;
+		total.nnodes += ps->nnodes;
+		total.nalloc += ps->nalloc;
+		total.bytes += ps->bytes;
+		if(ps->peak_rss > total.peak_rss){
+			total.peak_rss = ps->peak_rss;
+		}
+	}
+	fprintf(out, "%-10s %10.3f %10.3f %10ld %10ld %10ld %12ld %12ld\n",
+		"total", total.wall * 1e3, total.cpu * 1e3,
+		total.ntokens, total.nnodes, total.nalloc, total.bytes, total.peak_rss);
+	if(cache_dir){
+		fprintf(out, "cache: %ld hits, %ld misses, %.3f ms saved\n",
+			stats.cache_hits, stats.cache_misses, stats.cache_saved_ns * 1e-6);
+	}
+}
+
+static void report_json(FILE *out){
+	Arena *arenas[] = { &token_arena, &node_arena, &type_arena };
+
+	fprintf(out, "{\"phases\": [");
+	bool first = true;
+	for(int i = 0; i < NUM_PHASES; i++){
+		PhaseStat *ps = &phase_stats[i];
+		if(!ps->used){
+			continue;
+		}
+		fprintf(out, "%s\n  {\"name\": \"%s\", \"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+			"\"tokens\": %ld, \"nodes\": %ld, \"allocs\": %ld, \"bytes\": %ld, \"peak_rss_kb\": %ld}",
+			first ? "" : ",", phase_name[i], ps->wall * 1e3, ps->cpu * 1e3,
+			ps->ntokens, ps->nnodes, ps->nalloc, ps->bytes, ps->peak_rss);
+		first = false;
+	}
+	fprintf(out, "\n],\n\"arenas\": [");
+	for(int i = 0; i < sizeof(arenas) / sizeof(*arenas); i++){
+		Arena *a = arenas[i];
+		fprintf(out, "%s\n  {\"name\": \"%s\", \"allocs\": %zu, \"peak_bytes\": %zu, \"peak_reserved\": %zu}",
+			i ? "," : "", a->name, a->nalloc, a->peak, a->peak_reserved);
+	}
+	fprintf(out, ",\n  {\"name\": \"ast\", \"allocs\": %zu, \"peak_bytes\": %zu, \"peak_reserved\": %zu}",
+		ast.nalloc, ast.peak_reserved, ast.peak_reserved);
+	fprintf(out, "\n],\n");
+	if(cache_dir){
+		fprintf(out, "\"cache\": {\"hits\": %ld, \"misses\": %ld, \"saved_ms\": %.3f},\n",
+			stats.cache_hits, stats.cache_misses, stats.cache_saved_ns * 1e-6);
+	}
+	fprintf(out, "\"tokens\": %ld, \"nodes\": %ld}\n", stats.ntokens, stats.nnodes);
+}
+
+// --time-report の結果を出力する
+void stats_report(FILE *out){
+	if(stats.json){
+		report_json(out);
+	}
+	else{
+		report_text(out);
+	}
+}
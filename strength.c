@@ -0,0 +1,150 @@
+#include <limits.h>
+
+#include "9cc.h"
+
+// 定数による乗除算の強さの軽減
+//
+// 定数倍は、2の冪ならシフトに、3, 5, 9とその2の冪倍ならleaとシフトにする。
+// 定数での除算は、2の冪なら負の数を0の方向に丸める補正を足してシフトし、
+// それ以外は上位64ビットを取る乗算 (マジックナンバー) とシフトにする
+// (Hacker's Delight 10章)。割り切れると分かっている除算 (ポインタの差) は、
+// シフトと奇数の逆数 (2^64を法とする) の乗算だけで済む。
+//
+// どちらのコード生成からも使う。RAXとRDXは作業用に壊してよい。
+
+static bool is_imm32(long val){
+	return val == (int)val;
+}
+
+static int ctz(long c){
+	return __builtin_ctzl((unsigned long)c);
+}
+
+// dst *= c。cはimm32に収まること。
+void emit_mul_imm(Reg dst, long c){
+	if(c == 0){
+		emit_ri(IN_MOV, dst, 0);
+		return;
+	}
+	int k = ctz(c);
+	long odd = c >> k;
+	if(odd == 3 || odd == 5 || odd == 9){
+		emit_lea(dst, dst, odd - 1);
+	}
+	else if(odd != 1){
+		emit_ri(IN_IMUL, dst, c);
+		return;
+	}
+	if(k){
+		emit_ri(IN_SHL, dst, k);
+	}
+}
+
+// cでの除算をemit_div_immにできるか。0と-1はidivと同じく落ちるように残す。
+bool can_div_imm(long c){
+	return c != 0 && c != -1 && c != LONG_MIN;
+}
+
+// x / dを、xとmの積の上位64ビットをsだけ算術シフトして求めるm, s。
+// |d| >= 2 であること。
+static void magic(long d, long *m, int *s){
+	const unsigned long two63 = 1UL << 63;
+	unsigned long ad = d < 0 ? -(unsigned long)d : d;
+	unsigned long t = two63 + ((unsigned long)d >> 63);
+	unsigned long anc = t - 1 - t % ad; // |nc|
+	unsigned long q1 = two63 / anc, r1 = two63 - q1 * anc;
+	unsigned long q2 = two63 / ad, r2 = two63 - q2 * ad;
+	unsigned long delta;
+	int p = 63;
+	do{
+		p++;
+		q1 *= 2;
+		r1 *= 2;
+		if(r1 >= anc){
+			q1++;
+			r1 -= anc;
+		}
+		q2 *= 2;
+		r2 *= 2;
+		if(r2 >= ad){
+			q2++;
+			r2 -= ad;
+		}
+		delta = ad - r2;
+	}while(q1 < delta || (q1 == delta && r1 == 0));
+	*m = q2 + 1;
+	if(d < 0){
+		*m = -*m;
+	}
+	*s = p - 64;
+}
+
+// dst = x / c (0の方向に丸める)。can_div_imm(c)であること。
+// xはRAX, RDXでないこと。dstはxと同じでもよい。
+void emit_div_imm(Reg dst, Reg x, long c){
+	if(c == 1){
+		if(dst != x){
+			emit_rr(IN_MOV, dst, x);
+		}
+		return;
+	}
+
+	int k = c > 0 && !(c & (c - 1)) ? ctz(c) : -1;
+	if(k > 0){
+		// 負なら 2^k-1 を足してから算術シフトする
+		emit_rr(IN_MOV, RDX, x);
+		if(k > 1){
+			emit_ri(IN_SAR, RDX, 63);
+		}
+		emit_ri(IN_SHR, RDX, 64 - k);
+		emit_rr(IN_ADD, RDX, x);
+		emit_ri(IN_SAR, RDX, k);
+	}
+	else{
+		long m;
+		int s;
+		magic(c, &m, &s);
+		emit_ri(IN_MOV, RAX, m);
+		emit_r(IN_MULH, x);
+		if(c > 0 && m < 0){
+			emit_rr(IN_ADD, RDX, x);
+		}
+		if(c < 0 && m > 0){
+			emit_rr(IN_SUB, RDX, x);
+		}
+		if(s){
+			emit_ri(IN_SAR, RDX, s);
+		}
+		// 商が負なら1を足す
+		emit_rr(IN_MOV, RAX, RDX);
+		emit_ri(IN_SHR, RAX, 63);
+		emit_rr(IN_ADD, RDX, RAX);
+	}
+	if(dst != RDX){
+		emit_rr(IN_MOV, dst, RDX);
+	}
+}
+
+// dst /= c。dstはcで割り切れ、c > 0であること。dstはRDXでないこと。
+void emit_exact_div_imm(Reg dst, long c){
+	int k = ctz(c);
+	if(k){
+		emit_ri(IN_SAR, dst, k);
+	}
+	unsigned long odd = c >> k;
+	if(odd == 1){
+		return;
+	}
+	// ニュートン法で 2^64 を法とする逆数を求める (1回ごとに正しいビット数が倍になる)
+	unsigned long inv = odd;
+	for(int i = 0; i < 5; i++){
+		inv *= 2 - odd * inv;
+	}
+	if(is_imm32(inv)){
+		emit_ri(IN_IMUL, dst, inv);
+	}
+	else{
+		emit_ri(IN_MOV, RDX, inv);
+		emit_rr(IN_IMUL, dst, RDX);
+	}
+}
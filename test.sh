@@ -1,12 +1,92 @@
 #!/bin/bash
 
+# ./test.sh --server ではコンパイルサーバを起動し、クライアント経由でコンパイルする
+# ./test.sh --obj ではアセンブラを通さず、9cc -c の出力を直接リンクする
+# ./test.sh --run ではリンクもせず、9cc --run でメモリ上で実行する
+# ./test.sh -O0 ではレジスタ割り付けをせず、スタックマシンのコードを生成する
+# ./test.sh -O2 ではSSA形式での最適化もする
+CC9=./9cc
+OUT=tmp.s
+RUN=
+if [ "$1" = "--run" ]; then
+	RUN=1
+fi
+if [ "$1" = "-O0" ] || [ "$1" = "-O2" ]; then
+	CC9="./9cc $1"
+fi
+if [ "$1" = "--obj" ]; then
+	CC9="./9cc -c"
+	OUT=tmp.o
+fi
+if [ "$1" = "--server" ]; then
+	rm -f tmp.sock
+	./9cc --server=tmp.sock &
+	server_pid=$!
+	trap 'kill $server_pid 2>/dev/null; rm -f tmp.sock' EXIT
+	while [ ! -S tmp.sock ]; do sleep 0.01; done
+	CC9="./9cc --client=tmp.sock"
+fi
+
+# 9ccでコンパイルして実行し、その終了ステータスを返す。引数は9ccに渡す。
+compile_run(){
+	if [ -n "$RUN" ]; then
+		./9cc --run "$@"
+		return
+	fi
+	$CC9 "$@" > $OUT
+	gcc -o tmp $OUT
+	./tmp
+}
+
+try_file(){
+	expected="$1"
+	input="$2"
+
+	printf '%s' "$input" > tmp.in
+	compile_run -f tmp.in
+	actual="$?"
+
+	if [ "$actual" != "$expected" ]; then
+		echo "-f: $input => $expected expected, but got $actual"
+		exit 1
+	fi
+
+	printf '%s' "$input" | compile_run -f -
+	actual="$?"
+
+	if [ "$actual" = "$expected" ]; then
+		echo "-f: $input => $actual"
+	else
+		echo "-f -: $input => $expected expected, but got $actual"
+		exit 1
+	fi
+}
+
+# -j で並列に生成しても出力が変わらないことを確認
+try_jobs(){
+	input="$1"
+
+	./9cc -j 1 "$input" > tmp1.s
+	./9cc -j 4 "$input" > tmp4.s
+	if cmp -s tmp1.s tmp4.s; then
+		echo "-j 4: $input => same"
+	else
+		echo "-j 4: $input => output differs from -j 1"
+		exit 1
+	fi
+}
+
 try(){
 	expected="$1"
 	input="$2"
 
-	./9cc "$input" > tmp.s
-	gcc -o tmp tmp.s
-	./tmp
+	if [ -n "$RUN" ]; then
+		./9cc --run "$input"
+	else
+		$CC9 -o $OUT "$input"
+		gcc -o tmp $OUT
+		./tmp
+	fi
 	actual="$?"
 
 	if [ "$actual" = "$expected" ]; then
@@ -54,12 +134,153 @@ try 2 "int main(){int x=2; int *y = &x; return *y;}"
 try 3 "int main(){int x=2; int *y = &x; *y = 3; return x;}"
 try 4 "int main(){int x=4; int *y = &x; int **z = &y; return **z;}"
 try 4 "int main(){int x=1; return sizeof(x);}"
-try 8 "int main(){int *x; *x = 1; return sizeof(x);}"
+try 8 "int main(){int y; int *x = &y; *x = 1; return sizeof(x);}"
 try 3 "int main(){int x[3]; *x = 3; *(x+1)=4; *(x+2)=5; return *x;}"
 try 4 "int main(){int x[3]; *x = 3; *(x+1)=4; *(x+2)=5; return *(x+1);}"
 try 5 "int main(){int x[3]; *x = 3; *(x+1)=4; *(x+2)=5; return *(x+2);}"
 try 3 "int main(){int x[3]; *x = 3; *(x+1)=4; *(x+2)=5; return x[0];}"
 try 4 "int main(){int x[3]; *x = 3; *(x+1)=4; *(x+2)=5; return x[1];}"
 try 5 "int main(){int x[3]; *x = 3; *(x+1)=4; *(x+2)=5; return x[2];}"
+try 2 "int sub(int x, int y){return x - y;} int main(){return sub(5, 3);}"
+try 9 "int f(int a){int b = a * 2; return b;} int main(){int x = 3; int y = f(x); return x + y;}"
+# 引数の途中でトークンのリングが一周しても関数名を失わない
+try 60 "int sub(int x, int y){return x - y;} int main(){return sub(1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + 10 + 11 + 12 + 13, sub(50, 19));}"
+try 1 "int main(){int x = 1; {int x = 2; x = 3;} return x;}"
+try 2 "int main(){int x = 1; {int y = 2; x = y;} return x;}"
+try 10 "int main(){int i; int s = 0; for(i = 0; i < 10; i = i + 1){s = s + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 + 1 - 19;} return s;}"
+# 定数畳み込みと定数の伝播
+try 7 "int main(){int x = 0; int y = 5; if(x) return 1 / x; return y + 2;}"
+try 6 "int f(int a){return a * 1 + 0 * a + (a + 0) * 0 + a / 1;} int main(){int n = 3; return f(n);}"
+try 4 "int g(int *p){*p = 4; return 0;} int main(){int x = 1; g(&x); return x;}"
+try 5 "int main(){int i = 0; int s = 0; while(0) s = 9; for(;1;){ i = i + 1; if(i == 5) return i; } return s;}"
+try 136 "int main(){int x = 0; return 5 / x;}"
+try 136 "int main(){return 5 / 0;}"
+# -O2のSSA形式での最適化: phiのコピーの循環、共通部分式、ポインタ経由の書き込み
+try 21 "int main(){int a = 1; int b = 2; int t; int i; for(i = 0; i < 3; i = i + 1){t = a; a = b; b = t;} return a * 10 + b;}"
+try 24 "int main(){int x = 3; int y = 4; int a = x * y; int b = x * y; if(a != b) return 1; return a + b;}"
+try 7 "int main(){int x = 1; int *p = &x; x = 2; *p = 7; return x;}"
+
+# ポインタの差は要素数で割り切れる
+try 5 "int main(){int a[10]; int *p = &a[7]; int *q = &a[2]; return p - q;}"
+try 3 "int main(){int a[10]; int *p = &a[7]; int *q = &a[2]; return q - p + 8;}"
+try 6 "int main(){int **a[10]; int ***p = &a[9]; return p - a - 3;}"
+
+# 文の前後でスタックの深さが変わらず、呼び出しはどの深さでも揃う
+try 13 "int main(){int i; int s = 0; for(i = 0; i < 3; i = i + 1){ if(i == 1) s = s + 10; s = s + 1; } return s;}"
+try 4 "int main(){int i = 0; for(;;){ i = i + 1; if(i == 4) return i; }}"
+try 10 "int f(int x){return x;} int main(){return 1 + f(2) + (3 + f(4));}"
+
+# ループ不変式の移動と、添字の計算をポインタの増分にする誘導変数の変形
+try 212 "int main(){int a[12]; int i; int j; int s = 0; for(i = 0; i < 3; i = i + 1) for(j = 0; j < 4; j = j + 1) a[i * 4 + j] = i + j; for(i = 0; i < 12; i = i + 1) s = s + a[i] * i; return s;}"
+try 42 "int main(){int a[8]; int i; int s = 0; for(i = 7; i >= 0; i = i - 1) a[i] = i * 3; for(i = 0; i < 7; i = i + 1) a[i] = a[i + 1] - a[i]; for(i = 0; i < 8; i = i + 1) s = s + a[i]; return s;}"
+try 50 "int f(int *p){*p = *p + 1; return 0;} int main(){int i; int n = 2; int s = 0; for(i = 0; i < 5; i = i + 1){ f(&n); s = s + n * 2; } return s;}"
+
+try_file 3 "int main(){
+	int x = 3;
+	return x;
+}"
+try_file 8 "int fibo(int n){
+	if(n == 0) return 0;
+	if(n == 1) return 1;
+	return fibo(n-1) + fibo(n-2);
+}
+int main(){ return fibo(6); }"
+
+# 深く入れ子になった式も再帰せずに解析できる
+printf 'int main(){return %s1%s;}' "$(printf -- '-(%.0s' $(seq 100000))" "$(printf ')%.0s' $(seq 100000))" > tmp.in
+compile_run -f tmp.in
+actual="$?"
+if [ "$actual" != 1 ]; then
+	echo "100000-deep nesting => 1 expected, but got $actual"
+	exit 1
+fi
+echo "100000-deep nesting => 1"
+
+# 定数での乗除算をシフトやマジックナンバーに置き換えても、gccと同じ結果になる
+if [ -z "$RUN" ]; then
+	divs="2 3 4 5 6 7 8 9 10 12 16 24 25 100 125 641 1000 1024 65536 1000000007 2147483647 -2 -3 -7 -8 -100 -65536"
+	muls="2 3 5 6 9 10 24 40 72 1024 -3 -8"
+	{
+		echo "long vals[] = {0, 1, -1, 2, -2, 5, -5, 7, -7, 99, -99, 100, -100, 1000, -1001, 65535, -65537,"
+		echo "	2147483647, -2147483648, 4294967296, -4294967297, 123456789012345, -123456789012345,"
+		echo "	9223372036854775807, -9223372036854775807 - 1, 9223372036854775806, -9223372036854775807};"
+		echo "long val(long i){ return vals[i]; }"
+		echo "long nvals(void){ return sizeof(vals) / sizeof(vals[0]); }"
+		n=0
+		for c in $divs; do echo "long rd$n(long x){ return x / ($c); }"; n=$((n + 1)); done
+		n=0
+		for c in $muls; do echo "long rm$n(long x){ return (long)((unsigned long)x * ($c)); }"; n=$((n + 1)); done
+	} > tmp.ref
+	{
+		n=0
+		for c in $divs; do echo "int d$n(int x){return x / $c;}"; n=$((n + 1)); done
+		n=0
+		for c in $muls; do echo "int m$n(int x){return x * $c;}"; n=$((n + 1)); done
+		echo "int main(){"
+		echo "	int i = 0;"
+		echo "	int bad = 0;"
+		echo "	for(; i < nvals(); i = i + 1){"
+		n=0
+		for c in $divs; do echo "		bad = bad + (d$n(val(i)) != rd$n(val(i)));"; n=$((n + 1)); done
+		n=0
+		for c in $muls; do echo "		bad = bad + (m$n(val(i)) != rm$n(val(i)));"; n=$((n + 1)); done
+		echo "	}"
+		echo "	return bad;"
+		echo "}"
+	} > tmp.in
+	$CC9 -f tmp.in > $OUT
+	gcc -o tmp $OUT -x c tmp.ref
+	./tmp
+	actual="$?"
+	if [ "$actual" != 0 ]; then
+		echo "division/multiplication by constants: $actual results differ from gcc"
+		exit 1
+	fi
+	echo "division/multiplication by constants => ok"
+fi
+
+try_jobs "int a(int x){if(x) return 1; return 2;} int b(int x){while(x) x = x - 1; return x;} int c(){return 3;} int main(){return a(b(c()));}"
+
+# --cache で2回目は全関数をキャッシュから読み、出力は変わらない
+prog="int f(int x){return x + 1;} int main(){return f(2);}"
+rm -rf tmp.cache
+./9cc -o tmp1.s "$prog"
+./9cc --cache=tmp.cache -o tmp4.s "$prog"
+./9cc --cache=tmp.cache --time-report=json -o tmp4.s "$prog" 2> tmp.json
+if ! cmp -s tmp1.s tmp4.s || ! grep -q '"hits": 2, "misses": 0' tmp.json; then
+	echo "--cache: cached output differs or functions were not reused"
+	exit 1
+fi
+./9cc -O0 -o tmp1.s "$prog"
+./9cc -O0 --cache=tmp.cache -o tmp4.s "$prog"
+if ! cmp -s tmp1.s tmp4.s; then
+	echo "--cache: -O0 reused code generated at another optimization level"
+	exit 1
+fi
+echo "--cache => ok"
+
+# 字句解析のどの実装でも同じトークン列になる (長い空白・識別子・数字を含む)
+printf 'int main(){\n\t\t\t\t\t\t\t\t\t\t  int a_very_long_identifier_name_0123456789_abcdefghij;\n  a_very_long_identifier_name_0123456789_abcdefghij = 12345678901234567890123;\n  return 0;                                                                 \n}\n' > tmp.in
+if ! ./9cc --lex-check -f tmp.in > /dev/null; then
+	echo "--lex-check: lexers disagree"
+	./9cc --lex-check -f tmp.in
+	exit 1
+fi
+echo "--lex-check => ok"
+
+./9cc --time-report=json -o tmp.s "int main(){return 0;}" 2> tmp.json
+if ! grep -q '"name": "codegen"' tmp.json; then
+	echo "--time-report=json: codegen phase missing"
+	exit 1
+fi
+echo "--time-report=json => ok"
+
+# -O0 のスタックマシンでも、隣り合う push と pop はのぞき穴最適化で消える
+./9cc -O0 --peephole-report -o tmp.s "int main(){return 1 + 2;}" 2> tmp.log
+if ! grep -q "^push-pop  *[1-9]" tmp.log; then
+	echo "--peephole-report: push-pop was never rewritten"
+	exit 1
+fi
+echo "--peephole-report => ok"
 
 echo OK
@@ -0,0 +1,12 @@
+.intel_syntax noprefix
+.global main
+main:
+  push rbp
+  mov rbp, rsp
+  mov rdi, 2
+  mov rax, 1
+  add rax, rdi
+.Lreturn_main:
+  mov rsp, rbp
+  pop rbp
+  ret
@@ -0,0 +1,25 @@
+.intel_syntax noprefix
+.global f
+f:
+  push rbp
+  mov rbp, rsp
+  sub rsp, 16
+  mov [rbp-8], rdi
+  mov rax, [rbp-8]
+  mov rdi, 1
+  add rax, rdi
+.Lreturn_f:
+  mov rsp, rbp
+  pop rbp
+  ret
+.global main
+main:
+  push rbp
+  mov rbp, rsp
+  mov rdi, 2
+  mov rax, 0
+  call f
+.Lreturn_main:
+  mov rsp, rbp
+  pop rbp
+  ret
@@ -1,4 +1,7 @@
 #include <ctype.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -10,19 +13,54 @@
 
 extern Token *token;
 extern char *user_input;
+extern char *filename;
 
+FILE *error_out; // エラーの出力先。NULLなら標準エラー出力。
+jmp_buf *error_jmp; // NULLでなければ、エラー時にexitせずここへ戻る
 
+static void error_exit(void){
+	if(error_jmp){
+		longjmp(*error_jmp, 1);
+	}
+	exit(1);
+}
+
+
+// エラー箇所を「ファイル名:行:桁」と該当行だけで報告する
 void error_at(char *loc, char *fmt, ...){
 	va_list ap;
 	va_start(ap, fmt);
 
-	int pos = loc - user_input;
-	fprintf(stderr, "%s\n", user_input);
-	fprintf(stderr, "%*s", pos, ""); // pos個の空白を出力
-	fprintf(stderr, "^ ");
-	vfprintf(stderr, fmt, ap);
-	fprintf(stderr, "\n");
-	exit(1);
+	// locを含む行の先頭と末尾を探す
+	char *line = loc;
+	while(user_input < line && line[-1] != '\n'){
+		line--;
+	}
+	char *end = loc;
+	while(*end && *end != '\n'){
+		end++;
+	}
+
+	// 行番号を数える
+	int line_no = 1;
+	for(char *p = user_input; p < line; p++){
+		p = memchr(p, '\n', line - p);
+		if(!p){
+			break;
+		}
+		line_no++;
+	}
+
+	FILE *out = error_out ? error_out : stderr;
+	int pos = loc - line;
+	int indent = fprintf(out, "%s:%d:%d: ", filename, line_no, pos + 1);
+	fprintf(out, "%.*s\n", (int)(end - line), line);
+	fprintf(out, "%*s", indent + pos, ""); // pos個の空白を出力
+	fprintf(out, "^ ");
+	vfprintf(out, fmt, ap);
+	fprintf(out, "\n");
+	va_end(ap);
+	error_exit();
 }
 
 // エラー報告のための関数
@@ -30,20 +68,37 @@ void error_at(char *loc, char *fmt, ...){
 void error(char *fmt, ...){
 	va_list ap;
 	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
-	fprintf(stderr, "\n");
-	exit(1);
+	FILE *out = error_out ? error_out : stderr;
+	vfprintf(out, fmt, ap);
+	fprintf(out, "\n");
+	va_end(ap);
+	error_exit();
+}
+
+// トークンの種類ごとの表記 (エラーメッセージ用)
+static char *token_kind_str[] = {
+	[TK_IDENT] = "識別子", [TK_NUM] = "数", [TK_EOF] = "入力の終わり",
+	[TK_RETURN] = "return", [TK_IF] = "if", [TK_ELSE] = "else",
+	[TK_WHILE] = "while", [TK_FOR] = "for", [TK_INT] = "int",
+	[TK_SIZEOF] = "sizeof",
+	[TK_PLUS] = "+", [TK_MINUS] = "-", [TK_STAR] = "*", [TK_SLASH] = "/",
+	[TK_LPAREN] = "(", [TK_RPAREN] = ")", [TK_LBRACE] = "{", [TK_RBRACE] = "}",
+	[TK_LBRACKET] = "[", [TK_RBRACKET] = "]", [TK_SEMI] = ";", [TK_COMMA] = ",",
+	[TK_AMP] = "&", [TK_ASSIGN] = "=", [TK_LT] = "<", [TK_GT] = ">",
+	[TK_EQ] = "==", [TK_NE] = "!=", [TK_LE] = "<=", [TK_GE] = ">=",
+};
+
+char *tk_str(TokenKind kind){
+	return token_kind_str[kind];
 }
 
-// 次のトークンが期待している記号の時は、トークンを１つ読み進めて
+// 次のトークンが期待している種類の時は、トークンを１つ読み進めて
 // trueを返す。それ以外はfalseを返す。
-bool consume(char *op){
-	if(token->kind != TK_RESERVED 
-		|| strlen(op) != token->len
-		|| memcmp(token->str, op, token->len)){
+bool consume(TokenKind kind){
+	if(token->kind != kind){
 		return false;
 	}
-	token = token->next;
+	next_token();
 	return true;
 }
 
@@ -52,19 +107,17 @@ Token *consume_ident(){
         return NULL;
     }
     Token *tok_ident = token;
-    token = token->next;
+    next_token();
     return tok_ident;
 }
 
-// 次のトークンが期待している記号の時は、トークンを１つ読み進める。
+// 次のトークンが期待している種類の時は、トークンを１つ読み進める。
 // それ以外の場合にはエラーを報告する。
-void expect(char *s){
-	if(token->kind != TK_RESERVED 
-		|| strlen(s) != token->len
-		|| memcmp(token->str, s, token->len)){
-		error_at(token->str, "'%s'ではありません。", s);
+void expect(TokenKind kind){
+	if(token->kind != kind){
+		error_at(token->str, "'%s'ではありません。", tk_str(kind));
 	}
-	token = token->next;
+	next_token();
 }
 
 // 次のトークンが数値の場合、トークンを１つ読み進めてその数値を返す。
@@ -74,7 +127,7 @@ int expect_number(){
 		error_at(token->str, "数ではありません。");
 	}
 	int val = token->val;
-	token = token->next;
+	next_token();
 	return val;
 }
 
@@ -84,8 +137,8 @@ char *expect_ident(void){
 	if(token->kind != TK_IDENT){
 		error_at(token->str, "識別子が来るはずです。");
 	}
-	char *s = strndup(token->str, token->len);
-	token = token->next;
+	char *s = intern(token->str, token->len);
+	next_token();
 	return s;
 }
 
@@ -93,21 +146,6 @@ bool at_eof(){
 	return token->kind == TK_EOF;
 }
 
-// 新しいトークンを作成してcurにつなげる
-Token *new_token(TokenKind kind, Token *cur, char *str, int len){
-	Token *tok = calloc(1, sizeof(Token));
-	tok->kind = kind;
-	tok->str = str;
-	tok->len = len;
-	cur->next = tok;
-	return tok;
-}
-
-// 特定の文字列で始まっているか確認
-bool startswith(char *p, char *q){
-	return memcmp(p, q, strlen(q)) == 0;
-}
-
 int is_alnum(char c){
 	return ('a' <= c && c <= 'z') ||
 		   ('A' <= c && c <= 'Z') ||
@@ -115,89 +153,398 @@ int is_alnum(char c){
 		   (c == '_');
 }
 
-char* strndup(char *str, size_t len) {
+// 予約語の完全ハッシュ表
+// 先頭文字・末尾文字・長さから計算するハッシュが予約語どうしで衝突しない
+// ように係数を選んである。予約語を追加したら衝突しないことを確認すること。
+#define KW_TABLE_SIZE 16
+#define KW_HASH(first, last, len) \
+	((((unsigned char)(first) << 1) + ((unsigned char)(last) << 3) + (len)) & (KW_TABLE_SIZE - 1))
+
+typedef struct {
+	char *name;
+	int len;
+	TokenKind kind;
+} Keyword;
+
+static Keyword keywords[KW_TABLE_SIZE] = {
+	[KW_HASH('r', 'n', 6)] = { "return", 6, TK_RETURN },
+	[KW_HASH('i', 'f', 2)] = { "if",     2, TK_IF },
+	[KW_HASH('e', 'e', 4)] = { "else",   4, TK_ELSE },
+	[KW_HASH('w', 'e', 5)] = { "while",  5, TK_WHILE },
+	[KW_HASH('f', 'r', 3)] = { "for",    3, TK_FOR },
+	[KW_HASH('i', 't', 3)] = { "int",    3, TK_INT },
+	[KW_HASH('s', 'f', 6)] = { "sizeof", 6, TK_SIZEOF },
+};
+
+// 識別子p[0..len)が予約語ならその種類を、そうでなければTK_IDENTを返す
+static TokenKind keyword_kind(char *p, int len){
+	Keyword *kw = &keywords[KW_HASH(p[0], p[len - 1], len)];
+	if(kw->len == len && !memcmp(p, kw->name, len)){
+		return kw->kind;
+	}
+	return TK_IDENT;
+}
+
+// 1文字記号の表。0は記号でないことを表す。
+static const unsigned char punct1[256] = {
+	['+'] = TK_PLUS, ['-'] = TK_MINUS, ['*'] = TK_STAR, ['/'] = TK_SLASH,
+	['('] = TK_LPAREN, [')'] = TK_RPAREN, ['{'] = TK_LBRACE, ['}'] = TK_RBRACE,
+	['['] = TK_LBRACKET, [']'] = TK_RBRACKET, [';'] = TK_SEMI, [','] = TK_COMMA,
+	['&'] = TK_AMP, ['='] = TK_ASSIGN, ['<'] = TK_LT, ['>'] = TK_GT,
+};
+
+// 後ろに'='が続く2文字記号の表
+static const unsigned char punct2[256] = {
+	['='] = TK_EQ, ['!'] = TK_NE, ['<'] = TK_LE, ['>'] = TK_GE,
+};
+
+//---- 文字の並びの読み飛ばし ----
+//
+// 空白・識別子・数字が続く部分を読み飛ばす。スカラー版のほかに、
+// x86-64ではSSE2 (16バイト) とAVX2 (32バイト) で文字種を一度に判定する
+// 版があり、起動時にCPUに合わせて選ぶ。
+//
+// SIMD版は整列したアドレスから読むので、'\0'を越えて読んでもページを
+// またがず、入力の後ろにパディングは要らない。'\0'はどの文字種にも
+// 含まれないので必ずそこで止まる。
+
+// 文字種
+enum {
+	CH_SPACE = 1, // isspace
+	CH_DIGIT = 2, // 0-9
+	CH_ALPHA = 4, // a-z A-Z (識別子の先頭)
+	CH_IDENT = 8, // a-z A-Z 0-9 _ (識別子の2文字目以降)
+};
+
+static unsigned char char_class[256] = {
+	[' '] = CH_SPACE, ['\t'] = CH_SPACE, ['\n'] = CH_SPACE,
+	['\v'] = CH_SPACE, ['\f'] = CH_SPACE, ['\r'] = CH_SPACE,
+	['_'] = CH_IDENT,
+#define D CH_DIGIT | CH_IDENT
+	['0'] = D, ['1'] = D, ['2'] = D, ['3'] = D, ['4'] = D,
+	['5'] = D, ['6'] = D, ['7'] = D, ['8'] = D, ['9'] = D,
+#undef D
+#define A CH_ALPHA | CH_IDENT
+	['a'] = A, ['b'] = A, ['c'] = A, ['d'] = A, ['e'] = A, ['f'] = A, ['g'] = A,
+	['h'] = A, ['i'] = A, ['j'] = A, ['k'] = A, ['l'] = A, ['m'] = A, ['n'] = A,
+	['o'] = A, ['p'] = A, ['q'] = A, ['r'] = A, ['s'] = A, ['t'] = A, ['u'] = A,
+	['v'] = A, ['w'] = A, ['x'] = A, ['y'] = A, ['z'] = A,
+	['A'] = A, ['B'] = A, ['C'] = A, ['D'] = A, ['E'] = A, ['F'] = A, ['G'] = A,
+	['H'] = A, ['I'] = A, ['J'] = A, ['K'] = A, ['L'] = A, ['M'] = A, ['N'] = A,
+	['O'] = A, ['P'] = A, ['Q'] = A, ['R'] = A, ['S'] = A, ['T'] = A, ['U'] = A,
+	['V'] = A, ['W'] = A, ['X'] = A, ['Y'] = A, ['Z'] = A,
+#undef A
+};
+
+static char *scalar_skip(char *p, int cls){
+	while(char_class[(unsigned char)*p] & cls){
+		p++;
+	}
+	return p;
+}
+
+static char *scalar_skip_space(char *p){
+	return scalar_skip(p, CH_SPACE);
+}
+
+static char *scalar_skip_ident(char *p){
+	return scalar_skip(p, CH_IDENT);
+}
+
+static char *scalar_skip_digits(char *p){
+	return scalar_skip(p, CH_DIGIT);
+}
+
+#ifdef __x86_64__
+
+// 各バイトが lo <= c <= lo+n (符号なし) なら0xff
+#define SSE2_RANGE(x, lo, n) ({ \
+	__m128i t_ = _mm_sub_epi8((x), _mm_set1_epi8(lo)); \
+	_mm_cmpeq_epi8(_mm_min_epu8(t_, _mm_set1_epi8(n)), t_); })
+
+static inline __m128i sse2_space(__m128i x){
+	return _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), SSE2_RANGE(x, '\t', '\r' - '\t'));
+}
+
+static inline __m128i sse2_digit(__m128i x){
+	return SSE2_RANGE(x, '0', 9);
+}
+
+static inline __m128i sse2_ident(__m128i x){
+	__m128i alpha = SSE2_RANGE(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 25);
+	__m128i under = _mm_cmpeq_epi8(x, _mm_set1_epi8('_'));
+	return _mm_or_si128(_mm_or_si128(alpha, under), sse2_digit(x));
+}
+
+// pを含む16バイト境界から読み、classに当てはまらない最初の文字を返す
+#define SSE2_SKIP(name, class) \
+static char *name(char *p){ \
+	unsigned off = (unsigned long)p & 15; \
+	char *q = p - off; \
+	unsigned miss = ~_mm_movemask_epi8(class(_mm_load_si128((__m128i *)q))) & 0xffff & (0xffffu << off); \
+	while(!miss){ \
+		q += 16; \
+		miss = ~_mm_movemask_epi8(class(_mm_load_si128((__m128i *)q))) & 0xffff; \
+	} \
+	return q + __builtin_ctz(miss); \
+}
+
+SSE2_SKIP(sse2_skip_space, sse2_space)
+SSE2_SKIP(sse2_skip_ident, sse2_ident)
+SSE2_SKIP(sse2_skip_digits, sse2_digit)
+
+#define AVX2_RANGE(x, lo, n) ({ \
+	__m256i t_ = _mm256_sub_epi8((x), _mm256_set1_epi8(lo)); \
+	_mm256_cmpeq_epi8(_mm256_min_epu8(t_, _mm256_set1_epi8(n)), t_); })
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_space(__m256i x){
+	return _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), AVX2_RANGE(x, '\t', '\r' - '\t'));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_digit(__m256i x){
+	return AVX2_RANGE(x, '0', 9);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_ident(__m256i x){
+	__m256i alpha = AVX2_RANGE(_mm256_or_si256(x, _mm256_set1_epi8(0x20)), 'a', 25);
+	__m256i under = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_'));
+	return _mm256_or_si256(_mm256_or_si256(alpha, under), avx2_digit(x));
+}
+
+// pを含む32バイト境界から読み、classに当てはまらない最初の文字を返す
+#define AVX2_SKIP(name, class) \
+__attribute__((target("avx2"))) \
+static char *name(char *p){ \
+	unsigned off = (unsigned long)p & 31; \
+	char *q = p - off; \
+	unsigned miss = ~_mm256_movemask_epi8(class(_mm256_load_si256((__m256i *)q))) & (0xffffffffu << off); \
+	while(!miss){ \
+		q += 32; \
+		miss = ~_mm256_movemask_epi8(class(_mm256_load_si256((__m256i *)q))); \
+	} \
+	return q + __builtin_ctz(miss); \
+}
+
+AVX2_SKIP(avx2_skip_space, avx2_space)
+AVX2_SKIP(avx2_skip_ident, avx2_ident)
+AVX2_SKIP(avx2_skip_digits, avx2_digit)
+
+#endif
+
+typedef struct {
+	char *name;
+	char *(*skip_space)(char *p);
+	char *(*skip_ident)(char *p);
+	char *(*skip_digits)(char *p);
+} Scanner;
+
+static Scanner scanners[] = {
+	{ "scalar", scalar_skip_space, scalar_skip_ident, scalar_skip_digits },
+#ifdef __x86_64__
+	{ "sse2", sse2_skip_space, sse2_skip_ident, sse2_skip_digits },
+	{ "avx2", avx2_skip_space, avx2_skip_ident, avx2_skip_digits },
+#endif
+};
 
-    char *buffer = malloc(len + 1);
-    memcpy(buffer, str, len);
-    buffer[len] = '\0';
+#define NUM_SCANNERS (int)(sizeof(scanners) / sizeof(*scanners))
+
+static Scanner *scanner; // 使う実装。NULLなら最初のtokenizeで選ぶ。
+
+static bool scanner_supported(Scanner *sc){
+#ifdef __x86_64__
+	if(!strcmp(sc->name, "avx2")){
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+	return true;
+}
+
+// 使える中で最も速い実装を選ぶ
+static Scanner *best_scanner(void){
+	for(int i = NUM_SCANNERS - 1; i > 0; i--){
+		if(scanner_supported(&scanners[i])){
+			return &scanners[i];
+		}
+	}
+	return &scanners[0];
+}
 
-    return buffer;
+// --lex=<名前> で実装を指定する
+void set_scanner(char *name){
+	for(int i = 0; i < NUM_SCANNERS; i++){
+		if(!strcmp(scanners[i].name, name)){
+			if(!scanner_supported(&scanners[i])){
+				error("このCPUでは %s を使えません。", name);
+			}
+			scanner = &scanners[i];
+			return;
+		}
+	}
+	error("不明な字句解析の実装です: %s", name);
 }
 
-char *starts_with_reserved(char *p){
+// pから1トークン読んでtokに書き、そのトークンの直後の位置を返す。
+// tok->nextは変えない。
+char *lex_token(char *p, Token *tok){
+	// 空白文字、改行をスキップ。1文字だけの空白が多いので、
+	// 2文字以上続くときだけベクトル版を使う。
+	unsigned char c = *p;
+	if(char_class[c] & CH_SPACE){
+		p++;
+		if(char_class[(unsigned char)*p] & CH_SPACE){
+			p = scanner->skip_space(p + 1);
+		}
+		c = *p;
+	}
+
+	stats.ntokens++;
+	tok->str = p;
+	if(!c){
+		tok->kind = TK_EOF;
+		tok->len = 0;
+		return p;
+	}
+
+	if(punct2[c] && p[1] == '='){
+		tok->kind = punct2[c];
+		tok->len = 2;
+		return p + 2;
+	}
 
-	// 予約語チェック
-	static char *kw[] = {
-		"return", "if", "else", "while", "for", "int", "sizeof"
-	};
-	for(int i = 0; i < sizeof(kw) / sizeof(*kw); i++){
-		int len = strlen(kw[i]);
-		if(startswith(p, kw[i]) && !is_alnum(p[len])){
-			return kw[i];
+	if(punct1[c]){
+		tok->kind = punct1[c];
+		tok->len = 1;
+		return p + 1;
+	}
+
+	if(char_class[c] & CH_ALPHA){
+		char *end = p + 1;
+		if(char_class[(unsigned char)*end] & CH_IDENT){
+			end = scanner->skip_ident(end + 1);
 		}
+		tok->kind = keyword_kind(p, end - p);
+		tok->len = end - p;
+		return end;
 	}
 
-	// ２文字演算子チェック
-	static char *ops[] = {
-		"==", "!=", "<=", ">="
-	};
-	for(int i = 0; i < sizeof(ops) / sizeof(*ops); i++){
-		if(startswith(p, ops[i])){
-			return ops[i];
+	if(char_class[c] & CH_DIGIT){
+		char *end = p + 1;
+		if(char_class[(unsigned char)*end] & CH_DIGIT){
+			end = scanner->skip_digits(end + 1);
+		}
+		tok->kind = TK_NUM;
+		tok->len = end - p;
+		if(end - p <= 18){
+			long val = 0;
+			for(char *q = p; q < end; q++){
+				val = val * 10 + (*q - '0');
+			}
+			tok->val = val;
+		}
+		else{
+			tok->val = strtol(p, NULL, 10); // 桁あふれはstrtolに合わせる
 		}
+		return end;
 	}
 
+	error_at(p, "トークナイズできません。");
 	return NULL;
 }
 
-// 入力文字列pをトークナイズしてそれを返す
+// 入力文字列pをすべてトークナイズしてトークンの列を返す (--lex-check用)
 Token *tokenize(char *p){
 	Token head;
 	head.next = NULL;
 	Token *cur = &head;
 
-	while(*p){
-		// 空白文字、改行をスキップ
-		if(isspace(*p) || *p == '\n'){
-			p++;
-			continue;
-		}
+	if(!scanner){
+		scanner = best_scanner();
+	}
 
-		char *kw = starts_with_reserved(p);
-		if(kw){
-			int len = strlen(kw);
-			cur = new_token(TK_RESERVED, cur, p, len);
-			p += len;
-			continue;
-		}
+	do{
+		Token *tok = arena_alloc(&token_arena, sizeof(Token));
+		p = lex_token(p, tok);
+		cur = cur->next = tok;
+	}while(cur->kind != TK_EOF);
+	return head.next;
+}
+
+//---- トークンのリングバッファ ----
+//
+// パーサは現在のトークン (token) しか見ないので、ファイル全体をトークンの
+// 列にはせず、読み進めるたびに1トークンずつ切り出す。トークンは固定長の
+// リングに置き、直近のTOKEN_RING_SIZE-1個より前のものは上書きされる。
+// 入力の大きさに関係なく、トークンに使うメモリは一定になる。
+
+#define TOKEN_RING_SIZE 16
+
+static Token token_ring[TOKEN_RING_SIZE];
+static char *lex_pos; // 次のトークンを読み始める位置
+
+// pから読み始め、最初のトークンをtokenにする
+void lexer_start(char *p){
+	if(!scanner){
+		scanner = best_scanner();
+	}
+	for(int i = 0; i < TOKEN_RING_SIZE; i++){
+		token_ring[i].next = &token_ring[(i + 1) % TOKEN_RING_SIZE];
+	}
+	token = &token_ring[0];
+	lex_pos = lex_token(p, token);
+}
+
+// 次のトークンに進む。入力の終わりではそこに留まる。
+void next_token(void){
+	if(token->kind == TK_EOF){
+		return;
+	}
+	Token *tok = token->next;
+	lex_pos = lex_token(lex_pos, tok);
+	token = tok;
+}
+
+// 現在のトークンの後をとばし、pから読み直す
+void lexer_seek(char *p){
+	lex_pos = p;
+	next_token();
+}
 
-		if(strchr("+-*/()<>;={}&,[]", *p)){
-			cur = new_token(TK_RESERVED, cur, p++, 1);
+// 使えるすべての実装でpをトークナイズし、結果が同じか確かめる (--lex-check)
+bool lex_check(char *p, FILE *out){
+	Scanner *saved = scanner;
+	Token *ref = NULL;
+	bool ok = true;
+
+	for(int i = 0; i < NUM_SCANNERS; i++){
+		if(!scanner_supported(&scanners[i])){
+			fprintf(out, "%s: skipped (not supported)\n", scanners[i].name);
 			continue;
 		}
+		scanner = &scanners[i];
+		Token *toks = tokenize(p);
+		if(!ref){
+			ref = toks;
+		}
 
-        if(isalpha(*p)){
-			char *p_begin = p;
-			int len = 0;
-			while(is_alnum(*p)){
-				len++;
-				p++;
+		long n = 0;
+		Token *a = ref, *b = toks;
+		for(; a && b; a = a->next, b = b->next, n++){
+			if(a->kind != b->kind || a->str != b->str || a->len != b->len || a->val != b->val){
+				break;
 			}
-            cur = new_token(TK_IDENT, cur, p_begin, len);
-            continue;
-        }
-
-		if(isdigit(*p)){
-			cur = new_token(TK_NUM, cur, p, 0);
-			char *p_begin = p;
-			cur->val = strtol(p, &p, 10);
-			cur->len = p - p_begin;
-			continue;
 		}
-
-		error_at(p, "トークナイズできません。");
+		if(a || b){
+			fprintf(out, "%s: token %ld differs from %s\n", scanners[i].name, n, scanners[0].name);
+			ok = false;
+		}
+		else{
+			fprintf(out, "%s: %ld tokens ok\n", scanners[i].name, n);
+		}
 	}
 
-	new_token(TK_EOF, cur, p, 0);
-	return head.next;
+	scanner = saved;
+	return ok;
 }
@@ -9,7 +9,7 @@ bool is_integer(Type *ty){
 }
 
 Type *pointer_to(Type *base){
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc(&type_arena, sizeof(Type));
     ty->kind = TY_PTR;
     ty->base = base;
     ty->size = 8;
@@ -17,7 +17,7 @@ Type *pointer_to(Type *base){
 }
 
 Type *array_of(Type *base, int array_len){
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc(&type_arena, sizeof(Type));
     ty->kind = TY_ARRAY;
     ty->size = array_len * base->size;
     ty->base = base;
@@ -25,58 +25,66 @@ Type *array_of(Type *base, int array_len){
     return ty;
 }
 
-void add_type(Node *node){
-    if(!node || node->ty){
+// 左辺値になれるノードか
+static bool is_lvalue(NodeId node){
+    return ast.kind[node] == ND_LVAR || ast.kind[node] == ND_DEREF;
+}
+
+// まだ型の付いていないノードに型を付ける。子は親より番号が小さいので、
+// 番号順に1回なめれば子の型は先に決まっている。
+void add_type(void){
+    if(ast.ntyped == ast.len){
         return;
     }
+    phase_push(PH_TYPE);
 
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->inc);
-
-    for(Node *n = node->body; n; n = n->next){
-        add_type(n);
-    }
-    for(Node *n = node->args; n; n = n->next){
-        add_type(n);
-    }
+    for(NodeId node = ast.ntyped; node < ast.len; node++){
+        int lhs = ast.lhs[node];
 
-    switch(node->kind){
-    case ND_ADD:
-    case ND_SUB:
-    case ND_PTR_DIFF:
-    case ND_MUL:
-    case ND_DIV:
-    case ND_EQ:
-    case ND_NE:
-    case ND_LT:
-    case ND_LE:
-    case ND_FUNCCALL:
-    case ND_NUM:
-        node->ty = int_type;
-        return;
-    case ND_PTR_ADD:
-    case ND_PTR_SUB:
-    case ND_ASSIGN:
-        node->ty = node->lhs->ty;
-        return;
-    case ND_LVAR:
-        node->ty = node->lvar->ty;
-        return;
-    case ND_ADDR:
-        node->ty = pointer_to(node->lhs->ty);
-        return;
-    case ND_DEREF:
-        if(node->lhs->ty->kind == TY_PTR){
-            node->ty = node->lhs->ty->base;
-        }
-        else{
-            node->ty = int_type;
+        switch(ast.kind[node]){
+        case ND_ADD:
+        case ND_SUB:
+        case ND_PTR_DIFF:
+        case ND_MUL:
+        case ND_DIV:
+        case ND_EQ:
+        case ND_NE:
+        case ND_LT:
+        case ND_LE:
+        case ND_FUNCCALL:
+        case ND_NUM:
+            ast.ty[node] = int_type;
+            break;
+        case ND_ASSIGN:
+            if(!is_lvalue(lhs) || ast.ty[lhs]->kind == TY_ARRAY){
+                error("左辺値ではありません");
+            }
+            ast.ty[node] = ast.ty[lhs];
+            break;
+        case ND_PTR_ADD:
+        case ND_PTR_SUB:
+            ast.ty[node] = ast.ty[lhs];
+            break;
+        case ND_LVAR:
+            ast.ty[node] = ast.vars[lhs]->ty;
+            break;
+        case ND_ADDR:
+            if(!is_lvalue(lhs)){
+                error("左辺値ではありません");
+            }
+            ast.ty[node] = pointer_to(ast.ty[lhs]);
+            break;
+        case ND_DEREF:
+            if(ast.ty[lhs]->kind == TY_PTR){
+                ast.ty[node] = ast.ty[lhs]->base;
+            }
+            else{
+                ast.ty[node] = int_type;
+            }
+            break;
         }
     }
-}
 
+    ast.ntyped = ast.len;
+    phase_pop();
+}